@@ -1,6 +1,8 @@
+#define _GNU_SOURCE /* For accept4(2). */
 #define _POSIX_C_SOURCE 200112L
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -11,6 +13,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "chatlib.h"
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+#define HAVE_ACCEPT4
+#endif
 
 /* ======================== Low level networking stuff ==========================
  * Here you will find basic socket stuff that should be part of
@@ -34,14 +45,39 @@ int socketSetNonBlockNoDelay(int fd) {
     return 0;
 }
 
-/* Create a TCP socket listening to 'port' ready to accept connections. */
-int createTCPServer(int port) {
+/* Set the no delay flag of the socket. This is best-effort, errors are
+ * ignored. */
+void socketSetNoDelay(int fd) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+/* Create a TCP socket listening to 'port' ready to accept connections.
+ *
+ * If 'reuseport' is non-zero the socket is created with SO_REUSEPORT:
+ * many sockets can then listen to the same port, and the kernel balances
+ * the incoming connections among them. If the system does not support it
+ * -1 is returned. */
+int createTCPServer(int port, int reuseport) {
     int s, yes = 1;
     struct sockaddr_in sa;
 
     if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); // Best effort.
 
+    if (reuseport) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+            close(s);
+            return -1;
+        }
+#else
+        close(s);
+        errno = ENOPROTOOPT;
+        return -1;
+#endif
+    }
+
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
@@ -63,6 +99,39 @@ int createTCPServer(int port) {
  * and the connect() attempt will not block as well, but the socket
  * may not be immediately ready for writing. */
 int TCPConnect(char *addr, int port, int nonblock) {
+    return TCPConnectFrom(addr, port, NULL, nonblock);
+}
+
+/* Bind the socket 's' of the given family to the local address 'source'
+ * (any port). Returns 0 on success, -1 on error. */
+static int bindSource(int s, int family, char *source) {
+    struct addrinfo hints, *info;
+    int retval;
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(source,NULL,&hints,&info) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    /* Let connect(2) pick the port: then it only has to be unique for the
+     * destination, not among all the sockets bound to 'source'. */
+    int yes = 1;
+    setsockopt(s, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+#endif
+    retval = bind(s,info->ai_addr,info->ai_addrlen);
+    freeaddrinfo(info);
+    return retval;
+}
+
+/* Like TCPConnect(), but if 'source' is not NULL the connection is made
+ * from this local address. Every local address has its own set of
+ * ephemeral ports, so this is how a client opens more connections to the
+ * same server than there are ephemeral ports. */
+int TCPConnectFrom(char *addr, int port, char *source, int nonblock) {
     int s, retval = -1;
     struct addrinfo hints, *servinfo, *p;
 
@@ -87,11 +156,19 @@ int TCPConnect(char *addr, int port, int nonblock) {
             break;
         }
 
+        if (source && bindSource(s, p->ai_family, source) == -1) {
+            close(s);
+            continue;
+        }
+
         /* Try to connect. */
         if (connect(s,p->ai_addr,p->ai_addrlen) == -1) {
             /* If the socket is non-blocking, it is ok for connect() to
              * return an EINPROGRESS error here. */
-            if (errno == EINPROGRESS && nonblock) return s;
+            if (errno == EINPROGRESS && nonblock) {
+                retval = s;
+                break;
+            }
 
             /* Otherwise it's an error. */
             close(s);
@@ -110,14 +187,23 @@ int TCPConnect(char *addr, int port, int nonblock) {
 
 /* If the listening socket signaled there is a new connection ready to
  * be accepted, we accept(2) it and return -1 on error or the new client
- * socket on success. */
+ * socket on success. The socket is returned already non blocking, close
+ * on exec and with no delay: where accept4(2) is available the first two
+ * come with the accept itself, saving two fcntl(2) calls per client.
+ * With a non blocking listening socket errno is EAGAIN when there is
+ * nothing left to accept. */
 int acceptClient(int server_socket) {
     int s;
 
     while(1) {
         struct sockaddr_in sa;
         socklen_t slen = sizeof(sa);
+#ifdef HAVE_ACCEPT4
+        s = accept4(server_socket,(struct sockaddr*)&sa,&slen,
+                    SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
         s = accept(server_socket,(struct sockaddr*)&sa,&slen);
+#endif
         if (s == -1) {
             if (errno == EINTR)
                 continue; /* Try again. */
@@ -126,9 +212,400 @@ int acceptClient(int server_socket) {
         }
         break;
     }
+
+#ifdef HAVE_ACCEPT4
+    socketSetNoDelay(s);
+#else
+    if (socketSetNonBlockNoDelay(s) == -1) {
+        close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+#endif
     return s;
 }
 
+/* Create a UNIX domain socket listening at 'path', of the SOCK_SEQPACKET
+ * type: the messages keep their boundaries, and can be used to pass
+ * descriptors (see sendWithFd()). A stale socket file left at 'path' is
+ * replaced. The socket is non blocking and close on exec. Returns -1 on
+ * error. */
+int createUnixServer(const char *path) {
+    int s;
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) return -1;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+
+    if (bind(s,(struct sockaddr*)&sa,sizeof(sa)) == -1 ||
+        listen(s, 16) == -1 ||
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+}
+
+/* Connect a blocking SOCK_SEQPACKET socket to the UNIX domain socket at
+ * 'path'. Returns the socket, or -1 on error (ENOENT or ECONNREFUSED if
+ * nobody listens there). */
+int unixConnect(const char *path) {
+    int s;
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((s = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) return -1;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if (connect(s,(struct sockaddr*)&sa,sizeof(sa)) == -1) {
+        int saved_errno = errno;
+        close(s);
+        errno = saved_errno;
+        return -1;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    return s;
+}
+
+/* Send the message 'buf' of 'len' bytes on the UNIX domain socket 's',
+ * passing along a duplicate of the descriptor 'fd' (SCM_RIGHTS), unless
+ * it is -1. Returns the bytes sent or -1 on error, like send(2). */
+ssize_t sendWithFd(int s, const void *buf, size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t retval;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(&control,0,sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    do {
+        retval = sendmsg(s, &msg, 0);
+    } while (retval == -1 && errno == EINTR);
+    return retval;
+}
+
+/* Receive a message sent with sendWithFd(). '*fd' is set to the
+ * descriptor passed along with it (close on exec), or to -1. Returns the
+ * bytes received, 0 at end of stream, or -1 on error; a message longer
+ * than 'len' is an error (EMSGSIZE). */
+ssize_t recvWithFd(int s, void *buf, size_t len, int *fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t retval;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fd = -1;
+#ifdef MSG_CMSG_CLOEXEC
+    int flags = MSG_CMSG_CLOEXEC;
+#else
+    int flags = 0;
+#endif
+    do {
+        retval = recvmsg(s, &msg, flags);
+    } while (retval == -1 && errno == EINTR);
+    if (retval == -1) return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+        fcntl(*fd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+    if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return retval;
+}
+
+/* ================================== TLS ======================================
+ * TLS termination for the accepted sockets. The handshake and the record
+ * layer are done by OpenSSL, but as soon as the session keys are known
+ * they are handed to the kernel (kTLS, the "tls" TCP upper layer protocol)
+ * when it supports that: the socket then encrypts what is written to it,
+ * so the caller can keep using plain write(2)/writev(2), and the same
+ * unencrypted message buffer can be sent to many clients. When the kernel
+ * can't take a direction over, that direction goes through tlsRead() and
+ * tlsWritev(), that work like their system call counterparts.
+ *
+ * The server is compiled with TLS support with "make TLS=1".
+ * =========================================================================== */
+
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static SSL_CTX *TlsCtx;
+
+/* Log the OpenSSL error queue, after the message 'what'. */
+static void tlsPrintErrors(const char *what) {
+    unsigned long err;
+    char buf[256];
+
+    fprintf(stderr, "TLS: %s\n", what);
+    while ((err = ERR_get_error()) != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        fprintf(stderr, "  %s\n", buf);
+    }
+}
+
+/* Set up the server side TLS context, with the certificate chain in the
+ * PEM file 'cert' and its private key in 'key'. Returns 0 on success,
+ * -1 on error (the error is logged to standard error). Must be called
+ * once, before the first tlsAccept(). */
+int tlsInit(const char *cert, const char *key) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        tlsPrintErrors("can't create the context");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    /* Partial writes and moving buffers let tlsWritev() work like
+     * writev(2) on top of an output queue: after a short write, the
+     * next call starts from the first byte not written, wherever it is.
+     * Idle connections, the vast majority, release their record buffers. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        tlsPrintErrors("can't load the certificate");
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        tlsPrintErrors("can't load the private key");
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    TlsCtx = ctx;
+    return 0;
+}
+
+/* Start the server side of a TLS session on the connected socket 'fd'.
+ * The handshake is then driven by tlsHandshake(). Returns NULL on error.
+ * The socket is not owned by the session: tlsFree() does not close it. */
+struct tlsConn *tlsAccept(int fd) {
+    SSL *ssl = SSL_new(TlsCtx);
+    if (ssl == NULL) return NULL;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return (struct tlsConn*)ssl;
+}
+
+/* Make progress with the handshake of a non blocking socket. Returns
+ * TLS_DONE once it is completed, TLS_WANT_READ or TLS_WANT_WRITE when it
+ * must be called again once the socket is readable or writable, and
+ * TLS_ERR if the handshake failed. */
+int tlsHandshake(struct tlsConn *t) {
+    SSL *ssl = (SSL*)t;
+
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if (ret == 1) return TLS_DONE;
+    switch(SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ: return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE: return TLS_WANT_WRITE;
+    default: return TLS_ERR;
+    }
+}
+
+/* Return non zero if, after the handshake, the kernel encrypts what is
+ * written to the socket: the socket can then be written directly. */
+int tlsKernelSend(struct tlsConn *t) {
+    return BIO_get_ktls_send(SSL_get_wbio((SSL*)t)) > 0;
+}
+
+/* Return non zero if the kernel decrypts what is read from the socket. */
+int tlsKernelRecv(struct tlsConn *t) {
+    return BIO_get_ktls_recv(SSL_get_rbio((SSL*)t)) > 0;
+}
+
+/* Return the name of the negotiated protocol version and cipher, in the
+ * form "TLSv1.3 TLS_AES_128_GCM_SHA256". */
+const char *tlsDescription(struct tlsConn *t) {
+    static __thread char buf[128];
+    SSL *ssl = (SSL*)t;
+
+    snprintf(buf, sizeof(buf), "%s %s", SSL_get_version(ssl),
+             SSL_get_cipher_name(ssl));
+    return buf;
+}
+
+/* Turn the error of the last OpenSSL I/O call into the read(2)/write(2)
+ * convention: -1 with errno set, or 0 at end of stream. */
+static ssize_t tlsIOError(SSL *ssl, int ret) {
+    switch(SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        /* errno is set, unless the peer closed without a close notify. */
+        if (errno == 0) return 0;
+        return -1;
+    default:
+        errno = EIO;
+        return -1;
+    }
+}
+
+/* Like read(2) on the decrypted stream. A call returns at most the
+ * content of one record: using a buffer of TLS_MAX_RECORD bytes, nothing
+ * is left in the library buffers, so the readiness of the socket always
+ * tells if there is more to read. */
+ssize_t tlsRead(struct tlsConn *t, void *buf, size_t len) {
+    SSL *ssl = (SSL*)t;
+
+    if (len > INT_MAX) len = INT_MAX;
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(ssl, buf, len);
+    if (ret > 0) return ret;
+    return tlsIOError(ssl, ret);
+}
+
+/* Like writev(2), encrypting the data. Up to TLS_MAX_RECORD bytes are
+ * written per call, coalesced in a single record. After a -1 return with
+ * EAGAIN the next call must start from the same data (that may be moved
+ * in memory, and may be followed by more data). */
+ssize_t tlsWritev(struct tlsConn *t, const struct iovec *iov, int iovcnt) {
+    SSL *ssl = (SSL*)t;
+    char buf[TLS_MAX_RECORD];
+    size_t len = 0;
+
+    for (int j = 0; j < iovcnt && len < sizeof(buf); j++) {
+        size_t n = iov[j].iov_len;
+        if (n > sizeof(buf)-len) n = sizeof(buf)-len;
+        memcpy(buf+len, iov[j].iov_base, n);
+        len += n;
+    }
+    if (len == 0) return 0;
+
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(ssl, buf, len);
+    if (ret > 0) return ret;
+    ssize_t res = tlsIOError(ssl, ret);
+    if (res == 0) {
+        errno = EPIPE;
+        res = -1;
+    }
+    return res;
+}
+
+/* Free the session. The socket is left open, and if the kernel took the
+ * session over, it keeps working with no need for the library. */
+void tlsFree(struct tlsConn *t) {
+    SSL_free((SSL*)t);
+}
+
+#else /* !USE_TLS */
+
+int tlsInit(const char *cert, const char *key) {
+    (void)cert; (void)key;
+    fprintf(stderr, "TLS: not supported by this build (use make TLS=1)\n");
+    return -1;
+}
+
+struct tlsConn *tlsAccept(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+int tlsHandshake(struct tlsConn *t) {
+    (void)t;
+    return TLS_ERR;
+}
+
+int tlsKernelSend(struct tlsConn *t) {
+    (void)t;
+    return 0;
+}
+
+int tlsKernelRecv(struct tlsConn *t) {
+    (void)t;
+    return 0;
+}
+
+const char *tlsDescription(struct tlsConn *t) {
+    (void)t;
+    return "none";
+}
+
+ssize_t tlsRead(struct tlsConn *t, void *buf, size_t len) {
+    (void)t; (void)buf; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tlsWritev(struct tlsConn *t, const struct iovec *iov, int iovcnt) {
+    (void)t; (void)iov; (void)iovcnt;
+    errno = ENOTSUP;
+    return -1;
+}
+
+void tlsFree(struct tlsConn *t) {
+    (void)t;
+}
+#endif
+
 /* We also define an allocator that always crashes on out of memory: you
  * will discover that in most programs designed to run for a long time, that
  * are not libraries, trying to recover from out of memory is often futile
@@ -152,6 +629,91 @@ void *chatRealloc(void *ptr, size_t size) {
     return ptr;
 }
 
+/* ============================= Slab allocator ================================
+ * Objects allocated and freed at high rate, like the clients during a
+ * reconnect storm, come from a pool of fixed size slots. Slabs are never
+ * returned to the system while the pool is in use: a freed object goes in
+ * the free list, and is the first to be reused.
+ * =========================================================================== */
+
+/* Slab objects are aligned like the most demanding basic type. */
+#define SLAB_ALIGN (sizeof(long double) > sizeof(void*) ? \
+                    sizeof(long double) : sizeof(void*))
+
+/* Initialize an empty pool of objects of 'objsize' bytes. Slabs of
+ * 'objs_per_slab' objects are allocated on demand. */
+void slabInit(struct slabPool *pool, size_t objsize, int objs_per_slab) {
+    objsize = (objsize + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    pool->objsize = objsize;
+    pool->objs_per_slab = objs_per_slab > 0 ? objs_per_slab : 1;
+    pool->freelist = NULL;
+    pool->slabs = NULL;
+    pool->used = 0;
+    pool->capacity = 0;
+}
+
+/* Free all the slabs of the pool. Every object allocated from it becomes
+ * invalid. */
+void slabRelease(struct slabPool *pool) {
+    struct slab *sl = pool->slabs;
+
+    while (sl) {
+        struct slab *next = sl->next;
+        free(sl);
+        sl = next;
+    }
+    slabInit(pool, pool->objsize, pool->objs_per_slab);
+}
+
+/* Get an object from the pool. The content is undefined. */
+void *slabAlloc(struct slabPool *pool) {
+    if (pool->freelist == NULL) {
+        /* Empty free list: carve a new slab. The header is padded so that
+         * the objects keep the SLAB_ALIGN alignment. */
+        size_t hdrsize = (sizeof(struct slab) + SLAB_ALIGN - 1) &
+                         ~(SLAB_ALIGN - 1);
+        struct slab *sl = chatMalloc(hdrsize +
+                                     pool->objsize*pool->objs_per_slab);
+        char *obj = (char*)sl + hdrsize;
+
+        sl->next = pool->slabs;
+        pool->slabs = sl;
+        for (int j = 0; j < pool->objs_per_slab; j++) {
+            *(void**)obj = pool->freelist;
+            pool->freelist = obj;
+            obj += pool->objsize;
+        }
+        pool->capacity += pool->objs_per_slab;
+    }
+
+    void *obj = pool->freelist;
+    pool->freelist = *(void**)obj;
+    pool->used++;
+    return obj;
+}
+
+/* Return an object to the pool. */
+void slabFree(struct slabPool *pool, void *obj) {
+    *(void**)obj = pool->freelist;
+    pool->freelist = obj;
+    pool->used--;
+}
+
+/* Return the time in microseconds from an arbitrary point in the past.
+ * The clock is monotonic: it is meant to measure intervals and deadlines,
+ * and is not affected by changes of the system date. */
+long long ustime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/* Like ustime(), but in milliseconds. */
+long long mstime(void) {
+    return ustime()/1000;
+}
+
 /* A read(2) wrapper which limits the number of bytes read. */
 ssize_t limitedRead(int fd, void *buf, size_t count, size_t limit) {
     ssize_t retval = read(fd, buf, count < limit ? count : limit);
@@ -1,16 +1,72 @@
 #ifndef CHATLIB_H
 #define CHATLIB_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 /* Networking. */
-int createTCPServer(int port);
+int createTCPServer(int port, int reuseport);
 int socketSetNonBlockNoDelay(int fd);
+void socketSetNoDelay(int fd);
 int acceptClient(int server_socket);
 int TCPConnect(char *addr, int port, int nonblock);
+int TCPConnectFrom(char *addr, int port, char *source, int nonblock);
+int createUnixServer(const char *path);
+int unixConnect(const char *path);
+ssize_t sendWithFd(int s, const void *buf, size_t len, int fd);
+ssize_t recvWithFd(int s, void *buf, size_t len, int *fd);
+
+/* TLS. A session is driven on a non blocking socket: tlsHandshake()
+ * returns what the socket must wait for, and after the handshake the
+ * tlsKernel*() calls tell which directions the kernel took over: the
+ * others go through tlsRead() and tlsWritev(). */
+#define TLS_MAX_RECORD 16384 /* Biggest plaintext of a TLS record. */
+
+#define TLS_DONE 0
+#define TLS_WANT_READ 1
+#define TLS_WANT_WRITE 2
+#define TLS_ERR -1
+
+struct tlsConn;
+int tlsInit(const char *cert, const char *key);
+struct tlsConn *tlsAccept(int fd);
+int tlsHandshake(struct tlsConn *t);
+int tlsKernelSend(struct tlsConn *t);
+int tlsKernelRecv(struct tlsConn *t);
+const char *tlsDescription(struct tlsConn *t);
+ssize_t tlsRead(struct tlsConn *t, void *buf, size_t len);
+ssize_t tlsWritev(struct tlsConn *t, const struct iovec *iov, int iovcnt);
+void tlsFree(struct tlsConn *t);
 
 /* Allocation. */
 void *chatMalloc(size_t size);
 void *chatRealloc(void *ptr, size_t size);
 
+/* Fixed size object pool. Objects are carved out of big slabs and
+ * recycled through a free list, so allocating and freeing them never
+ * calls the general purpose allocator once the pool is warm. */
+struct slab {
+    struct slab *next;
+};
+
+struct slabPool {
+    size_t objsize;     // Size of each object (at least a pointer).
+    int objs_per_slab;  // Objects allocated at once when the pool is empty.
+    void *freelist;     // Free objects, linked through their first word.
+    struct slab *slabs; // All the slabs, to release them.
+    size_t used;        // Objects currently allocated.
+    size_t capacity;    // Objects available in all the slabs.
+};
+
+void slabInit(struct slabPool *pool, size_t objsize, int objs_per_slab);
+void slabRelease(struct slabPool *pool);
+void *slabAlloc(struct slabPool *pool);
+void slabFree(struct slabPool *pool, void *obj);
+
+/* Time. */
+long long ustime(void);
+long long mstime(void);
+
 /* Testing. */
 ssize_t limitedRead(int fd, void *buf, size_t count, size_t limit);
 
@@ -0,0 +1,540 @@
+/* circbuf-test.c -- Fuzzer and microbenchmarks for the circular buffer.
+ *
+ * Copyright (c) 2025, vitoloper
+ *
+ * "circbuf-test fuzz [iterations] [seed]" runs random sequences of
+ * operations against both a Circbuf and a naive reference queue (a flat
+ * array, shifted with memmove), and fails at the first difference.
+ *
+ * "circbuf-test bench" measures push/pop throughput, wraparound heavy
+ * bulk copies and the framing path of the server, bytes in -> messages
+ * out, for lines and binary frames of different size distributions. The
+ * framing runs the splitting loops of frame.c, shared with the server.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the project name of nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "chatlib.h"
+#include "circular_buffer.h"
+#include "frame.h"
+
+#define FUZZ_MAX_SIZE 4096  /* Largest buffer the fuzzer grows to. */
+#define FUZZ_OPS 2000       /* Operations of every fuzzer iteration. */
+#define BENCH_STREAM (16*1024*1024) /* Bytes of input of every benchmark. */
+#define BENCH_READ 16384    /* Bytes "read from the socket" at once. */
+
+uint64_t RandState;
+
+/* xorshift64*, so runs are reproducible from the seed everywhere. */
+uint64_t rnd(void) {
+    RandState ^= RandState >> 12;
+    RandState ^= RandState << 25;
+    RandState ^= RandState >> 27;
+    return RandState * 2685821657736338717ULL;
+}
+
+int rndRange(int n) {
+    return n ? (int)(rnd() % n) : 0;
+}
+
+/* ================================= Fuzzer ================================= */
+
+/* The reference: a flat array holding the elements oldest first. */
+struct refQueue {
+    char data[FUZZ_MAX_SIZE];
+    int len;
+    int size;
+};
+
+void refPush(struct refQueue *q, const char *src, int n) {
+    memcpy(q->data + q->len, src, n);
+    q->len += n;
+}
+
+void refPop(struct refQueue *q, char *dest, int n) {
+    if (dest) memcpy(dest, q->data, n);
+    memmove(q->data, q->data + n, q->len - n);
+    q->len -= n;
+}
+
+int FuzzIteration;
+int FuzzOp;
+
+void fuzzFail(const char *what) {
+    fprintf(stderr, "FUZZ FAILURE at iteration %d, operation %d: %s\n",
+            FuzzIteration, FuzzOp, what);
+    exit(1);
+}
+
+#define fuzzAssert(cond) do { if (!(cond)) fuzzFail(#cond); } while(0)
+
+/* Check that cb stores exactly what the reference does. */
+void fuzzCheck(struct Circbuf *cb, struct refQueue *q) {
+    struct iovec iov[2];
+    int iovcnt = circbuf_read_iov(cb, iov), seen = 0;
+
+    fuzzAssert(circbuf_len(cb) == q->len);
+    fuzzAssert(circbuf_size(cb) == q->size);
+    fuzzAssert(circbuf_space_left(cb) == q->size - q->len);
+    for (int j = 0; j < iovcnt; j++) {
+        fuzzAssert(memcmp(iov[j].iov_base, q->data + seen,
+                          iov[j].iov_len) == 0);
+        seen += iov[j].iov_len;
+    }
+    fuzzAssert(seen == q->len);
+}
+
+/* Random bytes, with plenty of separators for the searches. */
+void fuzzFill(char *buf, int n) {
+    for (int j = 0; j < n; j++)
+        buf[j] = rndRange(8) == 0 ? '\n' : 'a' + rndRange(26);
+}
+
+void fuzzOne(void) {
+    char storage[64], tmp[FUZZ_MAX_SIZE*2], tmp2[FUZZ_MAX_SIZE*2];
+    struct Circbuf cb;
+    struct refQueue q;
+    int storage_size = 1 << rndRange(7); /* 1 to 64 bytes. */
+
+    circbuf_init(&cb, storage, storage_size);
+    q.len = 0;
+    q.size = storage_size;
+
+    /* Start with the free running indices close to wrapping around
+     * 2^32, one of the cases that matter the most. */
+    unsigned int start = rndRange(2) ? 0u - (unsigned int)rndRange(5000) :
+                                       (unsigned int)rnd();
+    cb.read_idx = cb.write_idx = start;
+
+    for (FuzzOp = 0; FuzzOp < FUZZ_OPS; FuzzOp++) {
+        int space = q.size - q.len;
+        int n, got;
+        char c, *ptr;
+        struct iovec iov[2];
+
+        switch(rndRange(13)) {
+        case 0: /* push */
+            c = 'a' + rndRange(26);
+            got = circbuf_push(&cb, c);
+            fuzzAssert(got == (space > 0));
+            if (got) refPush(&q, &c, 1);
+            break;
+        case 1: /* pop */
+            got = circbuf_pop(&cb, &c);
+            fuzzAssert(got == (q.len > 0));
+            if (got) {
+                fuzzAssert(c == q.data[0]);
+                refPop(&q, NULL, 1);
+            }
+            break;
+        case 2: /* push_from_linear */
+            n = rndRange(q.size*2+1);
+            fuzzFill(tmp, n);
+            got = circbuf_push_from_linear(&cb, tmp, n);
+            fuzzAssert(got == (n < space ? n : space));
+            refPush(&q, tmp, got);
+            break;
+        case 3: /* pop_to_linear */
+            n = rndRange(q.size*2+1);
+            got = circbuf_pop_to_linear(tmp, &cb, n);
+            fuzzAssert(got == (n < q.len ? n : q.len));
+            refPop(&q, tmp2, got);
+            fuzzAssert(memcmp(tmp, tmp2, got) == 0);
+            break;
+        case 4: /* peek_to_linear */
+            n = rndRange(q.size*2+1);
+            got = circbuf_peek_to_linear(tmp, &cb, n);
+            fuzzAssert(got == (n < q.len ? n : q.len));
+            fuzzAssert(memcmp(tmp, q.data, got) == 0);
+            break;
+        case 5: /* write_span + commit */
+            got = circbuf_write_span(&cb, &ptr);
+            fuzzAssert(got <= space && (got > 0 || space == 0));
+            n = rndRange(got+1);
+            fuzzFill(ptr, n);
+            refPush(&q, ptr, n);
+            circbuf_commit(&cb, n);
+            break;
+        case 6: /* read_span + consume */
+            got = circbuf_read_span(&cb, &ptr);
+            fuzzAssert(got <= q.len && (got > 0 || q.len == 0));
+            fuzzAssert(memcmp(ptr, q.data, got) == 0);
+            n = rndRange(got+1);
+            circbuf_consume(&cb, n);
+            refPop(&q, NULL, n);
+            break;
+        case 7: /* write_iov + commit, like a readv(2) */
+            got = circbuf_write_iov(&cb, iov);
+            n = 0;
+            for (int j = 0; j < got; j++) n += iov[j].iov_len;
+            fuzzAssert(n == space);
+            n = rndRange(space+1);
+            for (int j = 0, left = n; j < got && left; j++) {
+                int chunk = (int)iov[j].iov_len < left ? (int)iov[j].iov_len
+                                                       : left;
+                fuzzFill(iov[j].iov_base, chunk);
+                refPush(&q, iov[j].iov_base, chunk);
+                left -= chunk;
+            }
+            circbuf_commit(&cb, n);
+            break;
+        case 8: /* index */
+            c = rndRange(2) ? '\n' : 'a' + rndRange(26);
+            got = circbuf_index(&cb, c);
+            ptr = memchr(q.data, c, q.len);
+            fuzzAssert(got == (ptr ? ptr - q.data : -1));
+            break;
+        case 9: { /* find_all */
+            int pos[FRAME_SEP_BATCH], from = rndRange(q.len+1);
+            int max = 1 + rndRange(FRAME_SEP_BATCH);
+            got = circbuf_find_all(&cb, from, '\n', pos, max);
+            n = 0;
+            for (int j = from; j < q.len && n < max; j++) {
+                if (q.data[j] != '\n') continue;
+                fuzzAssert(n < got && pos[n] == j);
+                n++;
+            }
+            fuzzAssert(got == n);
+            break;
+        }
+        case 10: /* resize */
+            n = 1 + rndRange(FUZZ_MAX_SIZE);
+            got = circbuf_resize(&cb, n);
+            {
+                int newsize = 1;
+                while (newsize < n) newsize <<= 1;
+
+                if (newsize == q.size) {
+                    fuzzAssert(got);
+                } else if (newsize < q.len) {
+                    fuzzAssert(!got);
+                } else {
+                    /* Small sizes use the embedded storage, whole. */
+                    fuzzAssert(got);
+                    q.size = newsize < storage_size ? storage_size : newsize;
+                }
+            }
+            break;
+        case 11: /* empty */
+            if (rndRange(8)) break;
+            circbuf_empty(&cb);
+            q.len = 0;
+            break;
+        case 12: /* grow by doubling, like the server */
+            if (q.size*2 <= FUZZ_MAX_SIZE && rndRange(4) == 0) {
+                fuzzAssert(circbuf_resize(&cb, q.size*2));
+                q.size *= 2;
+            }
+            break;
+        }
+        fuzzCheck(&cb, &q);
+    }
+    circbuf_deinit(&cb);
+}
+
+int fuzz(int iterations) {
+    for (FuzzIteration = 0; FuzzIteration < iterations; FuzzIteration++)
+        fuzzOne();
+    printf("fuzz: %d iterations of %d operations OK\n",
+           iterations, FUZZ_OPS);
+    return 0;
+}
+
+/* =============================== Benchmarks =============================== */
+
+/* Sum of the bytes handed to the consumer, so that the compiler can't
+ * drop the work, and the framing benchmarks can check their output. */
+unsigned long long Sink;
+
+void benchReport(const char *name, long long us, long long bytes,
+                 long long msgs)
+{
+    double ns = us * 1000.0;
+    printf("  %-36s %8.3f ns/byte", name, bytes ? ns/bytes : 0);
+    if (msgs) printf(" %9.2f ns/msg %8.1f Mmsg/s", ns/msgs, msgs/(double)us);
+    printf("\n");
+}
+
+/* One byte at a time, alternating push and pop (the buffer stays almost
+ * empty), then filling and draining the whole buffer. */
+void benchPushPop(void) {
+    struct Circbuf *cb = circbuf_alloc(4096);
+    long long n = BENCH_STREAM, start;
+    char c = 0;
+
+    start = ustime();
+    for (long long j = 0; j < n; j++) {
+        circbuf_push(cb, (char)j);
+        circbuf_pop(cb, &c);
+        Sink += c;
+    }
+    benchReport("push+pop, 1 byte", ustime()-start, n, 0);
+
+    start = ustime();
+    for (long long j = 0; j < n; j += 4096) {
+        for (int k = 0; k < 4096; k++) circbuf_push(cb, (char)k);
+        for (int k = 0; k < 4096; k++) { circbuf_pop(cb, &c); Sink += c; }
+    }
+    benchReport("fill+drain, 1 byte", ustime()-start, n, 0);
+    circbuf_free(cb);
+}
+
+/* Bulk copies whose sizes don't divide the buffer size, so that most of
+ * them wrap around the end of it. */
+void benchBulk(void) {
+    static const int chunks[] = {7, 100, 1000, 3000};
+    struct Circbuf *cb = circbuf_alloc(4096);
+    char src[4096], dst[4096];
+
+    memset(src, 'x', sizeof(src));
+    for (size_t j = 0; j < sizeof(chunks)/sizeof(*chunks); j++) {
+        int chunk = chunks[j];
+        long long n = 0, start = ustime();
+
+        while (n < BENCH_STREAM) {
+            circbuf_push_from_linear(cb, src, chunk);
+            circbuf_pop_to_linear(dst, cb, chunk);
+            Sink += dst[0];
+            n += chunk;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "push+pop linear, %d bytes", chunk);
+        benchReport(name, ustime()-start, n, 0);
+    }
+    circbuf_free(cb);
+}
+
+/* Message size distributions for the framing benchmarks. */
+struct sizeDist {
+    const char *name;
+    int min, max;       // Uniform in [min,max]...
+    int large;          // ...or this size, one time every 'large_every'.
+    int large_every;
+};
+
+struct sizeDist Dists[] = {
+    {"16 bytes", 16, 16, 0, 0},
+    {"256 bytes", 256, 256, 0, 0},
+    {"uniform 1-1024", 1, 1024, 0, 0},
+    {"bimodal 32/2048", 32, 32, 2048, 10},
+    {"4096 bytes", 4096, 4096, 0, 0},
+};
+
+int distSize(struct sizeDist *d) {
+    if (d->large_every && rndRange(d->large_every) == 0) return d->large;
+    return d->min + rndRange(d->max - d->min + 1);
+}
+
+/* Build the input stream of a benchmark: messages drawn from 'd', each
+ * one made of 'x' bytes, as lines (binary == 0) or frames. Returns the
+ * stream length, and sets *msgs and *payload. */
+size_t makeStream(char *stream, struct sizeDist *d, int binary,
+                  long long *msgs, unsigned long long *payload)
+{
+    size_t len = 0;
+
+    *msgs = 0;
+    *payload = 0;
+    while (1) {
+        int size = distSize(d);
+        unsigned char hdr[FRAME_MAX_HEADER];
+        int hdrlen = binary ? frame_encode_header(hdr, size, FRAME_MSG) : 0;
+        if (len + hdrlen + size + 1 > BENCH_STREAM) break;
+
+        memcpy(stream+len, hdr, hdrlen); len += hdrlen;
+        memset(stream+len, 'x', size); len += size;
+        if (!binary) stream[len++] = '\n';
+        (*msgs)++;
+        *payload += size;
+    }
+    return len;
+}
+
+/* Feed the stream to a read buffer BENCH_READ bytes at a time, as readv(2)
+ * would, growing it when full. Returns the bytes fed. */
+int feed(struct Circbuf *cb, const char *stream, size_t len, size_t *fed) {
+    struct iovec iov[2];
+    int iovcnt = circbuf_write_iov(cb, iov), n = 0;
+
+    if (iovcnt == 0) {
+        circbuf_resize(cb, circbuf_size(cb)*2);
+        iovcnt = circbuf_write_iov(cb, iov);
+    }
+    for (int j = 0; j < iovcnt && *fed < len && n < BENCH_READ; j++) {
+        size_t chunk = iov[j].iov_len;
+        if (chunk > len - *fed) chunk = len - *fed;
+        if (chunk > (size_t)(BENCH_READ - n)) chunk = BENCH_READ - n;
+        memcpy(iov[j].iov_base, stream + *fed, chunk);
+        *fed += chunk;
+        n += chunk;
+    }
+    circbuf_commit(cb, n);
+    return n;
+}
+
+/* State of a framing benchmark, passed to the splitting callbacks. */
+struct framingState {
+    struct Circbuf *cb;
+    char *msg;
+    long long *msgs;
+    unsigned long long *payload;
+};
+
+/* Copy every message out of the buffer, like the server does. */
+int benchLineProc(void *privdata, int len) {
+    struct framingState *fs = privdata;
+
+    circbuf_pop_to_linear(fs->msg, fs->cb, len);
+    Sink += fs->msg[0];
+    (*fs->msgs)++;
+    *fs->payload += len-1;
+    return 1;
+}
+
+int benchFrameProc(void *privdata, int type, int hdrlen, size_t len) {
+    struct framingState *fs = privdata;
+
+    (void)type;
+    circbuf_consume(fs->cb, hdrlen);
+    circbuf_pop_to_linear(fs->msg, fs->cb, len);
+    Sink += fs->msg[0];
+    (*fs->msgs)++;
+    *fs->payload += len;
+    return 1;
+}
+
+/* The line framing path of the server: frame_split_lines() scans for the
+ * separators once, then every message is copied out of the buffer. */
+void frameLines(const char *stream, size_t len, char *msg, long long *msgs,
+                unsigned long long *payload)
+{
+    struct framingState fs = {circbuf_alloc(16), msg, msgs, payload};
+    size_t fed = 0;
+    int scanned = 0;
+
+    while (fed < len) {
+        feed(fs.cb, stream, len, &fed);
+        frame_split_lines(fs.cb, &scanned, '\n', benchLineProc, &fs);
+    }
+    circbuf_free(fs.cb);
+}
+
+/* The binary framing path of the server: frame_split() decodes the
+ * headers, the buffer is grown to fit the whole frame when it is
+ * incomplete, then the payload is copied out. */
+void frameBinary(const char *stream, size_t len, char *msg, long long *msgs,
+                 unsigned long long *payload)
+{
+    struct framingState fs = {circbuf_alloc(16), msg, msgs, payload};
+    size_t fed = 0;
+
+    while (fed < len) {
+        size_t need;
+
+        feed(fs.cb, stream, len, &fed);
+        if (frame_split(fs.cb, BENCH_STREAM, &need, benchFrameProc, &fs) ==
+            FRAME_SPLIT_MORE && (size_t)circbuf_size(fs.cb) < need)
+        {
+            circbuf_resize(fs.cb, need);
+        }
+    }
+    circbuf_free(fs.cb);
+}
+
+int benchFraming(void) {
+    char *stream = chatMalloc(BENCH_STREAM);
+    char *msg = chatMalloc(BENCH_STREAM);
+    int errors = 0;
+
+    for (size_t j = 0; j < sizeof(Dists)/sizeof(*Dists); j++) {
+        for (int binary = 0; binary <= 1; binary++) {
+            long long msgs, gotmsgs = 0;
+            unsigned long long payload, gotpayload = 0;
+            size_t len = makeStream(stream, &Dists[j], binary, &msgs,
+                                    &payload);
+
+            long long start = ustime();
+            if (binary)
+                frameBinary(stream, len, msg, &gotmsgs, &gotpayload);
+            else
+                frameLines(stream, len, msg, &gotmsgs, &gotpayload);
+            long long elapsed = ustime()-start;
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s, %s", binary ? "frames" : "lines",
+                     Dists[j].name);
+            benchReport(name, elapsed, len, gotmsgs);
+            if (gotmsgs != msgs || gotpayload != payload) {
+                fprintf(stderr, "  %s: got %lld messages (%llu bytes), "
+                        "expected %lld (%llu bytes)\n", name, gotmsgs,
+                        gotpayload, msgs, payload);
+                errors++;
+            }
+        }
+    }
+    free(stream);
+    free(msg);
+    return errors != 0;
+}
+
+int bench(void) {
+    printf("push/pop:\n");
+    benchPushPop();
+    printf("bulk copies:\n");
+    benchBulk();
+    printf("framing, bytes in -> messages out:\n");
+    return benchFraming();
+}
+
+/* ================================= Main =================================== */
+
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s fuzz [iterations] [seed]\n"
+                    "       %s bench\n", progname, progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) usage(argv[0]);
+
+    RandState = 0x9e3779b97f4a7c15ULL;
+    if (!strcmp(argv[1], "fuzz") && argc <= 4) {
+        int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+        if (argc > 3) RandState = strtoull(argv[3], NULL, 10) | 1;
+        return fuzz(iterations);
+    } else if (!strcmp(argv[1], "bench") && argc == 2) {
+        return bench();
+    }
+    usage(argv[0]);
+    return 1;
+}
@@ -8,39 +8,120 @@
 #include "circular_buffer.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-/* Allocate circular buffer. */
+/* Vector instructions used by circbuf_find_all(), chosen at compile time
+ * from what the compiler targets (build with -mavx2 or -march=native to
+ * enable AVX2 on x86). Without any of them memchr(3) is used. */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CIRCBUF_SCAN_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CIRCBUF_SCAN_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CIRCBUF_SCAN_NEON
+#endif
+
+/* Round 'n' up to the next power of two. */
+static unsigned int circbuf_next_power(unsigned int n) {
+    unsigned int size = 1;
+
+    while (size < n) size <<= 1;
+    return size;
+}
+
+/* Allocate circular buffer. The size is rounded up to the next power
+ * of two. */
 struct Circbuf *circbuf_alloc(int size) {
     /* Allocate space for struct */
     struct Circbuf *cb = (struct Circbuf *)malloc(sizeof(struct Circbuf));
-    
+    if (cb == NULL) return NULL;
+
     /* Allocate space for buffer and set indices and size. */
-    cb->buf = (char *)malloc(sizeof(char) * size);
+    cb->size = circbuf_next_power(size > 0 ? size : 1);
+    cb->buf = (char *)malloc(sizeof(char) * cb->size);
+    if (cb->buf == NULL) {
+        free(cb);
+        return NULL;
+    }
     cb->write_idx = 0;
     cb->read_idx = 0;
-    cb->size = size;
+    cb->storage = NULL;
+    cb->storage_size = 0;
 
     return cb;
 }
 
 /* Free allocated memory. */
 void circbuf_free(struct Circbuf *cb) {
-    free(cb->buf);
+    circbuf_deinit(cb);
     free(cb);
 }
 
+/* Initialize a circular buffer embedded in some other structure, using
+ * the 'size' bytes at 'storage' (size must be a power of two) as buffer.
+ * This way creating it costs no allocation at all. If the buffer later
+ * grows it moves to the heap, and it moves back to 'storage' when it
+ * shrinks enough. */
+void circbuf_init(struct Circbuf *cb, char *storage, int size) {
+    cb->buf = storage;
+    cb->write_idx = 0;
+    cb->read_idx = 0;
+    cb->size = size;
+    cb->storage = storage;
+    cb->storage_size = size;
+}
+
+/* Release the memory used by a buffer set up with circbuf_init(). */
+void circbuf_deinit(struct Circbuf *cb) {
+    if (cb->buf != cb->storage) free(cb->buf);
+    cb->buf = NULL;
+}
+
+/* Change the buffer size (rounded up to the next power of two), keeping
+ * the stored elements. Returns 1 on success, 0 if the stored elements
+ * would not fit or on out of memory (the buffer is left untouched). */
+int circbuf_resize(struct Circbuf *cb, int size) {
+    unsigned int newsize = circbuf_next_power(size > 0 ? size : 1);
+    unsigned int len = cb->write_idx - cb->read_idx;
+
+    if (newsize == cb->size) return 1;
+    if (newsize < len) return 0;
+
+    /* Use the caller provided storage when the new size fits in it. */
+    char *newbuf;
+    if (cb->storage && newsize <= cb->storage_size) {
+        if (cb->buf == cb->storage) return 1; /* Can't get any smaller. */
+        newbuf = cb->storage;
+        newsize = cb->storage_size;
+    } else {
+        newbuf = (char *)malloc(sizeof(char) * newsize);
+        if (newbuf == NULL) return 0;
+    }
+
+    /* Linearize the stored elements at the start of the new buffer. */
+    circbuf_pop_to_linear(newbuf, cb, len);
+    if (cb->buf != cb->storage) free(cb->buf);
+    cb->buf = newbuf;
+    cb->size = newsize;
+    cb->read_idx = 0;
+    cb->write_idx = len;
+
+    return 1;
+}
+
 /* Insert (push) an element. */
 int circbuf_push(struct Circbuf *cb, char data) {
     /* Check if buffer is full. */
-    if ((cb->write_idx + 1) % (cb->size) == cb->read_idx) {
+    if (cb->write_idx - cb->read_idx == cb->size) {
         return 0;
     }
 
-    /* Write data */
-    cb->buf[cb->write_idx] = data;
-
-    /* Increment write_idx */
-    cb->write_idx = (cb->write_idx + 1) % cb->size;
+    /* Write data and increment write_idx */
+    cb->buf[cb->write_idx & (cb->size - 1)] = data;
+    cb->write_idx++;
 
     return 1;
 }
@@ -52,39 +133,253 @@ int circbuf_pop(struct Circbuf *cb, char *data) {
         return 0;
     }
 
-    /* Read data */
-    *data = cb->buf[cb->read_idx];
-
-    /* Increment read_idx */
-    cb->read_idx = (cb->read_idx + 1) % cb->size;
+    /* Read data and increment read_idx */
+    *data = cb->buf[cb->read_idx & (cb->size - 1)];
+    cb->read_idx++;
 
     return 1;
 }
 
-/* Push n elements from src linear array to cb. */
+/* Push up to n elements from src linear array to cb, with at most two
+ * memcpy() calls (the free space may wrap around the end of buf).
+ * Returns the number of elements pushed. */
 int circbuf_push_from_linear(struct Circbuf *cb, char *src, int n) {
-    int i;
+    int copied = 0;
 
-    for (i = 0; i < n && i < cb->size-1; i++) {
-        /* Push element and check if successful. */
-        if (circbuf_push(cb, src[i]) == 0) return i;
+    while (copied < n) {
+        char *dst;
+        int span = circbuf_write_span(cb, &dst);
+
+        if (span == 0) break;
+        if (span > n - copied) span = n - copied;
+        memcpy(dst, src + copied, span);
+        circbuf_commit(cb, span);
+        copied += span;
     }
 
     /* Return the number of elements. */
-    return i;
+    return copied;
 }
 
-/* Pop n elements from cb to dest linear array. */
+/* Pop up to n elements from cb to dest linear array, with at most two
+ * memcpy() calls. Returns the number of elements popped. */
 int circbuf_pop_to_linear(char *dest, struct Circbuf *cb, int n) {
-    int i = n;
+    int copied = 0;
+
+    while (copied < n) {
+        char *src;
+        int span = circbuf_read_span(cb, &src);
 
-    for(i = 0; i < n; i++) {
-        /* Pop element and check if successful. */
-        if (circbuf_pop(cb, &dest[i]) == 0) return i;
+        if (span == 0) break;
+        if (span > n - copied) span = n - copied;
+        memcpy(dest + copied, src, span);
+        circbuf_consume(cb, span);
+        copied += span;
     }
 
     /* Return the number of elements. */
-    return i;
+    return copied;
+}
+
+/* Copy up to n elements from the head of cb to dest, without consuming
+ * them. Returns the number of elements copied. */
+int circbuf_peek_to_linear(char *dest, struct Circbuf *cb, int n) {
+    struct iovec iov[2];
+    int iovcnt = circbuf_read_iov(cb, iov);
+    int copied = 0;
+
+    for (int j = 0; j < iovcnt && copied < n; j++) {
+        int span = iov[j].iov_len;
+        if (span > n - copied) span = n - copied;
+        memcpy(dest + copied, iov[j].iov_base, span);
+        copied += span;
+    }
+    return copied;
+}
+
+/* Set *ptr to the first free position and return how many elements can be
+ * written there contiguously. This may be less than circbuf_space_left()
+ * when the free space wraps around the end of buf: after committing the
+ * first span, a second call returns the rest. */
+int circbuf_write_span(struct Circbuf *cb, char **ptr) {
+    unsigned int pos = cb->write_idx & (cb->size - 1);
+    unsigned int avail = cb->size - (cb->write_idx - cb->read_idx);
+    unsigned int contiguous = cb->size - pos;
+
+    *ptr = cb->buf + pos;
+    return avail < contiguous ? avail : contiguous;
+}
+
+/* Mark as stored n elements written in the span returned by
+ * circbuf_write_span(). */
+void circbuf_commit(struct Circbuf *cb, int n) {
+    cb->write_idx += n;
+}
+
+/* Set *ptr to the oldest stored element and return how many elements can
+ * be read there contiguously. As for circbuf_write_span(), a second call
+ * after consuming the first span returns the wrapped around part. */
+int circbuf_read_span(struct Circbuf *cb, char **ptr) {
+    unsigned int pos = cb->read_idx & (cb->size - 1);
+    unsigned int used = cb->write_idx - cb->read_idx;
+    unsigned int contiguous = cb->size - pos;
+
+    *ptr = cb->buf + pos;
+    return used < contiguous ? used : contiguous;
+}
+
+/* Remove n elements from the head of the buffer, without copying them. */
+void circbuf_consume(struct Circbuf *cb, int n) {
+    cb->read_idx += n;
+}
+
+/* Fill iov[0] and iov[1] with the free space of the buffer, in order,
+ * and return the number of iovecs used (0 if the buffer is full, 2 if the
+ * free space wraps around the end of buf). After a readv(2) performed
+ * with these iovecs, circbuf_commit() the bytes read: this way data goes
+ * from the kernel straight into the buffer. */
+int circbuf_write_iov(struct Circbuf *cb, struct iovec *iov) {
+    unsigned int pos = cb->write_idx & (cb->size - 1);
+    unsigned int avail = cb->size - (cb->write_idx - cb->read_idx);
+    unsigned int first = cb->size - pos;
+
+    if (avail == 0) return 0;
+    if (first >= avail) {
+        iov[0].iov_base = cb->buf + pos;
+        iov[0].iov_len = avail;
+        return 1;
+    }
+    iov[0].iov_base = cb->buf + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = cb->buf;
+    iov[1].iov_len = avail - first;
+    return 2;
+}
+
+/* Fill iov[0] and iov[1] with the stored elements, oldest first, and
+ * return the number of iovecs used (0 if the buffer is empty). This lets
+ * the caller parse data in place, or hand it to writev(2), without
+ * copying it out of the buffer first. */
+int circbuf_read_iov(struct Circbuf *cb, struct iovec *iov) {
+    unsigned int pos = cb->read_idx & (cb->size - 1);
+    unsigned int used = cb->write_idx - cb->read_idx;
+    unsigned int first = cb->size - pos;
+
+    if (used == 0) return 0;
+    if (first >= used) {
+        iov[0].iov_base = cb->buf + pos;
+        iov[0].iov_len = used;
+        return 1;
+    }
+    iov[0].iov_base = cb->buf + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = cb->buf;
+    iov[1].iov_len = used - first;
+    return 2;
+}
+
+/* Return the offset, from the oldest stored element, of the first
+ * occurrence of c, or -1 if c is not stored in the buffer. */
+int circbuf_index(struct Circbuf *cb, char c) {
+    unsigned int pos = cb->read_idx & (cb->size - 1);
+    unsigned int used = cb->write_idx - cb->read_idx;
+    unsigned int first = cb->size - pos;
+    char *p;
+
+    if (first > used) first = used;
+    if ((p = memchr(cb->buf + pos, c, first)) != NULL)
+        return p - (cb->buf + pos);
+    if ((p = memchr(cb->buf, c, used - first)) != NULL)
+        return first + (p - cb->buf);
+    return -1;
+}
+
+/* Store in pos[] the offsets of the occurrences of c in the 'len' bytes
+ * at p, adding 'base' to each offset. At most 'max' offsets are stored
+ * (counting the 'found' ones already there). Returns the new number of
+ * stored offsets. */
+static int circbuf_scan(const char *p, int len, char c, int base,
+                        int *pos, int found, int max)
+{
+    int i = 0;
+
+#if defined(CIRCBUF_SCAN_AVX2)
+    __m256i needle = _mm256_set1_epi8(c);
+    for (; i + 32 <= len && found < max; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = (unsigned int)
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        while (mask && found < max) {
+            pos[found++] = base + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        if (mask) return found; /* pos[] is full. */
+    }
+#elif defined(CIRCBUF_SCAN_SSE2)
+    __m128i needle = _mm_set1_epi8(c);
+    for (; i + 16 <= len && found < max; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = (unsigned int)
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        while (mask && found < max) {
+            pos[found++] = base + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        if (mask) return found; /* pos[] is full. */
+    }
+#elif defined(CIRCBUF_SCAN_NEON)
+    uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+    for (; i + 16 <= len && found < max; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)(p + i)), needle);
+        /* Narrow the 128 bit comparison to a 64 bit mask, 4 bits per
+         * byte, NEON having no movemask instruction. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        mask &= 0x8888888888888888ULL;
+        while (mask && found < max) {
+            pos[found++] = base + i + (__builtin_ctzll(mask) >> 2);
+            mask &= mask - 1;
+        }
+        if (mask) return found; /* pos[] is full. */
+    }
+#endif
+
+    /* Tail (or whole span without vector instructions). */
+    while (i < len && found < max) {
+        const char *q = memchr(p + i, c, len - i);
+        if (q == NULL) break;
+        pos[found++] = base + (q - p);
+        i = (q - p) + 1;
+    }
+    return found;
+}
+
+/* Find, in a single pass, the occurrences of c among the stored elements,
+ * starting 'from' elements after the oldest one (so that callers can skip
+ * what they already scanned), across both parts of the buffer. The
+ * offsets, relative to the oldest stored element, are written in pos[]
+ * in ascending order, up to 'max' of them. Returns the number of offsets
+ * found: if it is 'max', scanning should continue after the last one. */
+int circbuf_find_all(struct Circbuf *cb, int from, char c, int *pos,
+                     int max)
+{
+    struct iovec iov[2];
+    int iovcnt = circbuf_read_iov(cb, iov);
+    int found = 0, base = 0;
+
+    for (int j = 0; j < iovcnt && found < max; j++) {
+        int len = iov[j].iov_len;
+
+        if (from < len) {
+            found = circbuf_scan((char *)iov[j].iov_base + from, len - from,
+                                 c, base + from, pos, found, max);
+            from = 0;
+        } else {
+            from -= len;
+        }
+        base += len;
+    }
+    return found;
 }
 
 /* Empty buffer. */
@@ -94,13 +389,7 @@ void circbuf_empty(struct Circbuf *cb) {
 
 /* Get buffer length (number of stored elements). */
 int circbuf_len(struct Circbuf * cb) {
-    if (cb->write_idx == cb->read_idx) {
-        return 0;
-    } else if (cb->write_idx > cb->read_idx) {
-        return cb->write_idx - cb->read_idx;
-    } else {
-        return cb->write_idx - cb->read_idx + cb->size;   
-    }
+    return cb->write_idx - cb->read_idx;
 }
 
 /* Get buffer size. */
@@ -110,26 +399,26 @@ int circbuf_size(struct Circbuf *cb) {
 
 /* Get buffer remaining space. */
 int circbuf_space_left(struct Circbuf *cb) {
-    return cb->size - 1 - circbuf_len(cb);
+    return cb->size - circbuf_len(cb);
 }
 
 /* Print buffer data, indices and size. */
 void circbuf_print_data(struct Circbuf *cb) {
     int i;
     int cb_len = circbuf_len(cb);
-    int read_idx = cb->read_idx;
+    unsigned int read_idx = cb->read_idx;
 
-    printf("write_idx: %d\n",cb->write_idx);
-    printf("read_idx: %d\n", cb->read_idx);
+    printf("write_idx: %u\n",cb->write_idx & (cb->size - 1));
+    printf("read_idx: %u\n", cb->read_idx & (cb->size - 1));
     printf("length: %d\n", cb_len);
-    printf("size: %d\n", cb->size);
+    printf("size: %u\n", cb->size);
 
     printf("Data: ");
     if (cb_len == 0) {
         printf("(empty)");
     } else {
         for (i = 0; i < cb_len; i++) {
-            switch (cb->buf[read_idx]) {
+            switch (cb->buf[read_idx & (cb->size - 1)]) {
                 case '\n':
                 printf("\\n ");
                 break;
@@ -143,10 +432,10 @@ void circbuf_print_data(struct Circbuf *cb) {
                 break;
 
                 default:
-                printf("%c ", cb->buf[read_idx]);
+                printf("%c ", cb->buf[read_idx & (cb->size - 1)]);
             }
             
-            read_idx = (read_idx + 1) % cb->size;
+            read_idx++;
         };
     }
 
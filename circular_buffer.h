@@ -1,30 +1,52 @@
 /*
  * Circular buffer.
- * 
+ *
  * Copyright (c) 2025 vitoloper
- * 
+ *
  */
 
 #ifndef CIRCBUFLIB_H
 #define CIRCBUFLIB_H
 
+#include <sys/uio.h>
+
+/* The size is always a power of two, so that positions are obtained by
+ * masking instead of by modulo. Indices are free running (they are only
+ * masked when accessing buf, and wrap around naturally as unsigned
+ * integers): this way write_idx - read_idx is always the number of stored
+ * elements, and the whole buffer can be used. */
 struct Circbuf {
     char *buf;
-    int write_idx;
-    int read_idx;
-    int size;   // if size is N, actual capacity is N-1
+    unsigned int write_idx;
+    unsigned int read_idx;
+    unsigned int size;   // power of two, it is also the capacity
+    char *storage;       // Caller provided memory, used as buf whenever
+                         // the buffer fits in it (NULL if none).
+    unsigned int storage_size; // Size of storage.
 };
 
 struct Circbuf *circbuf_alloc(int len);
 void circbuf_free(struct Circbuf *cb);
+void circbuf_init(struct Circbuf *cb, char *storage, int size);
+void circbuf_deinit(struct Circbuf *cb);
+int circbuf_resize(struct Circbuf *cb, int size);
 int circbuf_push(struct Circbuf *cb, char data);
 int circbuf_pop(struct Circbuf *cb, char *data);
 int circbuf_push_from_linear(struct Circbuf *cb, char *src, int n);
 int circbuf_pop_to_linear(char *dest, struct Circbuf *cb, int n);
+int circbuf_peek_to_linear(char *dest, struct Circbuf *cb, int n);
+int circbuf_write_span(struct Circbuf *cb, char **ptr);
+void circbuf_commit(struct Circbuf *cb, int n);
+int circbuf_read_span(struct Circbuf *cb, char **ptr);
+void circbuf_consume(struct Circbuf *cb, int n);
+int circbuf_write_iov(struct Circbuf *cb, struct iovec *iov);
+int circbuf_read_iov(struct Circbuf *cb, struct iovec *iov);
+int circbuf_index(struct Circbuf *cb, char c);
+int circbuf_find_all(struct Circbuf *cb, int from, char c, int *pos, int max);
 void circbuf_empty(struct Circbuf *cb);
 int circbuf_len(struct Circbuf * cb);
 int circbuf_size(struct Circbuf *cb);
 int circbuf_space_left(struct Circbuf *cb);
 void circbuf_print_data(struct Circbuf *cb);
 
-#endif // CIRCBUFLIB_H
\ No newline at end of file
+#endif // CIRCBUFLIB_H
@@ -0,0 +1,119 @@
+/*
+ * Message compression.
+ *
+ * Messages are compressed one by one, each one on its own, so that the
+ * same compressed buffer can be sent to any recipient. The codecs are
+ * optional, and built only when their library is available: "make
+ * ZLIB=1" builds deflate.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <string.h>
+
+#include "compress.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+
+/* Setting up a zlib stream allocates and clears a few hundreds KB: every
+ * thread keeps its own streams, and only resets them between messages. */
+static __thread z_stream Deflater, Inflater;
+static __thread int DeflaterReady, InflaterReady;
+#endif
+
+static const struct {
+    const char *name;
+    int codec;
+} Codecs[] = {
+    {"deflate", CODEC_DEFLATE},
+    {NULL, 0}
+};
+
+/* Return the mask of the codecs built in. */
+int codec_available(void) {
+#ifdef USE_ZLIB
+    return CODEC_DEFLATE;
+#else
+    return 0;
+#endif
+}
+
+/* Return the codec called 'name', or 0 if there is no such codec or it is
+ * not built in. */
+int codec_from_name(const char *name) {
+    for (int j = 0; Codecs[j].name; j++)
+        if (!strcmp(Codecs[j].name, name))
+            return Codecs[j].codec & codec_available();
+    return 0;
+}
+
+/* Return the name of the codec, or NULL. */
+const char *codec_name(int codec) {
+    for (int j = 0; Codecs[j].name; j++)
+        if (Codecs[j].codec == codec) return Codecs[j].name;
+    return NULL;
+}
+
+/* Compress the 'len' bytes at 'src' into 'dst'. Returns the compressed
+ * length, or 0 if it would not fit in 'dstlen' bytes: it is not worth
+ * it then. */
+size_t codec_compress(int codec, const char *src, size_t len, char *dst,
+                      size_t dstlen)
+{
+#ifdef USE_ZLIB
+    if (codec == CODEC_DEFLATE) {
+        z_stream *z = &Deflater;
+        if (!DeflaterReady) {
+            memset(z, 0, sizeof(*z));
+            if (deflateInit2(z, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+            DeflaterReady = 1;
+        } else {
+            deflateReset(z);
+        }
+        z->next_in = (Bytef *)src;
+        z->avail_in = len;
+        z->next_out = (Bytef *)dst;
+        z->avail_out = dstlen;
+        if (deflate(z, Z_FINISH) != Z_STREAM_END) return 0;
+        return dstlen - z->avail_out;
+    }
+#else
+    (void)src; (void)len; (void)dst; (void)dstlen;
+#endif
+    (void)codec;
+    return 0;
+}
+
+/* Decompress the 'len' bytes at 'src' into 'dst', that must be exactly
+ * as long as the original data, 'dstlen' bytes. Returns 0 on success, -1
+ * if the data is corrupted or has a different length. */
+int codec_decompress(int codec, const char *src, size_t len, char *dst,
+                     size_t dstlen)
+{
+#ifdef USE_ZLIB
+    if (codec == CODEC_DEFLATE) {
+        z_stream *z = &Inflater;
+        if (!InflaterReady) {
+            memset(z, 0, sizeof(*z));
+            if (inflateInit2(z, -MAX_WBITS) != Z_OK) return -1;
+            InflaterReady = 1;
+        } else {
+            inflateReset(z);
+        }
+        z->next_in = (Bytef *)src;
+        z->avail_in = len;
+        z->next_out = (Bytef *)dst;
+        z->avail_out = dstlen;
+        if (inflate(z, Z_FINISH) != Z_STREAM_END || z->avail_out ||
+            z->avail_in) return -1;
+        return 0;
+    }
+#else
+    (void)src; (void)len; (void)dst; (void)dstlen;
+#endif
+    (void)codec;
+    return -1;
+}
@@ -0,0 +1,25 @@
+/*
+ * Message compression.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+/* Codecs, as bits of a mask: the set of codecs a peer has fits a byte.
+ * Only the ones built in are available (see codec_available()). */
+#define CODEC_DEFLATE (1<<0) /* Raw deflate (RFC 1951), with zlib. */
+
+int codec_available(void);
+int codec_from_name(const char *name);
+const char *codec_name(int codec);
+size_t codec_compress(int codec, const char *src, size_t len, char *dst,
+                      size_t dstlen);
+int codec_decompress(int codec, const char *src, size_t len, char *dst,
+                     size_t dstlen);
+
+#endif // COMPRESS_H
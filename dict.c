@@ -0,0 +1,143 @@
+/*
+ * Hash table with string keys.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "chatlib.h"
+
+#define DICT_INITIAL_SIZE 16
+
+/* FNV-1a: simple and good enough for the short keys we store. */
+static unsigned int dict_hash(const char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Return the address of the pointer to the entry of 'key' (that is
+ * NULL if the key is not there), so the caller can unlink it. */
+static struct dictEntry **dict_lookup(struct dict *d, const char *key,
+                                      unsigned int hash)
+{
+    struct dictEntry **de = &d->table[hash & (d->size-1)];
+    while (*de && ((*de)->hash != hash || strcmp((*de)->key, key)))
+        de = &(*de)->next;
+    return de;
+}
+
+/* Double the number of buckets, moving every entry to its new chain. */
+static void dict_expand(struct dict *d) {
+    size_t newsize = d->size*2;
+    struct dictEntry **table = chatMalloc(sizeof(*table)*newsize);
+    memset(table, 0, sizeof(*table)*newsize);
+
+    for (size_t j = 0; j < d->size; j++) {
+        struct dictEntry *de = d->table[j];
+        while (de) {
+            struct dictEntry *next = de->next;
+            size_t idx = de->hash & (newsize-1);
+            de->next = table[idx];
+            table[idx] = de;
+            de = next;
+        }
+    }
+    free(d->table);
+    d->table = table;
+    d->size = newsize;
+}
+
+/* Initialize an empty table. */
+void dict_init(struct dict *d) {
+    d->size = DICT_INITIAL_SIZE;
+    d->used = 0;
+    d->table = chatMalloc(sizeof(*d->table)*d->size);
+    memset(d->table, 0, sizeof(*d->table)*d->size);
+}
+
+/* Release the entries and the table. The values are not touched. */
+void dict_free(struct dict *d) {
+    for (size_t j = 0; j < d->size; j++) {
+        struct dictEntry *de = d->table[j];
+        while (de) {
+            struct dictEntry *next = de->next;
+            free(de);
+            de = next;
+        }
+    }
+    free(d->table);
+    d->table = NULL;
+    d->size = d->used = 0;
+}
+
+/* Return the value of 'key', or NULL if it is not in the table. */
+void *dict_find(struct dict *d, const char *key) {
+    struct dictEntry *de = *dict_lookup(d, key, dict_hash(key));
+    return de ? de->val : NULL;
+}
+
+/* Add 'key' with the value 'val'. Returns 0 if the key already exists,
+ * in which case the table is unchanged, otherwise 1. */
+int dict_add(struct dict *d, const char *key, void *val) {
+    unsigned int hash = dict_hash(key);
+    struct dictEntry **slot = dict_lookup(d, key, hash);
+    if (*slot) return 0;
+
+    size_t keylen = strlen(key);
+    struct dictEntry *de = chatMalloc(sizeof(*de)+keylen+1);
+    memcpy(de->key, key, keylen+1);
+    de->hash = hash;
+    de->val = val;
+    de->next = NULL;
+    *slot = de;
+    if (++d->used > d->size) dict_expand(d);
+    return 1;
+}
+
+/* Remove 'key' from the table, returning its value, or NULL if the key
+ * was not there. */
+void *dict_delete(struct dict *d, const char *key) {
+    struct dictEntry **slot = dict_lookup(d, key, dict_hash(key));
+    struct dictEntry *de = *slot;
+    if (de == NULL) return NULL;
+
+    void *val = de->val;
+    *slot = de->next;
+    free(de);
+    d->used--;
+    return val;
+}
+
+/* Return the number of entries. */
+size_t dict_size(struct dict *d) {
+    return d->used;
+}
+
+/* Start a walk over the entries of 'd'. */
+void dict_iter_init(struct dictIterator *it, struct dict *d) {
+    it->d = d;
+    it->bucket = 0;
+    it->next = NULL;
+}
+
+/* Return the next entry of the walk, or NULL when all were returned. The
+ * entry returned can be deleted, but the table must not be modified
+ * otherwise until the walk ends. */
+struct dictEntry *dict_next(struct dictIterator *it) {
+    while (it->next == NULL) {
+        if (it->bucket == it->d->size) return NULL;
+        it->next = it->d->table[it->bucket++];
+    }
+    struct dictEntry *de = it->next;
+    it->next = de->next;
+    return de;
+}
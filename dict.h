@@ -0,0 +1,46 @@
+/*
+ * Hash table with string keys.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef DICT_H
+#define DICT_H
+
+#include <stddef.h>
+
+/* Keys are copied into the entry, values are opaque pointers owned by
+ * the caller. Collisions are chained. */
+struct dictEntry {
+    struct dictEntry *next;
+    void *val;
+    unsigned int hash;
+    char key[];
+};
+
+/* The number of buckets is a power of two, and doubles when there are
+ * more entries than buckets, so chains stay short. */
+struct dict {
+    struct dictEntry **table;
+    size_t size;    // Number of buckets.
+    size_t used;    // Number of entries.
+};
+
+/* Position of a walk over all the entries, see dict_next(). */
+struct dictIterator {
+    struct dict *d;
+    size_t bucket;          // Next bucket to visit.
+    struct dictEntry *next; // Next entry of the current chain.
+};
+
+void dict_init(struct dict *d);
+void dict_free(struct dict *d);
+void *dict_find(struct dict *d, const char *key);
+int dict_add(struct dict *d, const char *key, void *val);
+void *dict_delete(struct dict *d, const char *key);
+size_t dict_size(struct dict *d);
+void dict_iter_init(struct dictIterator *it, struct dict *d);
+struct dictEntry *dict_next(struct dictIterator *it);
+
+#endif // DICT_H
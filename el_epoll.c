@@ -0,0 +1,110 @@
+/*
+ * Linux epoll(7) backend for the event loop.
+ * This file is included by eventloop.c, it is not compiled on its own.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <sys/epoll.h>
+
+struct elApiState {
+    int epfd;
+    struct epoll_event *events;
+};
+
+static int elApiCreate(struct eventLoop *el) {
+    struct elApiState *state = chatMalloc(sizeof(*state));
+
+    state->events = chatMalloc(sizeof(struct epoll_event)*el->setsize);
+    state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel. */
+    if (state->epfd == -1) {
+        free(state->events);
+        free(state);
+        return -1;
+    }
+    fcntl(state->epfd, F_SETFD, FD_CLOEXEC);
+    el->apidata = state;
+    return 0;
+}
+
+static int elApiResize(struct eventLoop *el, int setsize) {
+    struct elApiState *state = el->apidata;
+
+    state->events = chatRealloc(state->events,
+                                sizeof(struct epoll_event)*setsize);
+    return 0;
+}
+
+static void elApiFree(struct eventLoop *el) {
+    struct elApiState *state = el->apidata;
+
+    close(state->epfd);
+    free(state->events);
+    free(state);
+}
+
+static int elApiAddEvent(struct eventLoop *el, int fd, int mask) {
+    struct elApiState *state = el->apidata;
+    struct epoll_event ee = {0};
+
+    /* If the fd was already monitored for some event, we need a MOD
+     * operation. Otherwise we need an ADD operation. */
+    int op = el->events[fd].mask == EL_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    mask |= el->events[fd].mask; /* Merge old events. */
+    if (mask & EL_READABLE) ee.events |= EPOLLIN;
+    if (mask & EL_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
+    return 0;
+}
+
+static void elApiDelEvent(struct eventLoop *el, int fd, int delmask) {
+    struct elApiState *state = el->apidata;
+    struct epoll_event ee = {0};
+    int mask = el->events[fd].mask & (~delmask);
+
+    if (mask & EL_READABLE) ee.events |= EPOLLIN;
+    if (mask & EL_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (mask != EL_NONE) {
+        epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
+    } else {
+        /* Note, Kernel < 2.6.9 requires a non null event pointer even for
+         * EPOLL_CTL_DEL. */
+        epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+    }
+}
+
+static int elApiPoll(struct eventLoop *el, struct timeval *tvp) {
+    struct elApiState *state = el->apidata;
+    int retval, numevents = 0;
+
+    retval = epoll_wait(state->epfd, state->events, el->setsize,
+            tvp ? (tvp->tv_sec*1000 + (tvp->tv_usec + 999)/1000) : -1);
+    if (retval > 0) {
+        numevents = retval;
+        for (int j = 0; j < numevents; j++) {
+            int mask = 0;
+            struct epoll_event *e = state->events+j;
+
+            if (e->events & EPOLLIN) mask |= EL_READABLE;
+            if (e->events & EPOLLOUT) mask |= EL_WRITABLE;
+            /* Errors and hangups are reported as both readable and
+             * writable, so that the handlers will notice them on the
+             * next read(2) or write(2). */
+            if (e->events & EPOLLERR) mask |= EL_READABLE|EL_WRITABLE;
+            if (e->events & EPOLLHUP) mask |= EL_READABLE|EL_WRITABLE;
+            el->fired[j].fd = e->data.fd;
+            el->fired[j].mask = mask;
+        }
+    } else if (retval == -1 && errno != EINTR) {
+        return -1;
+    }
+    return numevents;
+}
+
+static const char *elApiName(void) {
+    return "epoll";
+}
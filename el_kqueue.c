@@ -0,0 +1,132 @@
+/*
+ * BSD/macOS kqueue(2) backend for the event loop.
+ * This file is included by eventloop.c, it is not compiled on its own.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+
+struct elApiState {
+    int kqfd;
+    struct kevent *events;
+
+    /* kqueue reports readable and writable as two separate events for the
+     * same descriptor: we merge them back into a single fired entry using
+     * this per-fd scratch mask. */
+    char *eventsMask;
+};
+
+static int elApiCreate(struct eventLoop *el) {
+    struct elApiState *state = chatMalloc(sizeof(*state));
+
+    state->events = chatMalloc(sizeof(struct kevent)*el->setsize);
+    state->kqfd = kqueue();
+    if (state->kqfd == -1) {
+        free(state->events);
+        free(state);
+        return -1;
+    }
+    fcntl(state->kqfd, F_SETFD, FD_CLOEXEC);
+    state->eventsMask = chatMalloc(el->setsize);
+    memset(state->eventsMask, 0, el->setsize);
+    el->apidata = state;
+    return 0;
+}
+
+static int elApiResize(struct eventLoop *el, int setsize) {
+    struct elApiState *state = el->apidata;
+
+    state->events = chatRealloc(state->events, sizeof(struct kevent)*setsize);
+    state->eventsMask = chatRealloc(state->eventsMask, setsize);
+    memset(state->eventsMask, 0, setsize);
+    return 0;
+}
+
+static void elApiFree(struct eventLoop *el) {
+    struct elApiState *state = el->apidata;
+
+    close(state->kqfd);
+    free(state->events);
+    free(state->eventsMask);
+    free(state);
+}
+
+static int elApiAddEvent(struct eventLoop *el, int fd, int mask) {
+    struct elApiState *state = el->apidata;
+    struct kevent ke;
+
+    if (mask & EL_READABLE) {
+        EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(state->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+    }
+    if (mask & EL_WRITABLE) {
+        EV_SET(&ke, fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+        if (kevent(state->kqfd, &ke, 1, NULL, 0, NULL) == -1) return -1;
+    }
+    return 0;
+}
+
+static void elApiDelEvent(struct eventLoop *el, int fd, int mask) {
+    struct elApiState *state = el->apidata;
+    struct kevent ke;
+
+    if (mask & EL_READABLE) {
+        EV_SET(&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        kevent(state->kqfd, &ke, 1, NULL, 0, NULL);
+    }
+    if (mask & EL_WRITABLE) {
+        EV_SET(&ke, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(state->kqfd, &ke, 1, NULL, 0, NULL);
+    }
+}
+
+static int elApiPoll(struct eventLoop *el, struct timeval *tvp) {
+    struct elApiState *state = el->apidata;
+    int retval, numevents = 0;
+
+    if (tvp != NULL) {
+        struct timespec timeout;
+        timeout.tv_sec = tvp->tv_sec;
+        timeout.tv_nsec = tvp->tv_usec * 1000;
+        retval = kevent(state->kqfd, NULL, 0, state->events, el->setsize,
+                        &timeout);
+    } else {
+        retval = kevent(state->kqfd, NULL, 0, state->events, el->setsize,
+                        NULL);
+    }
+
+    if (retval > 0) {
+        /* First pass: accumulate the mask of every reported fd. */
+        for (int j = 0; j < retval; j++) {
+            struct kevent *e = state->events+j;
+            int fd = e->ident;
+
+            if (e->filter == EVFILT_READ) state->eventsMask[fd] |= EL_READABLE;
+            else if (e->filter == EVFILT_WRITE)
+                state->eventsMask[fd] |= EL_WRITABLE;
+        }
+
+        /* Second pass: emit one fired entry per fd and reset its mask. */
+        for (int j = 0; j < retval; j++) {
+            int fd = state->events[j].ident;
+            int mask = state->eventsMask[fd];
+
+            if (mask) {
+                el->fired[numevents].fd = fd;
+                el->fired[numevents].mask = mask;
+                state->eventsMask[fd] = 0;
+                numevents++;
+            }
+        }
+    } else if (retval == -1 && errno != EINTR) {
+        return -1;
+    }
+    return numevents;
+}
+
+static const char *elApiName(void) {
+    return "kqueue";
+}
@@ -0,0 +1,86 @@
+/*
+ * Portable select(2) backend for the event loop. Limited to FD_SETSIZE
+ * descriptors, it is only used when neither epoll nor kqueue exist.
+ * This file is included by eventloop.c, it is not compiled on its own.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <sys/select.h>
+
+struct elApiState {
+    fd_set rfds, wfds;
+    /* We need to have a copy of the fd sets as it's not safe to reuse
+     * FD sets after select(). */
+    fd_set _rfds, _wfds;
+};
+
+static int elApiCreate(struct eventLoop *el) {
+    struct elApiState *state = chatMalloc(sizeof(*state));
+
+    FD_ZERO(&state->rfds);
+    FD_ZERO(&state->wfds);
+    el->apidata = state;
+    return 0;
+}
+
+static int elApiResize(struct eventLoop *el, int setsize) {
+    UNUSED(el);
+    /* Just ensure we have enough room in the fd_set type. */
+    if (setsize >= FD_SETSIZE) return -1;
+    return 0;
+}
+
+static void elApiFree(struct eventLoop *el) {
+    free(el->apidata);
+}
+
+static int elApiAddEvent(struct eventLoop *el, int fd, int mask) {
+    struct elApiState *state = el->apidata;
+
+    if (fd >= FD_SETSIZE) return -1;
+    if (mask & EL_READABLE) FD_SET(fd, &state->rfds);
+    if (mask & EL_WRITABLE) FD_SET(fd, &state->wfds);
+    return 0;
+}
+
+static void elApiDelEvent(struct eventLoop *el, int fd, int mask) {
+    struct elApiState *state = el->apidata;
+
+    if (mask & EL_READABLE) FD_CLR(fd, &state->rfds);
+    if (mask & EL_WRITABLE) FD_CLR(fd, &state->wfds);
+}
+
+static int elApiPoll(struct eventLoop *el, struct timeval *tvp) {
+    struct elApiState *state = el->apidata;
+    int retval, numevents = 0;
+
+    memcpy(&state->_rfds, &state->rfds, sizeof(fd_set));
+    memcpy(&state->_wfds, &state->wfds, sizeof(fd_set));
+
+    retval = select(el->maxfd+1, &state->_rfds, &state->_wfds, NULL, tvp);
+    if (retval > 0) {
+        for (int j = 0; j <= el->maxfd; j++) {
+            int mask = 0;
+            struct elFileEvent *fe = &el->events[j];
+
+            if (fe->mask == EL_NONE) continue;
+            if (fe->mask & EL_READABLE && FD_ISSET(j, &state->_rfds))
+                mask |= EL_READABLE;
+            if (fe->mask & EL_WRITABLE && FD_ISSET(j, &state->_wfds))
+                mask |= EL_WRITABLE;
+            if (mask == 0) continue;
+            el->fired[numevents].fd = j;
+            el->fired[numevents].mask = mask;
+            numevents++;
+        }
+    } else if (retval == -1 && errno != EINTR) {
+        return -1;
+    }
+    return numevents;
+}
+
+static const char *elApiName(void) {
+    return "select";
+}
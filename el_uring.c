@@ -0,0 +1,613 @@
+/*
+ * Linux io_uring(7) backend for the event loop, selected by defining
+ * USE_IO_URING. This file is included by eventloop.c, it is not compiled
+ * on its own.
+ *
+ * The ring is driven with the raw system calls, no liburing needed.
+ * Everything the loop asks the kernel during an iteration (readiness
+ * polls, receives, writes, cancellations) is queued in the submission
+ * ring, and a single io_uring_enter(2) per iteration both submits it and
+ * waits for the completions.
+ *
+ * Readiness is emulated with one shot poll requests, armed again after
+ * they fire if the descriptor still has registered events: this keeps
+ * the level triggered semantics of the other backends, so every file
+ * event handler works unchanged.
+ *
+ * On top of that this backend implements the completion based operations
+ * of the event loop API (see elAsyncIO()): multishot accepts, multishot
+ * receives into a ring of buffers provided to the kernel, and writes.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define EL_HAVE_ASYNC_IO
+
+#define EL_URING_ENTRIES 1024   /* Submission ring entries. */
+#define EL_URING_CQ_ENTRIES (EL_URING_ENTRIES*8) /* Completion ring. */
+#define EL_URING_BUFS 256       /* Buffers provided for receives... */
+#define EL_URING_BUF_SIZE 4096  /* ...and their size. */
+#define EL_URING_BGID 0         /* Group of the provided buffers. */
+
+/* The user_data of every request tells the operation in the low bits.
+ * Writes carry the address of their struct elWrite. The other requests
+ * carry the descriptor, the generation of its accept or receive
+ * registration (bumped when it is cancelled, so that late completions are
+ * recognized as stale and dropped) and a 13 bits ticket, telling apart a
+ * request from the one it replaced. */
+#define OP_POLL 0
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_WRITE 3
+#define OP_IGNORE 4     /* Cancellations: nothing to do on completion. */
+#define OP_MASK 7
+
+#define UD_FD(ud) ((int)((ud) >> 32))
+#define UD_GEN(ud) ((unsigned short)((ud) >> 16))
+#define UD_OP(ud) ((int)((ud) & OP_MASK))
+
+/* What the backend knows about every descriptor. */
+struct elUringFd {
+    unsigned short gen;         // Generation of the registration.
+    unsigned short ticket;      // Last ticket handed out.
+    unsigned long long poll_ud;  // user_data of the armed poll...
+    unsigned long long async_ud; // ...and of the accept or receive.
+    int poll_armed;     // EL_(READABLE|WRITABLE) polled by the kernel now.
+    int async_op;       // OP_ACCEPT or OP_RECV registered, or 0.
+    int async_armed;    // True if its multishot request is in the kernel.
+    int async_active;   // False once stopped: not armed again.
+    int dirty;          // In the list of descriptors to update.
+    void *proc;         // elAcceptProc or elRecvProc.
+    void *privdata;
+};
+
+struct elApiState {
+    int ringfd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_entries, cq_entries;
+    unsigned int sq_local_tail; // Entries queued, published at submit.
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct elUringFd *fds;      // Indexed by descriptor, setsize slots.
+    int *dirty;                 // Descriptors whose requests must be
+    int numdirty;               // changed before waiting.
+    struct io_uring_cqe *done;  // Completions reaped by elApiPoll(), to
+    int numdone;                // be dispatched by elApiProcessCompletions().
+    struct io_uring_buf_ring *br; // Ring of the provided buffers.
+    size_t br_size;
+    unsigned short br_tail;
+    char *bufs;                 // EL_URING_BUFS buffers.
+};
+
+static int elUringSetup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int elUringEnter(int fd, unsigned int to_submit,
+                        unsigned int min_complete, unsigned int flags,
+                        void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int elUringRegister(int fd, unsigned int opcode, void *arg,
+                           unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned long long elUringData(int fd, unsigned short gen,
+                                      unsigned short ticket, int op)
+{
+    return ((unsigned long long)(unsigned int)fd << 32) |
+           ((unsigned long long)gen << 16) |
+           ((unsigned long long)(ticket & 0x1fff) << 3) | op;
+}
+
+/* Submit what was queued, without waiting. */
+static int elUringSubmit(struct elApiState *state) {
+    unsigned int pending = state->sq_local_tail - *state->sq_tail;
+
+    __atomic_store_n(state->sq_tail, state->sq_local_tail, __ATOMIC_RELEASE);
+    while (pending) {
+        int n = elUringEnter(state->ringfd, pending, 0, 0, NULL, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        pending -= n;
+    }
+    return 0;
+}
+
+/* Return a cleared submission entry. When the ring is full what it holds
+ * is submitted first, so callers never fail to queue a request. */
+static struct io_uring_sqe *elUringGetSqe(struct elApiState *state) {
+    unsigned int head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+
+    if (state->sq_local_tail - head == state->sq_entries) {
+        if (elUringSubmit(state) == -1) return NULL;
+    }
+    unsigned int idx = state->sq_local_tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    state->sq_local_tail++;
+    return sqe;
+}
+
+/* Give buffer 'bid' back to the kernel. */
+static void elUringRecycleBuffer(struct elApiState *state, int bid) {
+    struct io_uring_buf *b =
+        &state->br->bufs[state->br_tail & (EL_URING_BUFS-1)];
+
+    b->addr = (unsigned long long)(uintptr_t)
+              (state->bufs + (size_t)bid*EL_URING_BUF_SIZE);
+    b->len = EL_URING_BUF_SIZE;
+    b->bid = bid;
+    state->br_tail++;
+    __atomic_store_n(&state->br->tail, state->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Register the ring of provided buffers receives pick from. */
+static int elUringSetupBuffers(struct elApiState *state) {
+    state->br_size = sizeof(struct io_uring_buf)*EL_URING_BUFS;
+    state->br = mmap(NULL, state->br_size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (state->br == MAP_FAILED) {
+        state->br = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)state->br;
+    reg.ring_entries = EL_URING_BUFS;
+    reg.bgid = EL_URING_BGID;
+    if (elUringRegister(state->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1)
+        == -1) return -1;
+
+    state->bufs = chatMalloc((size_t)EL_URING_BUFS*EL_URING_BUF_SIZE);
+    state->br_tail = 0;
+    for (int j = 0; j < EL_URING_BUFS; j++) elUringRecycleBuffer(state, j);
+    return 0;
+}
+
+static void elApiFree(struct eventLoop *el);
+
+static int elApiCreate(struct eventLoop *el) {
+    struct elApiState *state = chatMalloc(sizeof(*state));
+    struct io_uring_params p;
+
+    memset(state, 0, sizeof(*state));
+    el->apidata = state;
+
+    /* Ask for cooperative task running when available: completions are
+     * only needed when we enter the kernel anyway, so there is no point
+     * in interrupting us to post them. */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_SUBMIT_ALL|
+              IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = EL_URING_CQ_ENTRIES;
+    state->ringfd = elUringSetup(EL_URING_ENTRIES, &p);
+    if (state->ringfd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = EL_URING_CQ_ENTRIES;
+        state->ringfd = elUringSetup(EL_URING_ENTRIES, &p);
+    }
+    if (state->ringfd == -1) goto err;
+    fcntl(state->ringfd, F_SETFD, FD_CLOEXEC);
+
+    /* Waiting with a timeout needs IORING_ENTER_EXT_ARG (Linux 5.11), and
+     * we rely on the kernel keeping completions that overflow the ring. */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        goto err;
+    }
+
+    state->sq_entries = p.sq_entries;
+    state->cq_entries = p.cq_entries;
+    state->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+    state->cq_ring_size = p.cq_off.cqes +
+                          p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+    state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, state->ringfd,
+                          IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED) {
+        state->sq_ring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ring = state->sq_ring;
+    } else {
+        state->cq_ring = mmap(NULL, state->cq_ring_size,
+                              PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                              state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED) {
+            state->cq_ring = NULL;
+            goto err;
+        }
+    }
+    state->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, state->ringfd,
+                       IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = state->sq_ring, *cq = state->cq_ring;
+    state->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    state->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    state->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    state->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    state->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    state->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    state->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    state->sq_local_tail = *state->sq_tail;
+
+    if (elUringSetupBuffers(state) == -1) goto err;
+
+    state->fds = chatMalloc(sizeof(struct elUringFd)*el->setsize);
+    memset(state->fds, 0, sizeof(struct elUringFd)*el->setsize);
+    state->dirty = chatMalloc(sizeof(int)*el->setsize);
+    state->done = chatMalloc(sizeof(struct io_uring_cqe)*state->cq_entries);
+    return 0;
+
+err:
+    {
+        int saved_errno = errno;
+        elApiFree(el);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+static int elApiResize(struct eventLoop *el, int setsize) {
+    struct elApiState *state = el->apidata;
+
+    /* Completion based registrations do not count in el->maxfd: refuse
+     * to forget about them. */
+    for (int fd = setsize; fd < el->setsize; fd++)
+        if (state->fds[fd].async_op || state->fds[fd].dirty) return -1;
+
+    state->fds = chatRealloc(state->fds, sizeof(struct elUringFd)*setsize);
+    if (setsize > el->setsize)
+        memset(state->fds+el->setsize, 0,
+               sizeof(struct elUringFd)*(setsize-el->setsize));
+    state->dirty = chatRealloc(state->dirty, sizeof(int)*setsize);
+    return 0;
+}
+
+static void elApiFree(struct eventLoop *el) {
+    struct elApiState *state = el->apidata;
+
+    if (state->ringfd != -1) close(state->ringfd);
+    if (state->sqes) munmap(state->sqes, state->sqes_size);
+    if (state->cq_ring && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring, state->cq_ring_size);
+    if (state->sq_ring) munmap(state->sq_ring, state->sq_ring_size);
+    if (state->br) munmap(state->br, state->br_size);
+    free(state->bufs);
+    free(state->fds);
+    free(state->dirty);
+    free(state->done);
+    free(state);
+}
+
+/* Put 'fd' in the list of descriptors whose requests are brought in line
+ * with what is registered before waiting. */
+static void elUringMarkDirty(struct elApiState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->numdirty++] = fd;
+}
+
+static int elApiAddEvent(struct eventLoop *el, int fd, int mask) {
+    UNUSED(mask);
+    elUringMarkDirty(el->apidata, fd);
+    return 0;
+}
+
+static void elApiDelEvent(struct eventLoop *el, int fd, int delmask) {
+    UNUSED(delmask);
+    elUringMarkDirty(el->apidata, fd);
+}
+
+/* Queue the requests that make the kernel watch 'fd' the way it is
+ * registered now: the poll for its file events, and the multishot
+ * accept or receive if any. */
+static int elUringUpdate(struct eventLoop *el, int fd) {
+    struct elApiState *state = el->apidata;
+    struct elUringFd *f = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+    int want = el->events[fd].mask & (EL_READABLE|EL_WRITABLE);
+
+    f->dirty = 0;
+    if (f->poll_armed && f->poll_armed != want) {
+        if ((sqe = elUringGetSqe(state)) == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = f->poll_ud;
+        sqe->user_data = OP_IGNORE;
+        f->poll_armed = 0;
+    }
+    if (want && !f->poll_armed) {
+        if ((sqe = elUringGetSqe(state)) == NULL) return -1;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        if (want & EL_READABLE) sqe->poll32_events |= POLLIN;
+        if (want & EL_WRITABLE) sqe->poll32_events |= POLLOUT;
+        f->poll_ud = elUringData(fd, f->gen, ++f->ticket, OP_POLL);
+        sqe->user_data = f->poll_ud;
+        f->poll_armed = want;
+    }
+
+    if (f->async_op && f->async_active && !f->async_armed) {
+        if ((sqe = elUringGetSqe(state)) == NULL) return -1;
+        sqe->fd = fd;
+        if (f->async_op == OP_ACCEPT) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = EL_URING_BGID;
+        }
+        f->async_ud = elUringData(fd, f->gen, ++f->ticket, f->async_op);
+        sqe->user_data = f->async_ud;
+        f->async_armed = 1;
+    } else if (f->async_armed && !f->async_active) {
+        if ((sqe = elUringGetSqe(state)) == NULL) return -1;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = f->async_ud;
+        sqe->user_data = OP_IGNORE;
+        f->async_armed = 0;
+    }
+    return 0;
+}
+
+/* Submit the queued requests and wait for completions, up to 'tvp'. Poll
+ * completions are reported as fired events, the others are kept for
+ * elApiProcessCompletions(). */
+static int elApiPoll(struct eventLoop *el, struct timeval *tvp) {
+    struct elApiState *state = el->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int numevents = 0;
+
+    for (int j = 0; j < state->numdirty; j++)
+        if (elUringUpdate(el, state->dirty[j]) == -1) return -1;
+    state->numdirty = 0;
+
+    /* Don't block if completions are already waiting, for instance the
+     * writes that completed inline while they were submitted. */
+    unsigned int head = *state->cq_head;
+    int ready = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE) != head;
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    unsigned int to_submit = state->sq_local_tail - *state->sq_tail;
+    __atomic_store_n(state->sq_tail, state->sq_local_tail, __ATOMIC_RELEASE);
+    if (elUringEnter(state->ringfd, to_submit, ready ? 0 : 1,
+                     IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                     &arg, sizeof(arg)) == -1 &&
+        errno != EINTR && errno != ETIME && errno != EBUSY)
+    {
+        return -1;
+    }
+
+    /* Copy the completions out of the ring, so that the handlers can
+     * queue new requests while we dispatch them. */
+    unsigned int tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    head = *state->cq_head;
+    state->numdone = 0;
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        unsigned long long ud = cqe->user_data;
+
+        if (UD_OP(ud) == OP_IGNORE) continue;
+        if (UD_OP(ud) != OP_POLL) {
+            state->done[state->numdone++] = *cqe;
+            continue;
+        }
+
+        int fd = UD_FD(ud);
+        struct elUringFd *f = &state->fds[fd];
+        if (ud != f->poll_ud || !f->poll_armed)
+            continue; /* Replaced or removed meanwhile. */
+        f->poll_armed = 0;
+        elUringMarkDirty(state, fd); /* Arm it again, if still wanted. */
+        if (cqe->res < 0) continue;
+
+        int mask = 0;
+        if (cqe->res & POLLIN) mask |= EL_READABLE;
+        if (cqe->res & POLLOUT) mask |= EL_WRITABLE;
+        /* Errors and hangups are reported as both readable and writable,
+         * like in the epoll backend. */
+        if (cqe->res & (POLLERR|POLLHUP)) mask |= EL_READABLE|EL_WRITABLE;
+        el->fired[numevents].fd = fd;
+        el->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+    return numevents;
+}
+
+/* Call the handlers of the completed accepts, receives and writes.
+ * Returns the number of handlers called. */
+static int elApiProcessCompletions(struct eventLoop *el) {
+    struct elApiState *state = el->apidata;
+    int processed = 0;
+
+    for (int j = 0; j < state->numdone; j++) {
+        struct io_uring_cqe *cqe = &state->done[j];
+        unsigned long long ud = cqe->user_data;
+        int op = UD_OP(ud);
+
+        if (op == OP_WRITE) {
+            struct elWrite *w = (struct elWrite *)(uintptr_t)(ud & ~OP_MASK);
+            w->pending = 0;
+            w->proc(el, w, cqe->res, w->privdata);
+            processed++;
+            continue;
+        }
+
+        int fd = UD_FD(ud);
+        struct elUringFd *f = &state->fds[fd];
+        int current = UD_GEN(ud) == f->gen && f->async_op == op;
+        int bid = -1;
+        char *buf = NULL;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            buf = state->bufs + (size_t)bid*EL_URING_BUF_SIZE;
+        }
+
+        /* The multishot request is over: arm a new one, unless the
+         * registration was stopped, or it ended with the stream. */
+        if (current && !(cqe->flags & IORING_CQE_F_MORE) &&
+            ud == f->async_ud && f->async_armed)
+        {
+            f->async_armed = 0;
+            if (op == OP_RECV && cqe->res <= 0 && cqe->res != -ENOBUFS)
+                f->async_active = 0;
+            if (f->async_active) elUringMarkDirty(state, fd);
+        }
+
+        if (!current) {
+            /* Nobody is interested anymore: don't leak what the kernel
+             * handed us. */
+            if (op == OP_ACCEPT && cqe->res >= 0) close(cqe->res);
+        } else if (cqe->res != -ECANCELED && cqe->res != -ENOBUFS) {
+            /* Stopped registrations still get what already completed:
+             * an accepted connection or received data can't be lost. */
+            if (op == OP_ACCEPT)
+                ((elAcceptProc *)f->proc)(el, fd, cqe->res, f->privdata);
+            else
+                ((elRecvProc *)f->proc)(el, fd, buf, cqe->res, f->privdata);
+            processed++;
+        }
+        if (bid != -1) elUringRecycleBuffer(state, bid);
+    }
+    state->numdone = 0;
+    return processed;
+}
+
+/* Register a completion based operation on 'fd'. */
+static int elApiAsyncStart(struct eventLoop *el, int fd, int op, void *proc,
+                           void *privdata)
+{
+    struct elApiState *state = el->apidata;
+    struct elUringFd *f = &state->fds[fd];
+
+    if (f->async_op && f->async_op != op) f->gen++;
+    f->async_op = op;
+    f->async_active = 1;
+    f->proc = proc;
+    f->privdata = privdata;
+    elUringMarkDirty(state, fd);
+    return 0;
+}
+
+static int elApiAsyncAccept(struct eventLoop *el, int fd, elAcceptProc *proc,
+                            void *privdata)
+{
+    return elApiAsyncStart(el, fd, OP_ACCEPT, (void *)proc, privdata);
+}
+
+static int elApiAsyncRecv(struct eventLoop *el, int fd, elRecvProc *proc,
+                          void *privdata)
+{
+    return elApiAsyncStart(el, fd, OP_RECV, (void *)proc, privdata);
+}
+
+static void elApiAsyncStop(struct eventLoop *el, int fd) {
+    struct elApiState *state = el->apidata;
+    struct elUringFd *f = &state->fds[fd];
+
+    if (!f->async_op) return;
+    f->async_active = 0;
+    elUringMarkDirty(state, fd);
+}
+
+static void elApiAsyncCancel(struct eventLoop *el, int fd) {
+    struct elApiState *state = el->apidata;
+    struct elUringFd *f = &state->fds[fd];
+
+    if (!f->async_op) return;
+    /* Cancel the request now: the descriptor is about to be closed, and
+     * its number reused. */
+    if (f->async_armed) {
+        struct io_uring_sqe *sqe = elUringGetSqe(state);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = f->async_ud;
+            sqe->user_data = OP_IGNORE;
+        }
+    }
+    f->gen++;
+    f->async_op = 0;
+    f->async_armed = 0;
+    f->async_active = 0;
+}
+
+static int elApiAsyncWritev(struct eventLoop *el, struct elWrite *w, int fd,
+                            const struct iovec *iov, int iovcnt)
+{
+    struct io_uring_sqe *sqe = elUringGetSqe(el->apidata);
+
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->off = (unsigned long long)-1; /* Current position: for sockets
+                                          and pipes alike. */
+    sqe->user_data = (unsigned long long)(uintptr_t)w | OP_WRITE;
+    return 0;
+}
+
+static void elApiAsyncCancelWrite(struct eventLoop *el, struct elWrite *w) {
+    struct io_uring_sqe *sqe = elUringGetSqe(el->apidata);
+
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long long)(uintptr_t)w | OP_WRITE;
+    sqe->user_data = OP_IGNORE;
+}
+
+static const char *elApiName(void) {
+    return "io_uring";
+}
@@ -0,0 +1,504 @@
+/*
+ * A small event loop, in the spirit of the Redis "ae" library.
+ *
+ * Descriptors are registered with the events we are interested in
+ * (readable, writable or both) and a handler. elProcessEvents() asks the
+ * kernel which descriptors are ready and only calls the handlers of those,
+ * so the cost of a wakeup follows the activity and not the number of
+ * connected clients.
+ *
+ * Timers live in a hierarchical timing wheel, arming, disarming and
+ * expiring each of them costs O(1) however many there are. The wait for
+ * events ends at the next timer deadline.
+ *
+ * The multiplexing layer is selected at compile time: epoll on Linux,
+ * kqueue on BSD and macOS, select(2) everywhere else. Define USE_SELECT to
+ * force the select(2) backend, or USE_IO_URING to use io_uring on Linux.
+ *
+ * The io_uring backend also performs I/O on behalf of the caller: accepts,
+ * receives and writes are submitted to the kernel and their handlers are
+ * called when they complete, all the requests of an iteration costing a
+ * single system call. The other backends don't, see elAsyncIO().
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifdef USE_IO_URING
+#define _GNU_SOURCE /* For syscall() and the mmap() flags of el_uring.c. */
+#endif
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eventloop.h"
+#include "chatlib.h"
+
+#define UNUSED(V) ((void) V)
+
+/* Include the best multiplexing layer supported by this system. */
+#if defined(__linux__) && defined(USE_IO_URING)
+    #include "el_uring.c"
+#elif defined(__linux__) && !defined(USE_SELECT)
+    #include "el_epoll.c"
+#elif (defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+       defined(__NetBSD__) || defined(__DragonFly__)) && !defined(USE_SELECT)
+    #include "el_kqueue.c"
+#else
+    #include "el_select.c"
+#endif
+
+/* Backends without asynchronous I/O: the operations are not supported. */
+#ifndef EL_HAVE_ASYNC_IO
+static int elApiAsyncAccept(struct eventLoop *el, int fd, elAcceptProc *proc,
+                            void *privdata)
+{
+    UNUSED(el); UNUSED(fd); UNUSED(proc); UNUSED(privdata);
+    errno = ENOSYS;
+    return -1;
+}
+
+static int elApiAsyncRecv(struct eventLoop *el, int fd, elRecvProc *proc,
+                          void *privdata)
+{
+    UNUSED(el); UNUSED(fd); UNUSED(proc); UNUSED(privdata);
+    errno = ENOSYS;
+    return -1;
+}
+
+static void elApiAsyncStop(struct eventLoop *el, int fd) {
+    UNUSED(el); UNUSED(fd);
+}
+
+static void elApiAsyncCancel(struct eventLoop *el, int fd) {
+    UNUSED(el); UNUSED(fd);
+}
+
+static int elApiAsyncWritev(struct eventLoop *el, struct elWrite *w, int fd,
+                            const struct iovec *iov, int iovcnt)
+{
+    UNUSED(el); UNUSED(w); UNUSED(fd); UNUSED(iov); UNUSED(iovcnt);
+    errno = ENOSYS;
+    return -1;
+}
+
+static void elApiAsyncCancelWrite(struct eventLoop *el, struct elWrite *w) {
+    UNUSED(el); UNUSED(w);
+}
+
+static int elApiProcessCompletions(struct eventLoop *el) {
+    UNUSED(el);
+    return 0;
+}
+#endif
+
+/* Create an event loop able to track descriptors up to 'setsize'-1.
+ * The set grows on demand when higher descriptors are registered.
+ * Returns NULL if the backend could not be initialized. */
+struct eventLoop *elCreateEventLoop(int setsize) {
+    struct eventLoop *el = chatMalloc(sizeof(*el));
+
+    el->events = chatMalloc(sizeof(struct elFileEvent)*setsize);
+    el->fired = chatMalloc(sizeof(struct elFiredEvent)*setsize);
+    el->setsize = setsize;
+    el->maxfd = -1;
+    el->timer_now = mstime();
+    el->numtimers = 0;
+    memset(el->wheel, 0, sizeof(el->wheel));
+    memset(el->wheel_used, 0, sizeof(el->wheel_used));
+    if (elApiCreate(el) == -1) {
+        free(el->events);
+        free(el->fired);
+        free(el);
+        return NULL;
+    }
+
+    /* Events with mask == EL_NONE are not set. So let's initialize the
+     * vector with it. */
+    for (int j = 0; j < setsize; j++) el->events[j].mask = EL_NONE;
+    return el;
+}
+
+/* Release the event loop and the backend state. Registered descriptors
+ * are not closed. */
+void elDeleteEventLoop(struct eventLoop *el) {
+    elApiFree(el);
+    free(el->events);
+    free(el->fired);
+    free(el);
+}
+
+/* Resize the maximum set size of the event loop.
+ * If the requested set size is smaller than the current set size, but
+ * there is already a file descriptor in use that is >= the requested
+ * set size minus one, EL_ERR is returned and the operation is not
+ * performed at all. Otherwise EL_OK is returned. */
+int elResizeSetSize(struct eventLoop *el, int setsize) {
+    if (setsize == el->setsize) return EL_OK;
+    if (el->maxfd >= setsize) return EL_ERR;
+    if (elApiResize(el, setsize) == -1) return EL_ERR;
+
+    el->events = chatRealloc(el->events, sizeof(struct elFileEvent)*setsize);
+    el->fired = chatRealloc(el->fired, sizeof(struct elFiredEvent)*setsize);
+
+    /* Make sure that if we created new slots, they are initialized with
+     * an EL_NONE mask. */
+    for (int j = el->setsize; j < setsize; j++) el->events[j].mask = EL_NONE;
+    el->setsize = setsize;
+    return EL_OK;
+}
+
+/* Make sure 'fd' fits in the set of tracked descriptors, growing it if
+ * needed. Returns EL_ERR with errno set to ERANGE if it can't. */
+static int elFitSetSize(struct eventLoop *el, int fd) {
+    if (fd < el->setsize) return EL_OK;
+
+    int setsize = el->setsize*2;
+    if (setsize <= fd) setsize = fd+1;
+    if (elResizeSetSize(el, setsize) == EL_ERR) {
+        errno = ERANGE;
+        return EL_ERR;
+    }
+    return EL_OK;
+}
+
+/* Register interest for 'mask' events on 'fd', calling 'proc' when they
+ * fire. Masks are merged with the events already registered for the
+ * same descriptor. Returns EL_OK on success, EL_ERR on error (errno is
+ * set to ERANGE when the backend can't track a descriptor that high). */
+int elCreateFileEvent(struct eventLoop *el, int fd, int mask,
+                      elFileProc *proc, void *privdata)
+{
+    if (elFitSetSize(el, fd) == EL_ERR) return EL_ERR;
+
+    struct elFileEvent *fe = &el->events[fd];
+
+    if (elApiAddEvent(el, fd, mask) == -1) return EL_ERR;
+    fe->mask |= mask;
+    if (mask & EL_READABLE) fe->rfileProc = proc;
+    if (mask & EL_WRITABLE) fe->wfileProc = proc;
+    fe->privdata = privdata;
+    if (fd > el->maxfd) el->maxfd = fd;
+    return EL_OK;
+}
+
+/* Remove interest for 'mask' events on 'fd'. */
+void elDeleteFileEvent(struct eventLoop *el, int fd, int mask) {
+    if (fd >= el->setsize) return;
+    struct elFileEvent *fe = &el->events[fd];
+    if (fe->mask == EL_NONE) return;
+
+    /* Only touch the backend for events that are actually set. */
+    mask &= fe->mask;
+    if (mask == EL_NONE) return;
+
+    elApiDelEvent(el, fd, mask);
+    fe->mask = fe->mask & (~mask);
+    if (fd == el->maxfd && fe->mask == EL_NONE) {
+        /* Update the max fd. */
+        int j;
+
+        for (j = el->maxfd-1; j >= 0; j--)
+            if (el->events[j].mask != EL_NONE) break;
+        el->maxfd = j;
+    }
+}
+
+/* Return the mask of the events registered for 'fd'. */
+int elGetFileEvents(struct eventLoop *el, int fd) {
+    if (fd >= el->setsize) return 0;
+    return el->events[fd].mask;
+}
+
+/* =================================== Timers ==================================
+ * A timer expiring within EL_WHEEL_SIZE milliseconds is in the slot of its
+ * expire time at level 0. Farther timers go to the upper levels, each one
+ * EL_WHEEL_SIZE times coarser: when level 0 wraps around, the timers of
+ * the next slot of level 1 are moved down (cascaded) to the slots of level
+ * 0 they now fit in, and so on for the levels above.
+ * =========================================================================== */
+
+/* Initialize an unarmed timer calling 'proc' when it expires. */
+void elTimerInit(struct elTimer *t, elTimerProc *proc, void *privdata) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->when = 0;
+    t->slot = -1;
+    t->proc = proc;
+    t->privdata = privdata;
+}
+
+/* Return true if the timer is armed. */
+int elTimerPending(struct elTimer *t) {
+    return t->pprev != NULL;
+}
+
+/* Put the timer in the slot of the wheel its expire time belongs to. */
+static void elWheelLink(struct eventLoop *el, struct elTimer *t) {
+    long long when = t->when < el->timer_now ? el->timer_now : t->when;
+    long long delta = when - el->timer_now;
+    int level = 0;
+
+    while (level < EL_WHEEL_LEVELS-1 &&
+           delta >= 1LL << (EL_WHEEL_BITS*(level+1))) level++;
+    /* Beyond the range of the wheel: park it in the farthest slot, it
+     * will be linked again when that slot is cascaded. */
+    if (delta >= 1LL << (EL_WHEEL_BITS*EL_WHEEL_LEVELS))
+        when = el->timer_now + (1LL << (EL_WHEEL_BITS*EL_WHEEL_LEVELS)) - 1;
+
+    int idx = (when >> (EL_WHEEL_BITS*level)) & EL_WHEEL_MASK;
+    struct elTimer **slot = &el->wheel[level][idx];
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    t->slot = level*EL_WHEEL_SIZE+idx;
+    el->wheel_used[level][idx/64] |= 1ULL << (idx%64);
+}
+
+/* Remove the timer from its slot. */
+static void elWheelUnlink(struct eventLoop *el, struct elTimer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    if (t->slot != -1) {
+        int level = t->slot / EL_WHEEL_SIZE, idx = t->slot % EL_WHEEL_SIZE;
+        if (el->wheel[level][idx] == NULL)
+            el->wheel_used[level][idx/64] &= ~(1ULL << (idx%64));
+    }
+}
+
+/* Arm the timer to expire in 'ms' milliseconds. If it was already armed
+ * the previous expire time is forgotten. */
+void elAddTimer(struct eventLoop *el, struct elTimer *t, long long ms) {
+    if (elTimerPending(t)) elDelTimer(el, t);
+    t->when = mstime()+ms;
+    elWheelLink(el, t);
+    el->numtimers++;
+}
+
+/* Disarm the timer, if armed. */
+void elDelTimer(struct eventLoop *el, struct elTimer *t) {
+    if (!elTimerPending(t)) return;
+    elWheelUnlink(el, t);
+    el->numtimers--;
+}
+
+/* Detach and return the timers of a slot. */
+static struct elTimer *elWheelTake(struct eventLoop *el, int level, int idx) {
+    struct elTimer *list = el->wheel[level][idx];
+    el->wheel[level][idx] = NULL;
+    el->wheel_used[level][idx/64] &= ~(1ULL << (idx%64));
+    return list;
+}
+
+/* Return the distance from 'start' of the first non empty slot of a
+ * level, going around the wheel, or -1 if the level is empty. */
+static int elWheelFindFrom(unsigned long long *used, int start) {
+    for (int k = 0; k < EL_WHEEL_SIZE; ) {
+        int idx = (start+k) & EL_WHEEL_MASK;
+        unsigned long long word = used[idx/64] >> (idx%64);
+        if (word) return k+__builtin_ctzll(word);
+        k += 64 - idx%64;
+    }
+    return -1;
+}
+
+/* Return the time (in mstime() milliseconds) of the next wheel activity,
+ * or -1 if no timer is armed. For timers in the upper levels this is the
+ * time they are cascaded, which is never later than their expire time. */
+static long long elNextTimerTime(struct eventLoop *el) {
+    long long next = -1;
+
+    if (el->numtimers == 0) return -1;
+    for (int level = 0; level < EL_WHEEL_LEVELS; level++) {
+        /* The slots of the upper levels are cascaded when we enter the
+         * block of time they cover: skip the current block if we already
+         * did it. */
+        long long base = el->timer_now >> (EL_WHEEL_BITS*level);
+        if (el->timer_now & ((1LL << (EL_WHEEL_BITS*level))-1)) base++;
+
+        int k = elWheelFindFrom(el->wheel_used[level], base & EL_WHEEL_MASK);
+        if (k == -1) continue;
+        long long when = (base+k) << (EL_WHEEL_BITS*level);
+        if (next == -1 || when < next) next = when;
+    }
+    return next;
+}
+
+/* Fire the timers expired up to now. Returns the number of timers fired. */
+static int elProcessTimers(struct eventLoop *el) {
+    long long now = mstime();
+    int processed = 0;
+
+    while (el->timer_now <= now && el->numtimers) {
+        long long tick = el->timer_now;
+        int idx = tick & EL_WHEEL_MASK;
+
+        /* Level 0 wrapped around: move the timers of the next block
+         * down, and the same for the levels above when they wrap too. */
+        if (idx == 0) {
+            for (int level = 1; level < EL_WHEEL_LEVELS; level++) {
+                int lidx = (tick >> (EL_WHEEL_BITS*level)) & EL_WHEEL_MASK;
+                struct elTimer *t = elWheelTake(el, level, lidx);
+                while (t) {
+                    struct elTimer *next = t->next;
+                    elWheelLink(el, t);
+                    t = next;
+                }
+                if (lidx != 0) break;
+            }
+        }
+
+        /* Fire the timers of this millisecond. They are detached first,
+         * so a handler can arm or disarm any timer, itself included. */
+        struct elTimer *pending = elWheelTake(el, 0, idx);
+        if (pending) pending->pprev = &pending;
+        for (struct elTimer *t = pending; t; t = t->next) t->slot = -1;
+        el->timer_now++;
+
+        while (pending) {
+            struct elTimer *t = pending;
+            elWheelUnlink(el, t);
+            el->numtimers--;
+            t->proc(el, t, t->privdata);
+            processed++;
+        }
+    }
+    if (el->numtimers == 0) el->timer_now = now+1;
+    return processed;
+}
+
+/* Wait for events up to the time specified by 'tvp' (forever if NULL),
+ * or up to the next timer deadline if it comes first, then call the
+ * handlers of the descriptors that are ready and of the expired timers.
+ * Returns the number of fired descriptors and timers (0 on timeout), or
+ * -1 if the backend reported an error. */
+int elProcessEvents(struct eventLoop *el, struct timeval *tvp) {
+    struct timeval tv;
+    long long next = elNextTimerTime(el);
+
+    if (next != -1) {
+        long long ms = next - mstime();
+        if (ms < 0) ms = 0;
+        if (tvp == NULL || ms*1000 < tvp->tv_sec*1000000LL + tvp->tv_usec) {
+            tv.tv_sec = ms/1000;
+            tv.tv_usec = (ms%1000)*1000;
+            tvp = &tv;
+        }
+    }
+
+    int numevents = elApiPoll(el, tvp);
+    int completed = numevents == -1 ? 0 : elApiProcessCompletions(el);
+
+    for (int j = 0; j < numevents; j++) {
+        int fd = el->fired[j].fd;
+        int mask = el->fired[j].mask;
+        int fired = 0; /* Number of events fired for current fd. */
+        struct elFileEvent *fe = &el->events[fd];
+
+        if (fe->mask & mask & EL_READABLE) {
+            fe->rfileProc(el, fd, fe->privdata, mask);
+            fired++;
+            /* The handler may have resized the events vector, or
+             * unregistered this very descriptor: refresh the pointer. */
+            fe = &el->events[fd];
+        }
+
+        /* Fire the writable event, unless it has the same handler as the
+         * readable one, that was already called above. */
+        if (fe->mask & mask & EL_WRITABLE) {
+            if (!fired || fe->wfileProc != fe->rfileProc)
+                fe->wfileProc(el, fd, fe->privdata, mask);
+        }
+    }
+    if (numevents == -1) return -1;
+    return numevents + completed + elProcessTimers(el);
+}
+
+/* Return the name of the multiplexing backend in use. */
+const char *elGetApiName(void) {
+    return elApiName();
+}
+
+/* ============================= Asynchronous I/O ==============================
+ * With backends able to do I/O on our behalf, instead of waiting for the
+ * descriptor to be ready and then calling accept(2), read(2) or write(2),
+ * the operation itself is requested, and a handler gets its result. For
+ * the other backends these calls fail with ENOSYS: check elAsyncIO().
+ * =========================================================================== */
+
+/* Return true if the backend supports the asynchronous operations. */
+int elAsyncIO(void) {
+#ifdef EL_HAVE_ASYNC_IO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Accept the connections arriving on the listening socket 'fd', calling
+ * 'proc' with every new (non blocking) descriptor, until stopped. */
+int elAsyncAccept(struct eventLoop *el, int fd, elAcceptProc *proc,
+                  void *privdata)
+{
+    if (elFitSetSize(el, fd) == EL_ERR) return EL_ERR;
+    if (elApiAsyncAccept(el, fd, proc, privdata) == -1) return EL_ERR;
+    return EL_OK;
+}
+
+/* Receive from 'fd', calling 'proc' with every chunk of data, until
+ * stopped or until the end of the stream or an error is reported. */
+int elAsyncRecv(struct eventLoop *el, int fd, elRecvProc *proc,
+                void *privdata)
+{
+    if (elFitSetSize(el, fd) == EL_ERR) return EL_ERR;
+    if (elApiAsyncRecv(el, fd, proc, privdata) == -1) return EL_ERR;
+    return EL_OK;
+}
+
+/* Stop accepting or receiving on 'fd'. What the kernel already completed
+ * is still passed to the handler: connections and data are never lost. */
+void elAsyncStop(struct eventLoop *el, int fd) {
+    if (fd >= el->setsize) return;
+    elApiAsyncStop(el, fd);
+}
+
+/* Stop accepting or receiving on 'fd', and forget about it: the handler is
+ * never called again. To use before closing the descriptor. */
+void elAsyncCancel(struct eventLoop *el, int fd) {
+    if (fd >= el->setsize) return;
+    elApiAsyncCancel(el, fd);
+}
+
+/* Initialize a write calling 'proc' when it completes. */
+void elWriteInit(struct elWrite *w, elWriteProc *proc, void *privdata) {
+    w->pending = 0;
+    w->proc = proc;
+    w->privdata = privdata;
+}
+
+/* Write the 'iovcnt' buffers of 'iov' to 'fd'. The write is submitted with
+ * the other requests of this iteration: 'iov' must stay valid until the
+ * handler is called. Returns EL_ERR if the write could not be queued, or
+ * if the previous one is still pending. */
+int elAsyncWritev(struct eventLoop *el, struct elWrite *w, int fd,
+                  const struct iovec *iov, int iovcnt)
+{
+    if (w->pending) {
+        errno = EBUSY;
+        return EL_ERR;
+    }
+    if (elApiAsyncWritev(el, w, fd, iov, iovcnt) == -1) return EL_ERR;
+    w->pending = 1;
+    return EL_OK;
+}
+
+/* Ask the kernel to give up a pending write. Its handler is still called,
+ * with -ECANCELED or with what was actually written. */
+void elAsyncCancelWrite(struct eventLoop *el, struct elWrite *w) {
+    if (w->pending) elApiAsyncCancelWrite(el, w);
+}
@@ -0,0 +1,136 @@
+/*
+ * A small event loop, in the spirit of the Redis "ae" library.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define EL_OK 0
+#define EL_ERR -1
+
+#define EL_NONE 0       /* No events registered. */
+#define EL_READABLE 1   /* Fire when descriptor is readable. */
+#define EL_WRITABLE 2   /* Fire when descriptor is writable. */
+
+#define EL_DEFAULT_SETSIZE 1024 /* Initial number of tracked descriptors. */
+
+/* Timers are kept in a hierarchical wheel with millisecond resolution:
+ * EL_WHEEL_LEVELS levels of EL_WHEEL_SIZE slots each, every level
+ * EL_WHEEL_SIZE times coarser than the one below. */
+#define EL_WHEEL_BITS 8
+#define EL_WHEEL_SIZE (1<<EL_WHEEL_BITS)
+#define EL_WHEEL_MASK (EL_WHEEL_SIZE-1)
+#define EL_WHEEL_LEVELS 4   /* Up to 2^32 milliseconds, about 49 days. */
+
+struct eventLoop;
+
+/* File event handler: called with the descriptor, the private data
+ * registered with it and the mask of the events that fired. */
+typedef void elFileProc(struct eventLoop *el, int fd, void *privdata, int mask);
+
+struct elTimer;
+
+/* Timer handler: called once when the timer expires. It can re-arm it. */
+typedef void elTimerProc(struct eventLoop *el, struct elTimer *t,
+                         void *privdata);
+
+/* Completion handlers of the asynchronous operations (see elAsyncIO()).
+ * 'res' is what the system call would return, or -errno on error: the
+ * descriptor of the accepted connection, or the number of bytes received
+ * (0 at end of stream) into 'buf', that is only valid during the call. */
+typedef void elAcceptProc(struct eventLoop *el, int fd, int res,
+                          void *privdata);
+typedef void elRecvProc(struct eventLoop *el, int fd, char *buf, int res,
+                        void *privdata);
+
+struct elWrite;
+
+/* Completion handler of a write: 'res' is the number of bytes written,
+ * or -errno. */
+typedef void elWriteProc(struct eventLoop *el, struct elWrite *w,
+                         ssize_t res, void *privdata);
+
+/* A registered file event. Slots are indexed by file descriptor. */
+struct elFileEvent {
+    int mask;               // One of EL_(READABLE|WRITABLE) or both.
+    elFileProc *rfileProc;  // Handler for readable events.
+    elFileProc *wfileProc;  // Handler for writable events.
+    void *privdata;         // Passed back to the handlers.
+};
+
+/* A descriptor reported as ready by the backend. */
+struct elFiredEvent {
+    int fd;
+    int mask;
+};
+
+/* A timer. It is meant to be embedded in the object it refers to, so
+ * arming and disarming it never allocates, and both take constant time. */
+struct elTimer {
+    struct elTimer *next;   // Next timer in the same wheel slot.
+    struct elTimer **pprev; // Pointer to us in the slot, NULL if not armed.
+    long long when;         // Expire time, in mstime() milliseconds.
+    int slot;               // Wheel slot, level*EL_WHEEL_SIZE+index, or
+                            // -1 while being fired.
+    elTimerProc *proc;
+    void *privdata;
+};
+
+/* An asynchronous write. Like timers it is meant to be embedded in the
+ * object it refers to. The object, and the data written, must stay valid
+ * until 'proc' is called, that always happens, even if the write is
+ * cancelled. */
+struct elWrite {
+    int pending;            // Submitted, and 'proc' not called yet.
+    elWriteProc *proc;
+    void *privdata;
+};
+
+/* The event loop state. */
+struct eventLoop {
+    int maxfd;      // Highest descriptor currently registered.
+    int setsize;    // Number of slots in events/fired.
+    struct elFileEvent *events; // Registered events.
+    struct elFiredEvent *fired; // Fired events, filled by the backend.
+    void *apidata;  // Backend private state (epoll, kqueue, select).
+    long long timer_now; // Next millisecond of the wheel to process.
+    int numtimers;       // Armed timers.
+    struct elTimer *wheel[EL_WHEEL_LEVELS][EL_WHEEL_SIZE];
+    unsigned long long wheel_used[EL_WHEEL_LEVELS][EL_WHEEL_SIZE/64];
+                         // Bitmap of the non empty slots.
+};
+
+struct eventLoop *elCreateEventLoop(int setsize);
+void elDeleteEventLoop(struct eventLoop *el);
+int elResizeSetSize(struct eventLoop *el, int setsize);
+int elCreateFileEvent(struct eventLoop *el, int fd, int mask,
+                      elFileProc *proc, void *privdata);
+void elDeleteFileEvent(struct eventLoop *el, int fd, int mask);
+int elGetFileEvents(struct eventLoop *el, int fd);
+int elProcessEvents(struct eventLoop *el, struct timeval *tvp);
+void elTimerInit(struct elTimer *t, elTimerProc *proc, void *privdata);
+void elAddTimer(struct eventLoop *el, struct elTimer *t, long long ms);
+void elDelTimer(struct eventLoop *el, struct elTimer *t);
+int elTimerPending(struct elTimer *t);
+const char *elGetApiName(void);
+
+int elAsyncIO(void);
+int elAsyncAccept(struct eventLoop *el, int fd, elAcceptProc *proc,
+                  void *privdata);
+int elAsyncRecv(struct eventLoop *el, int fd, elRecvProc *proc,
+                void *privdata);
+void elAsyncStop(struct eventLoop *el, int fd);
+void elAsyncCancel(struct eventLoop *el, int fd);
+void elWriteInit(struct elWrite *w, elWriteProc *proc, void *privdata);
+int elAsyncWritev(struct eventLoop *el, struct elWrite *w, int fd,
+                  const struct iovec *iov, int iovcnt);
+void elAsyncCancelWrite(struct eventLoop *el, struct elWrite *w);
+
+#endif // EVENTLOOP_H
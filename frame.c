@@ -0,0 +1,126 @@
+/*
+ * Length prefixed binary framing.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include "frame.h"
+#include "circular_buffer.h"
+
+/* Write 'val' as a varint to buf, that must have room for
+ * FRAME_MAX_VARINT bytes. Returns the varint length. */
+int frame_encode_varint(unsigned char *buf, size_t val) {
+    int n = 0;
+
+    while (val >= 0x80) {
+        buf[n++] = (val & 0x7f) | 0x80;
+        val >>= 7;
+    }
+    buf[n++] = val;
+    return n;
+}
+
+/* Parse the varint at the start of the 'n' bytes of buf into *val.
+ * Returns the varint length, 0 if more bytes are needed to tell, or -1 if
+ * it is longer than FRAME_MAX_VARINT bytes. */
+int frame_decode_varint(const unsigned char *buf, int n, size_t *val) {
+    size_t v = 0;
+
+    for (int j = 0; j < n && j < FRAME_MAX_VARINT; j++) {
+        v |= (size_t)(buf[j] & 0x7f) << (7*j);
+        if (buf[j] & 0x80) continue;
+        *val = v;
+        return j+1;
+    }
+    return n < FRAME_MAX_VARINT ? 0 : -1;
+}
+
+/* Write the header of a frame of type 'type' carrying 'len' bytes to buf,
+ * that must have room for FRAME_MAX_HEADER bytes. Returns the header
+ * length. */
+int frame_encode_header(unsigned char *buf, size_t len, int type) {
+    int n = frame_encode_varint(buf, len);
+
+    buf[n++] = type;
+    return n;
+}
+
+/* Parse the header at the start of the 'n' bytes of buf, setting *len to
+ * the payload length and *type to the frame type. Returns the header
+ * length, 0 if more bytes are needed to tell, or -1 if the varint is
+ * longer than FRAME_MAX_VARINT bytes. */
+int frame_decode_header(const unsigned char *buf, int n, size_t *len,
+                        int *type)
+{
+    int j = frame_decode_varint(buf, n, len);
+
+    /* The varint ends here, the type byte follows. */
+    if (j <= 0) return j;
+    if (j == n) return 0;
+    *type = buf[j];
+    return j+1;
+}
+
+/* ============================== Splitting ==================================
+ * The loops turning the bytes read from a client into messages, lines or
+ * frames, shared by the server and by the benchmarks of circbuf-test, so
+ * that they measure the code actually serving the clients.
+ * =========================================================================== */
+
+/* Call proc() for every complete line at the head of 'cb', with its
+ * length, separator included. The separators are located with a single
+ * scan of the bytes not scanned yet: '*scanned' is how many bytes at the
+ * head of the buffer are known not to contain 'sep', and is updated.
+ * Returns 1 if proc() stopped the loop, 0 once all the complete lines
+ * were consumed. */
+int frame_split_lines(struct Circbuf *cb, int *scanned, char sep,
+                      frameLineProc *proc, void *privdata)
+{
+    while (1) {
+        int pos[FRAME_SEP_BATCH];
+        int found = circbuf_find_all(cb, *scanned, sep, pos, FRAME_SEP_BATCH);
+        int consumed = 0;
+
+        *scanned = 0;
+        for (int k = 0; k < found; k++) {
+            int len = pos[k]+1-consumed;
+            if (!proc(privdata, len)) return 1;
+            consumed += len;
+        }
+
+        /* More separators than what a scan returns: scan again. */
+        if (found == FRAME_SEP_BATCH) continue;
+        *scanned = circbuf_len(cb);
+        return 0;
+    }
+}
+
+/* Call proc() for every frame at the head of 'cb' whose payload is
+ * complete, with its type, header length and payload length. Frames with
+ * a payload longer than 'maxlen' are passed as soon as their header is
+ * complete instead, for the caller to skip them. When more bytes are
+ * needed, FRAME_SPLIT_MORE is returned and '*need' set to the size the
+ * buffer must have to hold the frame at its head (0 if its header is
+ * still incomplete). */
+int frame_split(struct Circbuf *cb, size_t maxlen, size_t *need,
+                frameSplitProc *proc, void *privdata)
+{
+    while (1) {
+        unsigned char hdr[FRAME_MAX_HEADER];
+        size_t len;
+        int type;
+        int avail = circbuf_len(cb);
+        int n = circbuf_peek_to_linear((char*)hdr, cb, sizeof(hdr));
+        int hdrlen = frame_decode_header(hdr, n, &len, &type);
+
+        *need = 0;
+        if (hdrlen == 0) return FRAME_SPLIT_MORE;
+        if (hdrlen == -1) return FRAME_SPLIT_INVALID;
+        if (len <= maxlen && (size_t)avail < hdrlen+len) {
+            *need = hdrlen+len;
+            return FRAME_SPLIT_MORE;
+        }
+        if (!proc(privdata, type, hdrlen, len)) return FRAME_SPLIT_STOPPED;
+    }
+}
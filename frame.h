@@ -0,0 +1,64 @@
+/*
+ * Length prefixed binary framing.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+struct Circbuf;
+
+/* A frame is the payload length as an unsigned LEB128 varint (7 bits per
+ * byte, least significant group first, high bit set on all the bytes but
+ * the last one), a type byte, then the payload itself. The payload can
+ * contain any byte, but the newlines of the text of a FRAME_MSG are
+ * replaced with spaces by the server: a message is always a single line
+ * for the line mode clients. */
+#define FRAME_MSG 0 /* A chat message. */
+#define FRAME_CMD 1 /* A command, like a line mode one without the "/". */
+#define FRAME_ZMSG 2 /* A FRAME_MSG payload compressed with the codec
+                        agreed by /binary: the length of the original
+                        payload as a varint, then the compressed bytes. */
+
+/* Frames of the links between the nodes of a cluster. */
+#define FRAME_PEER_HELLO 16 /* Node id (8 bytes) and port accepting peers
+                               (2 bytes), big endian, then the mask of the
+                               codecs it has (1 byte). Always the first. */
+#define FRAME_PEER_SUB 17   /* A room name: the node has members there. */
+#define FRAME_PEER_UNSUB 18 /* A room name: the node has no more members. */
+#define FRAME_PEER_MSG 19   /* Room name length byte, room name, message. */
+#define FRAME_PEER_NODES 20 /* Space separated host:port of other nodes. */
+#define FRAME_PEER_ZMSG 21  /* Room name length byte, room name, then the
+                               payload of a FRAME_ZMSG frame of the message
+                               without its trailing newline. */
+
+#define FRAME_MAX_VARINT 5 /* Enough for 32 bit lengths. */
+#define FRAME_MAX_HEADER (FRAME_MAX_VARINT+1)
+#define FRAME_SEP_BATCH 64 /* Max separator positions found by a scan. */
+
+/* Results of frame_split(). */
+#define FRAME_SPLIT_MORE 0      /* More bytes are needed. */
+#define FRAME_SPLIT_STOPPED 1   /* The callback said to stop. */
+#define FRAME_SPLIT_INVALID -1  /* Undecodable header: the stream is lost. */
+
+/* Called by the splitting loops for every message at the head of the
+ * buffer. They must consume it and return 1, or leave it there and
+ * return 0 to stop. */
+typedef int frameLineProc(void *privdata, int len);
+typedef int frameSplitProc(void *privdata, int type, int hdrlen, size_t len);
+
+int frame_encode_varint(unsigned char *buf, size_t val);
+int frame_decode_varint(const unsigned char *buf, int n, size_t *val);
+int frame_encode_header(unsigned char *buf, size_t len, int type);
+int frame_decode_header(const unsigned char *buf, int n, size_t *len,
+                        int *type);
+int frame_split_lines(struct Circbuf *cb, int *scanned, char sep,
+                      frameLineProc *proc, void *privdata);
+int frame_split(struct Circbuf *cb, size_t maxlen, size_t *need,
+                frameSplitProc *proc, void *privdata);
+
+#endif // FRAME_H
@@ -0,0 +1,226 @@
+/*
+ * Asynchronous, leveled logging.
+ *
+ * Logging must never block the thread that logs (an event loop, most of
+ * the times) on whoever consumes the log: a terminal, a pipe, journald.
+ * So every thread formats its records into its own ring buffer, and a
+ * background thread drains all the rings every LOG_FLUSH_MS milliseconds
+ * with a single write(2). Each ring has one producer and one consumer,
+ * so no lock is needed on either side. When a ring is full the record is
+ * dropped and counted: the consumer reports how many were lost.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#define _XOPEN_SOURCE 700 /* For nanosleep() and localtime_r(). */
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "chatlib.h"
+#include "stats.h"
+
+/* The ring of a thread. Indexes are free running, like in Circbuf: the
+ * producer only writes 'head', the consumer only writes 'tail', and they
+ * sit in different cache lines. */
+struct logRing {
+    char *buf;
+    unsigned int head;      // Next byte to write (producer side).
+    unsigned long long dropped; // Records that did not fit.
+    char name[16];          // Of the thread, in the records.
+    char pad[STATS_CACHELINE];
+    unsigned int tail;      // Next byte to drain (consumer side).
+    unsigned long long dropped_reported; // Drops already logged.
+    struct logRing *next;   // All the rings, in a list.
+};
+
+int LogLevel = LL_NOTICE;
+static int LogFd = -1;
+static struct logRing *Rings;   // Only grows, so it is walked without locks.
+static pthread_mutex_t DrainLock = PTHREAD_MUTEX_INITIALIZER;
+static char *DrainBuf;          // Where the rings are gathered to write.
+static size_t DrainBufSize;
+
+static __thread struct logRing *MyRing;
+static __thread time_t MyTimeSec = -1;  // Second of MyTimeStr.
+static __thread char MyTimeStr[32];
+
+static const char *LevelNames[] = {"debug", "verbose", "notice", "warning"};
+static const char LevelMarks[] = ".-*#";
+
+/* Give the calling thread its ring, named 'name' in the records. Threads
+ * that log without calling this get a ring named after their first
+ * record. */
+void log_thread_init(const char *name) {
+    if (MyRing) return;
+
+    struct logRing *r = chatMalloc(sizeof(*r));
+    r->buf = chatMalloc(LOG_RING_SIZE);
+    r->head = r->tail = 0;
+    r->dropped = r->dropped_reported = 0;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+
+    /* Push it on the list, that is never shrunk. */
+    r->next = __atomic_load_n(&Rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&Rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    MyRing = r;
+}
+
+/* Format the current time, caching the part that changes once a second:
+ * records usually come in bursts within the same second. */
+static int log_timestamp(char *buf, size_t size) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != MyTimeSec) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(MyTimeStr, sizeof(MyTimeStr), "%d %b %Y %H:%M:%S", &tm);
+        MyTimeSec = ts.tv_sec;
+    }
+    return snprintf(buf, size, "%s.%03d", MyTimeStr,
+                    (int)(ts.tv_nsec/1000000));
+}
+
+/* Log a record, if 'level' is at least LogLevel. The record is formatted
+ * in the ring of the calling thread, nothing is written here. */
+void log_write(int level, const char *fmt, ...) {
+    if (level < LogLevel || LogFd == -1) return;
+    if (MyRing == NULL) log_thread_init("-");
+
+    char rec[LOG_MAX_LEN];
+    int len = snprintf(rec, sizeof(rec), "%d:%s ", (int)getpid(),
+                       MyRing->name);
+    len += log_timestamp(rec+len, sizeof(rec)-len);
+    len += snprintf(rec+len, sizeof(rec)-len, " %c ", LevelMarks[level]);
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec+len, sizeof(rec)-len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    len += n;
+    if (len > (int)sizeof(rec)-1) len = sizeof(rec)-1; /* Truncated. */
+    rec[len++] = '\n';
+
+    /* Copy it in the ring, in two parts if it wraps around. */
+    struct logRing *r = MyRing;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (r->head - tail) < (unsigned int)len) {
+        STAT_INC(r->dropped);
+        return;
+    }
+    unsigned int pos = r->head & (LOG_RING_SIZE-1);
+    unsigned int first = LOG_RING_SIZE - pos;
+    if (first > (unsigned int)len) first = len;
+    memcpy(r->buf+pos, rec, first);
+    memcpy(r->buf, rec+first, len-first);
+    __atomic_store_n(&r->head, r->head+len, __ATOMIC_RELEASE);
+}
+
+/* Append 'len' bytes to the drain buffer. */
+static size_t log_gather(size_t used, const char *p, size_t len) {
+    if (len == 0) return used;
+    if (used+len > DrainBufSize) {
+        DrainBufSize = (used+len)*2;
+        DrainBuf = chatRealloc(DrainBuf, DrainBufSize);
+    }
+    memcpy(DrainBuf+used, p, len);
+    return used+len;
+}
+
+/* Write out everything the rings hold, with a single write(2) unless it
+ * is short. The records of each thread keep their order. */
+void log_flush(void) {
+    pthread_mutex_lock(&DrainLock);
+    size_t used = 0;
+
+    for (struct logRing *r = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); r;
+         r = r->next)
+    {
+        unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned int pos = r->tail & (LOG_RING_SIZE-1);
+        unsigned int len = head - r->tail;
+        unsigned int first = LOG_RING_SIZE - pos;
+        if (first > len) first = len;
+
+        used = log_gather(used, r->buf+pos, first);
+        used = log_gather(used, r->buf, len-first);
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+        unsigned long long dropped = STAT_GET(r->dropped);
+        if (dropped != r->dropped_reported) {
+            char msg[128];
+            int n = snprintf(msg, sizeof(msg), "%d:%s %llu log records "
+                             "dropped, the log can't keep up\n",
+                             (int)getpid(), r->name,
+                             dropped - r->dropped_reported);
+            used = log_gather(used, msg, n);
+            r->dropped_reported = dropped;
+        }
+    }
+
+    size_t written = 0;
+    while (written < used) {
+        ssize_t n = write(LogFd, DrainBuf+written, used-written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break; /* Nowhere to report it: lose the batch. */
+        }
+        written += n;
+    }
+    pthread_mutex_unlock(&DrainLock);
+}
+
+/* Drain the rings forever. */
+static void *log_thread(void *arg) {
+    (void)arg;
+    struct timespec ts = {0, LOG_FLUSH_MS*1000000};
+
+    while(1) {
+        nanosleep(&ts, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+/* Start logging to 'fd' the records of level 'level' and above. The
+ * rings are also flushed at exit. Returns -1 on error, with errno set. */
+int log_init(int fd, int level) {
+    pthread_t thread;
+
+    LogFd = fd;
+    LogLevel = level;
+    if ((errno = pthread_create(&thread, NULL, log_thread, NULL)) != 0)
+        return -1;
+    pthread_detach(thread);
+    atexit(log_flush);
+    return 0;
+}
+
+/* Records dropped so far by all the threads. */
+unsigned long long log_dropped(void) {
+    unsigned long long dropped = 0;
+
+    for (struct logRing *r = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); r;
+         r = r->next)
+    {
+        dropped += STAT_GET(r->dropped);
+    }
+    return dropped;
+}
+
+/* Return the LL_* level called 'name', or -1 if there is none. */
+int log_level_from_name(const char *name) {
+    for (int j = 0; j <= LL_WARNING; j++)
+        if (!strcmp(name, LevelNames[j])) return j;
+    return -1;
+}
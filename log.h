@@ -0,0 +1,31 @@
+/*
+ * Asynchronous, leveled logging.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+/* Log levels, from the most verbose. */
+#define LL_DEBUG 0      /* Includes every chat message. */
+#define LL_VERBOSE 1    /* Connections and disconnections. */
+#define LL_NOTICE 2
+#define LL_WARNING 3
+
+#define LOG_MAX_LEN 1024        /* Longer records are truncated. */
+#define LOG_RING_SIZE (1<<20)   /* Bytes buffered by every thread. */
+#define LOG_FLUSH_MS 10         /* Interval of the background writes. */
+
+extern int LogLevel;
+
+int log_init(int fd, int level);
+void log_thread_init(const char *name);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+unsigned long long log_dropped(void);
+int log_level_from_name(const char *name);
+
+#endif // LOG_H
@@ -0,0 +1,66 @@
+/*
+ * Lock-free multi producer, single consumer queue.
+ *
+ * This is the intrusive queue described by Dmitry Vyukov: producers
+ * atomically swap the head and then link the previous head to the new
+ * node, so a push is wait-free and costs a single atomic exchange. The
+ * consumer walks the list from the tail without atomic read-modify-write
+ * operations at all.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include <stddef.h>
+
+#include "mpsc.h"
+
+/* Initialize an empty queue. */
+void mpsc_init(struct mpscQueue *q) {
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+/* Push 'n'. Can be called by any number of threads at the same time. */
+void mpsc_push(struct mpscQueue *q, struct mpscNode *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    struct mpscNode *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* Pop the oldest node, or return NULL if the queue is empty. Only one
+ * thread, the consumer, can call it.
+ *
+ * NULL is also returned if a producer is in the middle of a push: the
+ * node will be visible as soon as the push completes, so producers should
+ * notify the consumer only after mpsc_push() returns. */
+struct mpscNode *mpsc_pop(struct mpscQueue *q) {
+    struct mpscNode *tail = q->tail;
+    struct mpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    /* Skip the stub. */
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* 'tail' is the last node: if it is not the head as well a push is in
+     * progress. Otherwise put the stub back behind it, so that 'tail' can
+     * be detached. */
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+    mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
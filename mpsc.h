@@ -0,0 +1,33 @@
+/*
+ * Lock-free multi producer, single consumer queue.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#define MPSC_CACHELINE 64
+
+/* Intrusive node: embed it as the first member of the queued objects. */
+struct mpscNode {
+    struct mpscNode *next;
+};
+
+/* Producers only touch 'head', the consumer only touches 'tail': they
+ * live in different cache lines so that they don't bounce between the
+ * cores. */
+struct mpscQueue {
+    struct mpscNode *head;  // Last pushed node (producers side).
+    char pad1[MPSC_CACHELINE - sizeof(struct mpscNode *)];
+    struct mpscNode *tail;  // Next node to pop (consumer side).
+    struct mpscNode stub;   // Placeholder, keeps the list never empty.
+    char pad2[MPSC_CACHELINE - 2*sizeof(struct mpscNode *)];
+};
+
+void mpsc_init(struct mpscQueue *q);
+void mpsc_push(struct mpscQueue *q, struct mpscNode *n);
+struct mpscNode *mpsc_pop(struct mpscQueue *q);
+
+#endif // MPSC_H
@@ -0,0 +1,213 @@
+/*
+ * Append-only message log on memory mapped segments.
+ *
+ * Messages are copied into the mapping of the current segment, so they
+ * reach the page cache without a system call. A background thread makes
+ * them durable with a single msync(2) per interval for all the messages
+ * appended in the meantime, and takes care of the disk work of rotation:
+ * it closes the full segments and prepares the next one in advance.
+ *
+ * Segments are preallocated, so after a crash the last one may end with
+ * zero bytes that were never written: readers stop at the first of them.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#define _XOPEN_SOURCE 700 /* For posix_fallocate() and nanosleep(). */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "msglog.h"
+#include "chatlib.h"
+
+/* Create, preallocate and map the next segment, of 'size' bytes. Segment
+ * numbers already on disk are skipped: the log resumes after them. This
+ * does not need the log lock. */
+static struct logSegment *msglog_create_segment(struct msgLog *log,
+                                                size_t size)
+{
+    size_t namelen = strlen(log->path)+32;
+    char *name = chatMalloc(namelen);
+    int fd;
+
+    do {
+        unsigned long segno = __atomic_add_fetch(&log->segno, 1,
+                                                 __ATOMIC_RELAXED);
+        snprintf(name, namelen, "%s.%06lu", log->path, segno);
+        fd = open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+    } while (fd == -1 && errno == EEXIST);
+    if (fd == -1) {
+        free(name);
+        return NULL;
+    }
+
+    /* Allocate the blocks now: with a sparse file running out of disk
+     * space would deliver a SIGBUS to the thread writing the mapping. */
+    int err = posix_fallocate(fd, 0, size);
+    char *map = MAP_FAILED;
+    if (err == 0)
+        map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    else
+        errno = err;
+    if (map == MAP_FAILED) {
+        err = errno;
+        close(fd);
+        unlink(name);
+        free(name);
+        errno = err;
+        return NULL;
+    }
+
+    struct logSegment *seg = chatMalloc(sizeof(*seg));
+    seg->name = name;
+    seg->fd = fd;
+    seg->map = map;
+    seg->size = size;
+    seg->used = seg->synced = 0;
+    seg->next = NULL;
+    return seg;
+}
+
+/* Flush a segment, trim it to the bytes used and release it. Segments
+ * never used are removed. */
+static void msglog_close_segment(struct logSegment *seg) {
+    if (seg->used) msync(seg->map, seg->used, MS_SYNC);
+    munmap(seg->map, seg->size);
+    if (seg->used == 0) {
+        unlink(seg->name);
+    } else {
+        if (ftruncate(seg->fd, seg->used) == -1)
+            perror("Trimming log segment");
+        fsync(seg->fd);
+    }
+    close(seg->fd);
+    free(seg->name);
+    free(seg);
+}
+
+/* Make what was appended so far durable, and do the disk work of the
+ * segments rotation. Returns -1 if the next segment can't be created.
+ * Callers are serialized by 'sync_lock', while appends only wait for the
+ * short critical sections under 'lock'. */
+int msglog_sync(struct msgLog *log) {
+    pthread_mutex_lock(&log->sync_lock);
+    pthread_mutex_lock(&log->lock);
+    struct logSegment *retired = log->retired;
+    struct logSegment *cur = log->cur;
+    size_t end = cur ? cur->used : 0;
+    int need_spare = log->spare == NULL;
+    log->retired = NULL;
+    pthread_mutex_unlock(&log->lock);
+
+    /* Only this function unmaps segments, one call at a time, so 'cur'
+     * stays valid even if an append retires it in the meantime. */
+    while (retired) {
+        struct logSegment *next = retired->next;
+        msglog_close_segment(retired);
+        retired = next;
+    }
+    if (cur && end > cur->synced) {
+        size_t start = cur->synced & ~((size_t)sysconf(_SC_PAGESIZE)-1);
+        msync(cur->map+start, end-start, MS_SYNC);
+        cur->synced = end;
+    }
+
+    int retval = 0;
+    if (need_spare) {
+        struct logSegment *spare = msglog_create_segment(log, log->segsize);
+        if (spare) {
+            pthread_mutex_lock(&log->lock);
+            log->spare = spare;
+            pthread_mutex_unlock(&log->lock);
+        } else {
+            retval = -1;
+        }
+    }
+    pthread_mutex_unlock(&log->sync_lock);
+    return retval;
+}
+
+/* Group commit loop. */
+static void *msglog_sync_thread(void *arg) {
+    struct msgLog *log = arg;
+    struct timespec ts;
+
+    ts.tv_sec = log->sync_ms/1000;
+    ts.tv_nsec = (log->sync_ms%1000)*1000000;
+    while(1) {
+        nanosleep(&ts, NULL);
+        if (msglog_sync(log) == -1) perror("Creating log segment");
+    }
+    return NULL;
+}
+
+/* Open the log writing segments of 'segsize' bytes named after 'path',
+ * and start the thread flushing it every 'sync_ms' milliseconds. Returns
+ * -1 on error, with errno set. */
+int msglog_open(struct msgLog *log, const char *path, size_t segsize,
+                long long sync_ms)
+{
+    log->path = strdup(path);
+    log->segsize = segsize;
+    log->segno = 0;
+    log->retired = NULL;
+    log->sync_ms = sync_ms;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->sync_lock, NULL);
+
+    if ((log->cur = msglog_create_segment(log, segsize)) == NULL ||
+        (log->spare = msglog_create_segment(log, segsize)) == NULL)
+        return -1;
+    if ((errno = pthread_create(&log->sync_thread, NULL,
+                                msglog_sync_thread, log)) != 0)
+        return -1;
+    return 0;
+}
+
+/* Append 'len' bytes to the log. This is just a copy into the mapping:
+ * when the current segment is full we switch to the spare one created
+ * in advance by the sync thread, that also closes the full one.
+ * Returns -1 on error (errno is set). */
+int msglog_append(struct msgLog *log, const char *buf, size_t len) {
+    pthread_mutex_lock(&log->lock);
+    struct logSegment *seg = log->cur;
+
+    if (seg == NULL || seg->used+len > seg->size) {
+        if (seg) {
+            seg->next = log->retired;
+            log->retired = seg;
+        }
+        if (log->spare && len <= log->spare->size) {
+            seg = log->spare;
+            log->spare = NULL;
+        } else {
+            /* Message larger than a segment, or no spare yet: create the
+             * segment right now. An unused spare would come before it in
+             * the log: it is retired, and removed by the sync thread. */
+            if (log->spare) {
+                log->spare->next = log->retired;
+                log->retired = log->spare;
+                log->spare = NULL;
+            }
+            seg = msglog_create_segment(log,
+                len > log->segsize ? len : log->segsize);
+        }
+        log->cur = seg;
+        if (seg == NULL) {
+            pthread_mutex_unlock(&log->lock);
+            return -1;
+        }
+    }
+    memcpy(seg->map+seg->used, buf, len);
+    seg->used += len;
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Append-only message log on memory mapped segments.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* A segment file, mapped in memory while we append to it. Segments are
+ * created with their final size, so an append is just a memcpy(), and
+ * trimmed to the bytes actually used when they are closed. */
+struct logSegment {
+    char *name;
+    int fd;
+    char *map;
+    size_t size;    // Mapped bytes.
+    size_t used;    // Bytes appended.
+    size_t synced;  // Bytes known to be on disk.
+    struct logSegment *next; // Next retired segment.
+};
+
+/* The log. Appends may come from any thread. They never touch the disk:
+ * a background thread flushes what was appended every 'sync_ms'
+ * milliseconds with a single msync(2), so the cost of the flush is
+ * shared by all the messages of the interval (group commit). */
+struct msgLog {
+    char *path;             // Segments are named path.000001 and so on.
+    size_t segsize;         // Size of new segments.
+    unsigned long segno;    // Number of the last segment created.
+    struct logSegment *cur; // Segment we append to.
+    struct logSegment *spare;   // Next segment, created in advance.
+    struct logSegment *retired; // Full segments still to flush and close.
+    long long sync_ms;
+    pthread_t sync_thread;
+    pthread_mutex_t lock;   // Protects the segment pointers and 'used'.
+    pthread_mutex_t sync_lock; // Serializes msglog_sync(): besides the
+                               // sync thread, it is called to flush the
+                               // log before a hot restart.
+};
+
+int msglog_open(struct msgLog *log, const char *path, size_t segsize,
+                long long sync_ms);
+int msglog_append(struct msgLog *log, const char *buf, size_t len);
+int msglog_sync(struct msgLog *log);
+
+#endif // MSGLOG_H
@@ -0,0 +1,348 @@
+/*
+ * Per-client outbound queue.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#define _XOPEN_SOURCE 600 /* For IOV_MAX. */
+#include <sys/uio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "outqueue.h"
+#include "chatlib.h"
+#include "frame.h"
+#include "compress.h"
+#include "stats.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Max number of messages gathered by a single writev(2) call. */
+#define OUTQ_MAX_IOV (IOV_MAX > 1024 ? 1024 : IOV_MAX)
+
+/* Update the counters of the queue, if it has any. */
+#define OUTQ_STAT_ADD(q, field, n) do { \
+    if ((q)->stats) STAT_ADD((q)->stats->field, (n)); \
+} while(0)
+
+/* Allocate a message of 'len' bytes with a reference count of 1. The
+ * caller fills m->buf before sharing it: after that it is immutable. */
+struct sharedMsg *smsg_alloc(size_t len) {
+    struct sharedMsg *m = chatMalloc(sizeof(*m)+len);
+
+    m->refcount = 1;
+    m->len = len;
+    m->framed = NULL;
+    m->compressed = NULL;
+    return m;
+}
+
+/* Create a message holding a copy of 's'. */
+struct sharedMsg *smsg_create(const char *s, size_t len) {
+    struct sharedMsg *m = smsg_alloc(len);
+
+    memcpy(m->buf, s, len);
+    return m;
+}
+
+/* Take a new reference to the message. The reference count is atomic:
+ * with multiple worker threads the same message may be queued to clients
+ * served by different threads. */
+struct sharedMsg *smsg_retain(struct sharedMsg *m) {
+    __atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+    return m;
+}
+
+/* Drop a reference, freeing the message when it was the last one. */
+void smsg_release(struct sharedMsg *m) {
+    if (__atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (m->framed) smsg_release(m->framed);
+        if (m->compressed) smsg_release(m->compressed);
+        free(m);
+    }
+}
+
+/* Return the message encoded as a FRAME_MSG frame, for the clients in
+ * binary mode. The line separator, if any, is not part of the payload.
+ * The frame is created once and cached in the message, so a broadcast
+ * is encoded once however many binary clients receive it. It is owned by
+ * 'm': take a reference to keep it longer than 'm'. */
+struct sharedMsg *smsg_framed(struct sharedMsg *m) {
+    struct sharedMsg *f = __atomic_load_n(&m->framed, __ATOMIC_ACQUIRE);
+    if (f) return f;
+
+    size_t len = m->len;
+    if (len && m->buf[len-1] == '\n') len--;
+
+    unsigned char hdr[FRAME_MAX_HEADER];
+    int hdrlen = frame_encode_header(hdr, len, FRAME_MSG);
+    f = smsg_alloc(hdrlen+len);
+    memcpy(f->buf, hdr, hdrlen);
+    memcpy(f->buf+hdrlen, m->buf, len);
+
+    /* Workers sending the same message may race to encode it: the first
+     * one wins, the others drop their copy. */
+    struct sharedMsg *expected = NULL;
+    if (!__atomic_compare_exchange_n(&m->framed, &expected, f, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        smsg_release(f);
+        f = expected;
+    }
+    return f;
+}
+
+/* Return the message encoded as a FRAME_ZMSG frame compressed with
+ * 'codec', for the binary clients that agreed to it. Like smsg_framed()
+ * the frame is made once and cached, so a broadcast is compressed once
+ * however many clients receive it. Messages shorter than 'minlen', or
+ * that don't get shorter, are not worth it: their FRAME_MSG frame is
+ * returned instead, and the caller can tell by the type. There is a
+ * single cache, all the recipients must use the same codec. */
+struct sharedMsg *smsg_compressed(struct sharedMsg *m, int codec,
+                                  size_t minlen)
+{
+    struct sharedMsg *z = __atomic_load_n(&m->compressed, __ATOMIC_ACQUIRE);
+    if (z) return z;
+
+    struct sharedMsg *f = smsg_framed(m);
+    size_t len = m->len;
+    if (len && m->buf[len-1] == '\n') len--;
+    if (len < minlen) return f;
+
+    /* Compress past the longest header, then move the data next to the
+     * actual header. Unless it is shorter than the plain frame, the
+     * compressed frame is of no use. */
+    size_t maxhdr = FRAME_MAX_HEADER+FRAME_MAX_VARINT;
+    z = smsg_alloc(f->len);
+    size_t zlen = f->len > maxhdr ?
+        codec_compress(codec, m->buf, len, z->buf+maxhdr, f->len-maxhdr) : 0;
+    if (zlen) {
+        unsigned char hdr[FRAME_MAX_HEADER+FRAME_MAX_VARINT];
+        unsigned char lenbuf[FRAME_MAX_VARINT];
+        int lenlen = frame_encode_varint(lenbuf, len);
+        int hdrlen = frame_encode_header(hdr, lenlen+zlen, FRAME_ZMSG);
+        memcpy(hdr+hdrlen, lenbuf, lenlen);
+        hdrlen += lenlen;
+        memmove(z->buf+hdrlen, z->buf+maxhdr, zlen);
+        memcpy(z->buf, hdr, hdrlen);
+        z->len = hdrlen+zlen;
+    }
+    if (zlen == 0 || z->len >= f->len) {
+        smsg_release(z);
+        z = smsg_retain(f);
+    }
+
+    struct sharedMsg *expected = NULL;
+    if (!__atomic_compare_exchange_n(&m->compressed, &expected, z, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        smsg_release(z);
+        z = expected;
+    }
+    return z;
+}
+
+/* Initialize an empty queue, counting its activity in 'stats' (that can
+ * be NULL). */
+void outq_init(struct outQueue *q, struct outqStats *stats) {
+    q->head = q->tail = NULL;
+    q->sentpos = 0;
+    q->bytes = 0;
+    q->stats = stats;
+}
+
+/* Release all the pending messages. The queue is left empty. */
+void outq_free(struct outQueue *q) {
+    struct outNode *n = q->head;
+
+    while (n) {
+        struct outNode *next = n->next;
+        smsg_release(n->msg);
+        free(n);
+        n = next;
+    }
+    OUTQ_STAT_ADD(q, queued, -(long long)q->bytes);
+    outq_init(q, q->stats);
+}
+
+/* Append the message 'm' to the tail of the queue. The queue takes its
+ * own reference, the payload is not copied. */
+void outq_push(struct outQueue *q, struct sharedMsg *m) {
+    struct outNode *n = chatMalloc(sizeof(*n));
+
+    n->next = NULL;
+    n->msg = smsg_retain(m);
+    if (q->tail) q->tail->next = n;
+    else q->head = n;
+    q->tail = n;
+    q->bytes += m->len;
+    OUTQ_STAT_ADD(q, queued, m->len);
+}
+
+/* Send 'm' on 'fd', that must have an empty queue: the message is written
+ * right away, and only the part the socket did not accept is queued. In
+ * the common case of a socket with room in its buffer, this costs no
+ * allocation at all. Returns the number of bytes written, or -1 on write
+ * error (nothing is queued then). */
+ssize_t outq_send(struct outQueue *q, int fd, struct sharedMsg *m) {
+    ssize_t nwritten;
+
+    do {
+        nwritten = write(fd, m->buf, m->len);
+    } while (nwritten == -1 && errno == EINTR);
+    OUTQ_STAT_ADD(q, writes, 1);
+
+    if (nwritten == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        OUTQ_STAT_ADD(q, write_eagain, 1);
+        nwritten = 0;
+    }
+    OUTQ_STAT_ADD(q, bytes, nwritten);
+    if ((size_t)nwritten < m->len) {
+        outq_push(q, m);
+        q->sentpos = nwritten;
+        q->bytes -= nwritten;
+        OUTQ_STAT_ADD(q, queued, -nwritten);
+    }
+    return nwritten;
+}
+
+/* Fill 'iov' with up to 'max' buffers of pending data, starting from the
+ * unsent part of the head message. Returns the number of buffers, and
+ * their total length in '*len'. The buffers stay valid until released by
+ * outq_advance() or outq_free(). */
+int outq_gather(struct outQueue *q, struct iovec *iov, int max, size_t *len) {
+    int iovcnt = 0;
+    size_t offset = q->sentpos;
+
+    *len = 0;
+    for (struct outNode *n = q->head; n && iovcnt < max; n = n->next) {
+        iov[iovcnt].iov_base = n->msg->buf+offset;
+        iov[iovcnt].iov_len = n->msg->len-offset;
+        *len += iov[iovcnt].iov_len;
+        iovcnt++;
+        offset = 0;
+    }
+    return iovcnt;
+}
+
+/* Account for a write of 'nwritten' bytes of the gathered data: release
+ * the messages fully transmitted, and remember how much of the last one
+ * went out. */
+void outq_advance(struct outQueue *q, size_t nwritten) {
+    q->bytes -= nwritten;
+    OUTQ_STAT_ADD(q, writes, 1);
+    OUTQ_STAT_ADD(q, bytes, nwritten);
+    OUTQ_STAT_ADD(q, queued, -(long long)nwritten);
+
+    while (nwritten) {
+        struct outNode *n = q->head;
+        size_t remaining = n->msg->len-q->sentpos;
+
+        if (nwritten < remaining) {
+            q->sentpos += nwritten;
+            break;
+        }
+        nwritten -= remaining;
+        q->head = n->next;
+        if (q->head == NULL) q->tail = NULL;
+        q->sentpos = 0;
+        smsg_release(n->msg);
+        free(n);
+    }
+}
+
+/* Write as much as possible of the queue to 'fd', releasing the messages
+ * fully transmitted. Pending messages are gathered in batches of up to
+ * OUTQ_MAX_IOV buffers, so that flushing many short messages costs a
+ * single writev(2) call and not one write(2) per message.
+ *
+ * Returns the number of bytes written (0 if the socket can't accept more
+ * data right now), or -1 on write error. */
+ssize_t outq_write(struct outQueue *q, int fd) {
+    struct iovec iov[OUTQ_MAX_IOV];
+    ssize_t totwritten = 0;
+
+    while (q->head) {
+        size_t iovlen;
+        int iovcnt = outq_gather(q, iov, OUTQ_MAX_IOV, &iovlen);
+
+        ssize_t nwritten = writev(fd, iov, iovcnt);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            OUTQ_STAT_ADD(q, writes, 1);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                OUTQ_STAT_ADD(q, write_eagain, 1);
+                break;
+            }
+            return -1;
+        }
+        totwritten += nwritten;
+        outq_advance(q, nwritten);
+
+        /* Short write: the kernel buffer is full. */
+        if ((size_t)nwritten < iovlen) break;
+    }
+    return totwritten;
+}
+
+/* Return the number of bytes waiting to be transmitted. */
+size_t outq_len(struct outQueue *q) {
+    return q->bytes;
+}
+
+/* Initialize an empty ring holding up to 'size' messages, rounded up to
+ * a power of two. The slots are allocated with the first message. */
+void msgring_init(struct msgRing *r, unsigned int size) {
+    r->msgs = NULL;
+    r->write_idx = r->len = 0;
+    r->size = 1;
+    while (r->size < size) r->size <<= 1;
+}
+
+/* Release the messages in the ring. The ring is left empty. */
+void msgring_free(struct msgRing *r) {
+    for (unsigned int j = 0; j < r->len; j++)
+        smsg_release(r->msgs[(r->write_idx-1-j) & (r->size-1)]);
+    free(r->msgs);
+    r->msgs = NULL;
+    r->write_idx = r->len = 0;
+}
+
+/* Append a reference to 'm', dropping the oldest message if the ring is
+ * full. */
+void msgring_push(struct msgRing *r, struct sharedMsg *m) {
+    if (r->msgs == NULL) r->msgs = chatMalloc(sizeof(*r->msgs)*r->size);
+
+    struct sharedMsg **slot = &r->msgs[r->write_idx & (r->size-1)];
+    if (r->len == r->size) smsg_release(*slot);
+    else r->len++;
+    *slot = smsg_retain(m);
+    r->write_idx++;
+}
+
+/* Return the number of messages in the ring. */
+unsigned int msgring_len(struct msgRing *r) {
+    return r->len;
+}
+
+/* Store in 'msgs' a new reference to each of the last 'n' messages (or
+ * all of them, if there are fewer), oldest first. Returns the number of
+ * messages stored. */
+unsigned int msgring_last(struct msgRing *r, unsigned int n,
+                          struct sharedMsg **msgs)
+{
+    if (n > r->len) n = r->len;
+
+    unsigned int first = r->write_idx-n;
+    for (unsigned int j = 0; j < n; j++)
+        msgs[j] = smsg_retain(r->msgs[(first+j) & (r->size-1)]);
+    return n;
+}
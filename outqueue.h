@@ -0,0 +1,90 @@
+/*
+ * Per-client outbound queue.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* A reference counted, immutable message. When the same message is sent
+ * to many clients (fan-out), every output queue just points to it, so
+ * memory used by a broadcast is O(len) and not O(clients*len). The message
+ * is released when the last recipient finished transmitting it. */
+struct sharedMsg {
+    int refcount;
+    size_t len;     // Length of buf.
+    struct sharedMsg *framed; // The same message as a binary frame, made
+                              // the first time a binary client needs it.
+    struct sharedMsg *compressed; // Likewise, as a compressed frame.
+    char buf[];     // Payload.
+};
+
+/* A message waiting to be written to the socket. */
+struct outNode {
+    struct outNode *next;
+    struct sharedMsg *msg;
+};
+
+/* Counters of the output queues, shared by all the queues of a thread.
+ * See STAT_ADD() in stats.h: only that thread updates them. */
+struct outqStats {
+    unsigned long long writes;      // write(2) and writev(2) calls.
+    unsigned long long write_eagain;// Calls that found the socket full.
+    unsigned long long bytes;       // Bytes written.
+    long long queued;               // Bytes waiting in the queues now.
+};
+
+/* FIFO of messages. Messages are appended at the tail and written from the
+ * head. 'sentpos' is the number of bytes of the head message already
+ * written, this way a short write never corrupts the framing of the
+ * stream. */
+struct outQueue {
+    struct outNode *head;
+    struct outNode *tail;
+    size_t sentpos; // Bytes of 'head' already transmitted.
+    size_t bytes;   // Bytes still to transmit, across all chunks.
+    struct outqStats *stats; // Where to count our writes, or NULL.
+};
+
+/* Ring of the last messages of a stream, each one a reference to the
+ * shared message. Like Circbuf the size is a power of two and the index
+ * is free running, masked on access. Once the ring is full the newest
+ * message overwrites (and releases) the oldest one. */
+struct msgRing {
+    struct sharedMsg **msgs;
+    unsigned int write_idx; // Messages pushed so far, modulo 2^32.
+    unsigned int len;       // Messages in the ring, at most 'size'.
+    unsigned int size;      // Power of two, the ring capacity.
+};
+
+struct sharedMsg *smsg_alloc(size_t len);
+struct sharedMsg *smsg_create(const char *s, size_t len);
+struct sharedMsg *smsg_retain(struct sharedMsg *m);
+void smsg_release(struct sharedMsg *m);
+struct sharedMsg *smsg_framed(struct sharedMsg *m);
+struct sharedMsg *smsg_compressed(struct sharedMsg *m, int codec,
+                                  size_t minlen);
+
+void outq_init(struct outQueue *q, struct outqStats *stats);
+void outq_free(struct outQueue *q);
+void outq_push(struct outQueue *q, struct sharedMsg *m);
+ssize_t outq_send(struct outQueue *q, int fd, struct sharedMsg *m);
+ssize_t outq_write(struct outQueue *q, int fd);
+int outq_gather(struct outQueue *q, struct iovec *iov, int max, size_t *len);
+void outq_advance(struct outQueue *q, size_t nwritten);
+size_t outq_len(struct outQueue *q);
+
+void msgring_init(struct msgRing *r, unsigned int size);
+void msgring_free(struct msgRing *r);
+void msgring_push(struct msgRing *r, struct sharedMsg *m);
+unsigned int msgring_len(struct msgRing *r);
+unsigned int msgring_last(struct msgRing *r, unsigned int n,
+                          struct sharedMsg **msgs);
+
+#endif // OUTQUEUE_H
@@ -0,0 +1,738 @@
+/* smallchat-bench.c -- Load generator and fan-out latency benchmark.
+ *
+ * Copyright (c) 2025, vitoloper
+ *
+ * Opens many connections to a smallchat server, makes some of them send
+ * messages at a fixed total rate, and measures how long every message
+ * takes to reach every other client. Each message carries the time it
+ * was sent, so the receivers measure the end-to-end latency themselves.
+ *
+ * With --idle the benchmark also ramps up to many more connections that
+ * just sit there, while the others chat, to find out how the server
+ * copes with them and, with --metrics-port, how much memory each one
+ * costs it.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the project name of nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "chatlib.h"
+#include "circular_buffer.h"
+#include "eventloop.h"
+#include "stats.h"
+
+#define MIN_MSG_SIZE 24     /* Room for the timestamp and the newline. */
+#define LINE_OVERHEAD 128   /* Nick and room prefix added by the server. */
+#define READBUF_SIZE 16384  /* At least, to read many messages at once. */
+#define CONNECT_TIMEOUT 10000 /* Milliseconds to get all the connections. */
+#define DRAIN_TIME 1000     /* Milliseconds to wait for the last messages. */
+#define REPORT_INTERVAL 1000
+#define RAMP_INTERVAL 10    /* Milliseconds between idle connection batches. */
+#define MAX_BIND_ADDRS 256
+#define METRICS_TIMEOUT 200 /* Milliseconds to get the server metrics. */
+
+/* ============================ Data structures ============================= */
+
+/* A connection that stays idle. */
+struct idleConn {
+    int fd;     // -1 once closed by the server.
+    int ready;  // True once the welcome line was received.
+};
+
+/* What the metrics of the server say about its memory. Fields the server
+ * does not report are -1. */
+struct serverMemory {
+    long long rss;          // Resident set size.
+    long long idle_clients; // Clients in the "idle" state, and the memory
+    long long idle_bytes;   // they use.
+};
+
+/* A connection to the server. */
+struct benchConn {
+    int fd;
+    int ready;                  // True once the welcome line was received.
+    struct Circbuf *read_cb;    // Input waiting for its newline.
+    char *pending;              // Rest of a message the socket did not
+    size_t pending_len;         // accept yet, and its length.
+};
+
+struct benchState {
+    struct eventLoop *el;
+    struct benchConn *conns;
+    int numconns;
+    int numready;           // Connections that got the welcome line.
+    int next_sender;        // Round robin among the senders.
+    long long start_time;   // ustime() when sending started, 0 before.
+    long long stop_time;    // ustime() when sending stopped, 0 before.
+    unsigned long long scheduled; // Messages the rate allowed so far.
+    unsigned long long sent;    // Messages sent.
+    unsigned long long stalled; // Sends skipped, the socket was full.
+    unsigned long long received;// Messages received by all the clients.
+    unsigned long long received_bytes;
+    unsigned long long last_sent, last_received; // At the last report.
+    struct histogram latency;   // In microseconds, of the whole run.
+    struct histogram interval;  // Since the last report.
+    struct elTimer send_timer, report_timer, phase_timer;
+    int done;
+    char *msgbuf;           // Message template, the timestamp goes first.
+    struct idleConn *idle;  // The idle connections.
+    int numidle;            // Idle connections opened...
+    int idle_ready;         // ...that got the welcome line...
+    int idle_lost;          // ...and closed by the server since.
+    int ramp_done;          // No more idle connections to open.
+    long long ramp_start;   // mstime() when the ramp started...
+    long long ramp_end;     // ...when the last connection was opened...
+    long long ramp_time;    // ...and milliseconds until all were welcomed.
+    int measuring;          // The ramp is over, sending for --duration.
+    struct elTimer ramp_timer;
+    struct serverMemory mem_before, mem_after; // Before and after the ramp.
+    char *bind_addrs[MAX_BIND_ADDRS]; // Local addresses to connect from.
+    int numbind;
+} Bench;
+
+struct benchConfig {
+    long long port;
+    long long clients;      // Connections to open.
+    long long senders;      // How many of them send messages.
+    long long rate;         // Messages per second, all senders together.
+    long long size;         // Bytes per message, newline included.
+    long long duration;     // Seconds of sending.
+    long long idle;         // Idle connections to ramp up to.
+    long long ramp_rate;    // Idle connections opened per second.
+    long long metrics_port; // Of the server, 0 to not read its metrics.
+    char *host;
+    char *bind;             // Comma separated local addresses, or NULL.
+} Config = {
+    .port = 7711,
+    .clients = 100,
+    .senders = 10,
+    .rate = 1000,
+    .size = 64,
+    .duration = 10,
+    .idle = 0,
+    .ramp_rate = 10000,
+    .metrics_port = 0,
+    .host = "127.0.0.1",
+    .bind = NULL,
+};
+
+/* Command line options, numeric ones first. */
+struct benchOption {
+    const char *name;
+    long long *value;
+    long long min, max;
+    const char *help;
+} BenchOptions[] = {
+    {"--port", &Config.port, 1, 65535, "Port of the server"},
+    {"--clients", &Config.clients, 2, 1<<20, "Connections to open"},
+    {"--senders", &Config.senders, 1, 1<<20,
+     "Connections that send messages, the others only receive"},
+    {"--rate", &Config.rate, 1, 1<<24, "Messages sent per second, in total"},
+    {"--size", &Config.size, MIN_MSG_SIZE, 1<<20,
+     "Bytes of every message, newline included"},
+    {"--duration", &Config.duration, 1, 1<<20,
+     "Seconds of sending, after the idle connections ramp"},
+    {"--idle", &Config.idle, 0, 1<<22,
+     "Idle connections opened on top of --clients, while they chat"},
+    {"--ramp-rate", &Config.ramp_rate, 1, 1<<20,
+     "Idle connections opened per second"},
+    {"--metrics-port", &Config.metrics_port, 0, 65535,
+     "Metrics port of the server, to report its memory (0 = don't)"},
+    {NULL, NULL, 0, 0, NULL}
+};
+
+struct benchStrOption {
+    const char *name;
+    char **value;
+    const char *help;
+} BenchStrOptions[] = {
+    {"--host", &Config.host, "Address of the server"},
+    {"--bind", &Config.bind,
+     "Comma separated local addresses to connect from, each one allowing "
+     "as many connections as there are ephemeral ports"},
+    {NULL, NULL, NULL}
+};
+
+/* ============================== Histograms ================================ */
+
+/* Print the distribution, a line for every power of two. */
+void histPrint(struct histogram *h) {
+    unsigned long long cumulative = 0;
+    int j = 0;
+
+    for (int bits = 1; bits <= HIST_MAX_BITS && cumulative < h->count; bits++) {
+        long long upto = (1LL << bits) - 1;
+        unsigned long long n = 0;
+        while (j < HIST_BUCKETS && hist_bucket_max(j) <= upto)
+            n += h->buckets[j++];
+        cumulative += n;
+        if (n == 0) continue;
+
+        int bar = 50.0 * n / h->count;
+        printf("  <= %10lld us %10llu %6.2f%% |", upto, n,
+               100.0 * cumulative / h->count);
+        for (int k = 0; k < bar; k++) putchar('#');
+        putchar('\n');
+    }
+}
+
+/* ============================== Connections =============================== */
+
+void connReadHandler(struct eventLoop *el, int fd, void *privdata, int mask);
+
+/* Open the connection number 'j', without waiting for it to complete,
+ * from one of the --bind addresses in turn if any. */
+int connectToServer(int j) {
+    char *source = Bench.numbind ? Bench.bind_addrs[j % Bench.numbind] : NULL;
+    return TCPConnectFrom(Config.host, Config.port, source, 1);
+}
+
+void adjustOpenFilesLimit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return;
+    if (limit.rlim_cur == limit.rlim_max) return;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        perror("Raising the open files limit"); // Not fatal.
+}
+
+/* Handle a line received by a connection. The first one is the welcome
+ * message of the server, the others messages of the senders, in the
+ * form "nick> <timestamp> <padding>". */
+void processLine(struct benchConn *bc, char *line) {
+    if (!bc->ready) {
+        bc->ready = 1;
+        Bench.numready++;
+        return;
+    }
+
+    char *p = strstr(line, "> ");
+    if (p == NULL) return;
+    long long sent_time = strtoll(p+2, NULL, 10);
+    if (sent_time <= 0) return;
+
+    long long latency = ustime() - sent_time;
+    hist_add(&Bench.latency, latency);
+    hist_add(&Bench.interval, latency);
+    Bench.received++;
+}
+
+void connReadHandler(struct eventLoop *el, int fd, void *privdata, int mask) {
+    (void)el; (void)mask;
+    struct benchConn *bc = privdata;
+    struct iovec iov[2];
+    int iovcnt = circbuf_write_iov(bc->read_cb, iov);
+    ssize_t nread = readv(fd, iov, iovcnt);
+
+    if (nread <= 0) {
+        if (nread == -1 && errno == EAGAIN) return;
+        fprintf(stderr, "Connection fd=%d %s\n", fd,
+                nread == 0 ? "closed by the server" : strerror(errno));
+        exit(1);
+    }
+    circbuf_commit(bc->read_cb, nread);
+    Bench.received_bytes += nread;
+
+    char line[Config.size+LINE_OVERHEAD+1];
+    int pos;
+    while ((pos = circbuf_index(bc->read_cb, '\n')) != -1) {
+        int len = pos+1;
+        if (len > (int)sizeof(line)-1) {
+            /* Not one of ours. */
+            circbuf_consume(bc->read_cb, len);
+            continue;
+        }
+        circbuf_pop_to_linear(line, bc->read_cb, len);
+        line[len] = '\0';
+        processLine(bc, line);
+    }
+    if (circbuf_space_left(bc->read_cb) == 0) circbuf_empty(bc->read_cb);
+}
+
+/* Write what is left of the last message, once the socket accepts it. */
+void connWriteHandler(struct eventLoop *el, int fd, void *privdata, int mask) {
+    (void)mask;
+    struct benchConn *bc = privdata;
+    ssize_t nwritten = write(fd, bc->pending, bc->pending_len);
+
+    if (nwritten == -1) {
+        if (errno == EAGAIN) return;
+        perror("Writing to the server");
+        exit(1);
+    }
+    bc->pending_len -= nwritten;
+    memmove(bc->pending, bc->pending+nwritten, bc->pending_len);
+    if (bc->pending_len == 0) elDeleteFileEvent(el, fd, EL_WRITABLE);
+}
+
+/* Send a message stamped with the current time. If the previous one is
+ * still not fully written the server is not keeping up with this sender:
+ * count it as a stall and skip it, instead of growing a backlog that
+ * would be measured as latency. */
+void sendMessage(struct benchConn *bc) {
+    if (bc->pending_len) {
+        Bench.stalled++;
+        return;
+    }
+
+    size_t len = Config.size;
+    char *msg = Bench.msgbuf;
+    int tslen = snprintf(msg, MIN_MSG_SIZE, "%lld", ustime());
+    msg[tslen] = ' ';
+
+    ssize_t nwritten = write(bc->fd, msg, len);
+    if (nwritten == -1) {
+        if (errno != EAGAIN) {
+            perror("Writing to the server");
+            exit(1);
+        }
+        nwritten = 0;
+    }
+    Bench.sent++;
+    if ((size_t)nwritten == len) return;
+
+    bc->pending_len = len-nwritten;
+    memcpy(bc->pending, msg+nwritten, bc->pending_len);
+    elCreateFileEvent(Bench.el, bc->fd, EL_WRITABLE, connWriteHandler, bc);
+}
+
+/* ============================ Idle connections =========================== */
+
+/* An idle connection leaves the room as soon as it is welcomed, so that
+ * the chat of the active ones is not sent to it, and from then on it
+ * only reads what the server may still send. */
+void idleReadHandler(struct eventLoop *el, int fd, void *privdata, int mask) {
+    (void)mask;
+    struct idleConn *ic = privdata;
+    char buf[1024];
+    ssize_t nread = read(fd, buf, sizeof(buf));
+
+    if (nread <= 0) {
+        if (nread == -1 && errno == EAGAIN) return;
+        elDeleteFileEvent(el, fd, EL_READABLE);
+        close(fd);
+        ic->fd = -1;
+        Bench.idle_lost++;
+        return;
+    }
+    if (ic->ready) return;
+
+    /* The welcome line. An empty socket buffer always takes the few bytes
+     * of the command: failing, the server is going away, and we'll read
+     * the EOF next. */
+    ic->ready = 1;
+    Bench.idle_ready++;
+    if (write(fd, "/part\n", 6) == -1 && errno != EAGAIN) {
+        elDeleteFileEvent(el, fd, EL_READABLE);
+        close(fd);
+        ic->fd = -1;
+        Bench.idle_lost++;
+    }
+}
+
+/* No more idle connections: the last one could not be opened because of
+ * 'err', or 0 if they all were. */
+void endRamp(int err) {
+    if (err)
+        printf("Idle connections ramp stopped at %d: %s\n",
+               Bench.numidle, strerror(err));
+    Bench.ramp_done = 1;
+    Bench.ramp_end = mstime();
+}
+
+/* Open the idle connections due since the start of the ramp. When the
+ * server stops accepting them (or we run out of descriptors or ports)
+ * the ramp ends there: that is the ceiling we are looking for. */
+void rampTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+    long long elapsed = mstime() - Bench.ramp_start;
+    long long due = elapsed * Config.ramp_rate / 1000 + 1;
+
+    if (due > Config.idle) due = Config.idle;
+    while (Bench.numidle < due) {
+        struct idleConn *ic = &Bench.idle[Bench.numidle];
+        int fd = connectToServer(Config.clients + Bench.numidle);
+        if (fd == -1) {
+            endRamp(errno);
+            return;
+        }
+        ic->fd = fd;
+        ic->ready = 0;
+        if (elCreateFileEvent(el, fd, EL_READABLE, idleReadHandler,
+                              ic) == EL_ERR)
+        {
+            endRamp(errno);
+            close(fd);
+            return;
+        }
+        Bench.numidle++;
+    }
+    if (Bench.numidle == Config.idle) {
+        endRamp(0);
+        return;
+    }
+    elAddTimer(el, t, RAMP_INTERVAL);
+}
+
+/* Read the memory figures of the server from its metrics port, adding
+ * up those of all the workers. Blocks, but only for a local request done
+ * once a second at most, and for METRICS_TIMEOUT at worst: a server out
+ * of descriptors would never answer. Returns -1 if the metrics can't be
+ * read. */
+int fetchServerMemory(struct serverMemory *mem) {
+    const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+    int fd = TCPConnect(Config.host, Config.metrics_port, 0);
+    if (fd == -1) return -1;
+
+    struct timeval tv = {0, METRICS_TIMEOUT*1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (write(fd, req, strlen(req)) != (ssize_t)strlen(req)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t len = 0, size = 65536;
+    char *buf = chatMalloc(size);
+    ssize_t nread;
+    while ((nread = read(fd, buf+len, size-len-1)) > 0) {
+        len += nread;
+        if (len == size-1) buf = chatRealloc(buf, size *= 2);
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    mem->rss = mem->idle_clients = mem->idle_bytes = -1;
+    char *line = buf;
+    while (*line) {
+        char *end = strchr(line, '\n');
+        if (end) *end = '\0';
+
+        char *value = strchr(line, ' ');
+        int idle = strstr(line, "state=\"idle\"") != NULL;
+        long long *field = NULL;
+        if (*line == '#' || value == NULL)
+            field = NULL;
+        else if (!strncmp(line, "smallchat_resident_memory_bytes ", 32))
+            field = &mem->rss;
+        else if (!strncmp(line, "smallchat_clients_by_state{", 27) && idle)
+            field = &mem->idle_clients;
+        else if (!strncmp(line, "smallchat_client_memory_bytes{", 30) && idle)
+            field = &mem->idle_bytes;
+        if (field) {
+            if (*field == -1) *field = 0;
+            *field += strtoll(value+1, NULL, 10);
+        }
+
+        if (end == NULL) break;
+        line = end+1;
+    }
+    free(buf);
+    return mem->rss == -1 && mem->idle_clients == -1 ? -1 : 0;
+}
+
+/* ================================ Phases ================================== */
+
+/* Send the messages due since the start at the configured rate, then
+ * check again in a millisecond. */
+void sendTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+    long long elapsed = ustime() - Bench.start_time;
+    unsigned long long due = (double)elapsed * Config.rate / 1000000;
+
+    /* After a stall don't try to catch up with a burst. */
+    unsigned long long maxburst = Config.rate/100 + 1;
+    if (due > Bench.scheduled + maxburst) Bench.scheduled = due - maxburst;
+
+    for (; Bench.scheduled < due; Bench.scheduled++) {
+        sendMessage(&Bench.conns[Bench.next_sender]);
+        Bench.next_sender = (Bench.next_sender+1) % Config.senders;
+    }
+    elAddTimer(el, t, 1);
+}
+
+void reportTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+    double secs = REPORT_INTERVAL/1000.0;
+    printf("sent %8.0f msg/s  received %10.0f msg/s  "
+           "p50 %7lld us  p99 %7lld us  max %7lld us",
+        (Bench.sent-Bench.last_sent)/secs,
+        (Bench.received-Bench.last_received)/secs,
+        hist_percentile(&Bench.interval, 0.50),
+        hist_percentile(&Bench.interval, 0.99),
+        Bench.interval.max);
+
+    /* While ramping, show how far we got, and what it costs the server.
+     * Once the metrics can't be read we stop trying, not to stall. */
+    static int metrics_failed;
+    struct serverMemory mem;
+    if (Config.idle && !Bench.measuring) {
+        printf("  idle %7d", Bench.idle_ready);
+        if (Config.metrics_port && !metrics_failed) {
+            if (fetchServerMemory(&mem) == 0 && mem.rss != -1)
+                printf("  rss %7.1f MB", mem.rss/(1024.0*1024));
+            else
+                metrics_failed = 1;
+        }
+    }
+    putchar('\n');
+    fflush(stdout);
+    Bench.last_sent = Bench.sent;
+    Bench.last_received = Bench.received;
+    memset(&Bench.interval, 0, sizeof(Bench.interval));
+    if (!Bench.stop_time) elAddTimer(el, t, REPORT_INTERVAL);
+}
+
+void report(void) {
+    double secs = (Bench.stop_time - Bench.start_time) / 1000000.0;
+    unsigned long long expected = Bench.sent * (Config.clients-1);
+
+    printf("\n%lld clients, %lld senders, %lld bytes per message, "
+           "event loop %s\n", Config.clients, Config.senders, Config.size,
+           elGetApiName());
+    printf("Sent:      %llu messages in %.2f seconds, %.0f msg/s "
+           "(%llu stalls)\n", Bench.sent, secs, Bench.sent/secs,
+           Bench.stalled);
+    printf("Received:  %llu messages of %llu expected (%.2f%%), "
+           "%.0f msg/s, %.2f MB/s\n", Bench.received, expected,
+           expected ? 100.0*Bench.received/expected : 0,
+           Bench.received/secs, Bench.received_bytes/secs/(1024*1024));
+    if (Config.idle) {
+        printf("Idle:      %d of %lld connections welcomed in %lld ms, "
+               "%d closed by the server\n", Bench.idle_ready, Config.idle,
+               Bench.ramp_time, Bench.idle_lost);
+    }
+
+    /* The RSS grown with the ramp is the real cost of a connection,
+     * kernel buffers aside: the client objects are only part of it. */
+    struct serverMemory *before = &Bench.mem_before, *after = &Bench.mem_after;
+    if (after->rss != -1) {
+        printf("Server:    RSS %.1f MB", after->rss/(1024.0*1024));
+        if (before->rss != -1 && Bench.idle_ready)
+            printf(", %.1f MB before the ramp, %lld bytes per idle "
+                   "connection", before->rss/(1024.0*1024),
+                   (after->rss - before->rss)/Bench.idle_ready);
+        putchar('\n');
+    }
+    if (after->idle_clients > 0)
+        printf("           %lld idle clients, %lld bytes of client state "
+               "each\n", after->idle_clients,
+               after->idle_bytes/after->idle_clients);
+    printf("Latency:   p50 %lld us, p99 %lld us, p999 %lld us, "
+           "max %lld us\n",
+        hist_percentile(&Bench.latency, 0.50),
+        hist_percentile(&Bench.latency, 0.99),
+        hist_percentile(&Bench.latency, 0.999),
+        Bench.latency.max);
+    histPrint(&Bench.latency);
+}
+
+/* Drive the benchmark: wait for all the connections, open the idle ones
+ * while sending, send for --duration seconds more, then give the last
+ * messages time to arrive. */
+void phaseTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+    static long long connect_start;
+
+    if (!Bench.start_time) {
+        if (!connect_start) connect_start = mstime();
+        if (Bench.numready < Bench.numconns) {
+            if (mstime() - connect_start > CONNECT_TIMEOUT) {
+                fprintf(stderr, "Only %d of %d clients connected\n",
+                        Bench.numready, Bench.numconns);
+                exit(1);
+            }
+            elAddTimer(el, t, 10);
+            return;
+        }
+        printf("%d clients connected in %lld ms, sending...\n",
+               Bench.numconns, mstime() - connect_start);
+        if (Config.idle) {
+            if (Config.metrics_port &&
+                fetchServerMemory(&Bench.mem_before) == -1)
+            {
+                fprintf(stderr, "Can't read the metrics of the server\n");
+            }
+            printf("Ramping up to %lld idle connections, %lld per "
+                   "second...\n", Config.idle, Config.ramp_rate);
+            Bench.ramp_start = mstime();
+            elAddTimer(el, &Bench.ramp_timer, 0);
+        }
+        Bench.start_time = ustime();
+        elAddTimer(el, &Bench.send_timer, 0);
+        elAddTimer(el, &Bench.report_timer, REPORT_INTERVAL);
+        elAddTimer(el, t, 0);
+    } else if (!Bench.measuring) {
+        if (Config.idle) {
+            /* Wait for the last idle connections to be welcomed, unless
+             * the server never does. */
+            int pending = Bench.numidle - Bench.idle_ready - Bench.idle_lost;
+            if (!Bench.ramp_done ||
+                (pending > 0 && mstime() - Bench.ramp_end < CONNECT_TIMEOUT))
+            {
+                elAddTimer(el, t, 10);
+                return;
+            }
+            Bench.ramp_time = mstime() - Bench.ramp_start;
+            printf("%d idle connections welcomed in %lld ms\n",
+                   Bench.idle_ready, Bench.ramp_time);
+        }
+        Bench.measuring = 1;
+        elAddTimer(el, t, Config.duration*1000);
+    } else if (!Bench.stop_time) {
+        Bench.stop_time = ustime();
+        elDelTimer(el, &Bench.send_timer);
+        elDelTimer(el, &Bench.report_timer);
+        elAddTimer(el, t, DRAIN_TIME);
+    } else {
+        /* The server samples the memory of its clients every second: by
+         * now it saw the idle ones settled. */
+        if (Config.metrics_port) fetchServerMemory(&Bench.mem_after);
+        Bench.done = 1;
+    }
+}
+
+/* ================================= Main =================================== */
+
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    for (struct benchOption *o = BenchOptions; o->name; o++)
+        fprintf(stderr, "  %-14s %s (default %lld)\n",
+            o->name, o->help, *o->value);
+    for (struct benchStrOption *o = BenchStrOptions; o->name; o++)
+        fprintf(stderr, "  %-14s %s (default %s)\n",
+            o->name, o->help, *o->value ? *o->value : "none");
+    exit(1);
+}
+
+void parseOptions(int argc, char **argv) {
+    for (int j = 1; j < argc; j++) {
+        struct benchOption *o;
+
+        for (o = BenchOptions; o->name; o++)
+            if (!strcmp(argv[j], o->name)) break;
+        if (o->name == NULL) {
+            struct benchStrOption *so;
+            for (so = BenchStrOptions; so->name; so++)
+                if (!strcmp(argv[j], so->name)) break;
+            if (so->name == NULL || j+1 == argc) usage(argv[0]);
+            *so->value = argv[++j];
+            continue;
+        }
+        if (j+1 == argc) usage(argv[0]);
+
+        char *endptr;
+        long long val = strtoll(argv[++j], &endptr, 10);
+        if (*endptr != '\0' || val < o->min || val > o->max) {
+            fprintf(stderr, "Invalid value for %s: %s\n", o->name, argv[j]);
+            exit(1);
+        }
+        *o->value = val;
+    }
+
+    if (Config.senders > Config.clients) Config.senders = Config.clients;
+
+    if (Config.bind) {
+        char *addrs = chatMalloc(strlen(Config.bind)+1);
+        strcpy(addrs, Config.bind);
+        for (char *a = strtok(addrs, ","); a; a = strtok(NULL, ",")) {
+            if (Bench.numbind == MAX_BIND_ADDRS) {
+                fprintf(stderr, "Too many --bind addresses\n");
+                exit(1);
+            }
+            Bench.bind_addrs[Bench.numbind++] = a;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    adjustOpenFilesLimit();
+
+    Bench.el = elCreateEventLoop(Config.clients+64);
+    if (Bench.el == NULL) {
+        perror("Creating the event loop");
+        exit(1);
+    }
+
+    /* The message template: the timestamp is written over the start of
+     * it every time it is sent. */
+    Bench.msgbuf = chatMalloc(Config.size);
+    memset(Bench.msgbuf, 'x', Config.size-1);
+    Bench.msgbuf[Config.size-1] = '\n';
+
+    /* Connect everybody, without waiting: the connections complete while
+     * the event loop runs. */
+    Bench.conns = chatMalloc(sizeof(struct benchConn)*Config.clients);
+    Bench.idle = chatMalloc(sizeof(struct idleConn)*(Config.idle+1));
+    Bench.mem_before.rss = Bench.mem_after.rss = -1;
+    Bench.mem_before.idle_clients = Bench.mem_after.idle_clients = -1;
+    for (int j = 0; j < Config.clients; j++) {
+        struct benchConn *bc = &Bench.conns[j];
+
+        bc->fd = connectToServer(j);
+        if (bc->fd == -1) {
+            fprintf(stderr, "Connecting to %s:%lld: %s\n",
+                    Config.host, Config.port, strerror(errno));
+            exit(1);
+        }
+        bc->ready = 0;
+        int readbuf = (Config.size+LINE_OVERHEAD)*2;
+        if (readbuf < READBUF_SIZE) readbuf = READBUF_SIZE;
+        bc->read_cb = circbuf_alloc(readbuf);
+        bc->pending = chatMalloc(Config.size);
+        bc->pending_len = 0;
+        if (bc->read_cb == NULL ||
+            elCreateFileEvent(Bench.el, bc->fd, EL_READABLE,
+                              connReadHandler, bc) == EL_ERR)
+        {
+            perror("Setting up the connection");
+            exit(1);
+        }
+        Bench.numconns++;
+    }
+
+    elTimerInit(&Bench.send_timer, sendTimerProc, NULL);
+    elTimerInit(&Bench.report_timer, reportTimerProc, NULL);
+    elTimerInit(&Bench.phase_timer, phaseTimerProc, NULL);
+    elTimerInit(&Bench.ramp_timer, rampTimerProc, NULL);
+    elAddTimer(Bench.el, &Bench.phase_timer, 0);
+
+    while (!Bench.done) elProcessEvents(Bench.el, NULL);
+    report();
+    return 0;
+}
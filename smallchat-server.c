@@ -30,47 +30,601 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _XOPEN_SOURCE 700 /* For pthreads and the socket API. */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/select.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netdb.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+#define HAVE_MALLINFO2
+#endif
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "chatlib.h"
 #include "circular_buffer.h"
+#include "eventloop.h"
+#include "outqueue.h"
+#include "mpsc.h"
+#include "dict.h"
+#include "msglog.h"
+#include "frame.h"
+#include "compress.h"
+#include "stats.h"
+#include "log.h"
 
 /* ============================ Data structures =================================
  * The minimal stuff we can afford to have. This example must be simple
  * even for people that don't know a lot of C.
  * =========================================================================== */
 
-#define MAX_CLIENTS 1000 // This is actually the higher file descriptor.
+#define CLIENTS_TABLE_INITIAL 64 // Initial size of the clients tables.
 #define SERVER_PORT 7711
 
-#define READBUF_SIZE 128
+#define READBUF_INITIAL_SIZE 16 /* Read buffers start small and grow. */
+#define MAX_LINE_LENGTH 4096
 #define MSG_SEP '\n' /* Message separator (buffer reads until this char is found) */
+#define NICK_INLINE_SIZE 32 /* Nicks shorter than this need no allocation. */
+#define CLIENTS_PER_SLAB 64 /* Clients allocated at once by the pool. */
+#define CLIENT_WRITE_IOV 64 /* Messages of a write submitted to the kernel. */
+#define WRITES_PER_SLAB 64  /* Writes allocated at once by the pool. */
+#define MAX_WORKERS 256
+#define MAX_ACCEPTS_PER_CALL 1000 /* Default accept(2) budget per wakeup. */
+#define ACCEPT_BACKOFF_MS 100 /* Accepts pause when out of descriptors. */
+#define CLIENT_QUANTUM 32 /* Default messages of a client per turn. */
+#define TICK_BUDGET 1024 /* Default messages per event loop iteration. */
+#define MEMORY_SAMPLE_MS 1000 /* Period of the client memory sampling. */
+#define DEFAULT_ROOM "lobby" /* Joined by every client on connection. */
+#define MAX_ROOM_NAME 32
+#define MAX_ROOMS_PER_CLIENT 32
+#define MAX_NICK_LENGTH 64
+#define DEFAULT_NICK_PREFIX "user:" /* Reserved for the default nicks. */
+#define CLUSTER_ADDR_LEN 64 /* Longest "host:port" of a cluster node. */
+#define CLUSTER_READ_SIZE 16384 /* Bytes read at once from a peer link. */
+#define CLUSTER_MAX_FRAME (1<<27) /* Longest frame accepted from a peer. */
+#define CLUSTER_RECONNECT_MS 1000 /* Retry interval of the broken links. */
+
+/* Hot restart protocol, see handOff(). */
+#define HANDOFF_LISTENER 1  /* Comes with a listening socket. */
+#define HANDOFF_CLIENT 2    /* Comes with the socket of a client: struct
+                               handoffClient, then the nick and the rooms,
+                               the current one last, all null terminated. */
+#define HANDOFF_INPUT 3     /* Input of the last client, not parsed yet. */
+#define HANDOFF_OUTPUT 4    /* Output of the last client, not sent yet. */
+#define HANDOFF_END 5       /* The old process is done and exits. */
+#define HANDOFF_CHUNK 65536 /* Longest payload of a message. */
+#define HANDOFF_DRAIN_MS 1000 /* Time allowed to the writes in flight. */
+
+/* Client flags. */
+#define CLIENT_READ_PAUSED (1<<0) /* Output over soft limit: reads paused. */
+#define CLIENT_CLOSE_ASAP (1<<1)  /* Free it at the end of the event loop
+                                     iteration (for instance hard limit
+                                     reached or write error). */
+#define CLIENT_PENDING_WRITE (1<<2) /* In Chat->clients_pending_write. */
+#define CLIENT_DISCARD_LINE (1<<3) /* Line too long: ignore input up to the
+                                      next MSG_SEP. */
+#define CLIENT_BINARY (1<<4)      /* Input and output are binary frames
+                                     (see frame.h) instead of lines. */
+#define CLIENT_TLS_HANDSHAKE (1<<5) /* TLS handshake in progress: output is
+                                       queued, but not written yet. */
+#define CLIENT_TLS_READ (1<<6)    /* Input decrypted by the TLS library... */
+#define CLIENT_TLS_WRITE (1<<7)   /* ...and output encrypted by it. Without
+                                     these flags a TLS client is handled by
+                                     the kernel (kTLS) like any other. */
+#define CLIENT_INPUT_PENDING (1<<8) /* Complete messages buffered, waiting
+                                       for their turn in
+                                       Chat->clients_pending_input. */
+#define CLIENT_THROTTLED (1<<9)   /* Over its rate limit: waiting for the
+                                     throttle timer. */
+/* Any of these flags stops the reads from the client. */
+#define CLIENT_NO_READS (CLIENT_READ_PAUSED|CLIENT_INPUT_PENDING| \
+                         CLIENT_THROTTLED)
 
 /* This structure represents a connected client. There is very little
  * info about it: the socket descriptor and the nick name, if set, otherwise
  * the first byte of the nickname is set to 0 if not set.
  * The client can set its nickname with /nick <nickname> command. */
+struct client;
+
+/* A room, with the dense array of its members: fan-out to a room only
+ * visits the clients subscribed to it. */
+struct roomMember {
+    struct client *c;
+    int slot;   // Position of the room in c->rooms.
+};
+
+/* The last messages sent to a room, shared by all the workers, and kept
+ * as long as the room has members in any of them. Every room has its own
+ * lock, so that workers broadcasting to different rooms never wait for
+ * each other. */
+struct roomHistory {
+    struct msgRing ring;
+    pthread_mutex_t lock; // Protects 'ring'.
+    int members;        // Members of the room, in all the workers,
+                        // protected by Server.history_lock.
+};
+
+struct room {
+    char name[MAX_ROOM_NAME+1];
+    struct roomHistory *history;
+    struct roomMember *members;
+    int nummembers;
+    int members_size;   // Allocated slots of 'members'.
+};
+
+/* A room the client joined. */
+struct clientRoom {
+    struct room *room;
+    int index;  // Position of the client in room->members.
+};
+
+struct chatState;
+struct clientWrite;
+
 struct client {
     int fd;     // Client socket.
+    unsigned long long id;    // Unique, unlike fd that is reused.
+    struct chatState *worker; // Worker serving the client.
+    int index;  // Position in Chat->clients.
     char *nick; // Nickname of the client.
-    struct Circbuf *read_cb; // Circular buffer
+    char nickbuf[NICK_INLINE_SIZE]; // Storage for short nicknames.
+    struct Circbuf read_cb;  // Circular buffer
+    int scanned;             // Bytes at the head of read_cb already known
+                             // not to contain MSG_SEP.
+    size_t discard;          // Bytes of a rejected frame still to skip.
+    long long last_read_time; // mstime() of the last read from the socket.
+    long long last_ping_time; // mstime() of the last PING we sent.
+    struct elTimer timer;     // Keepalive and idle timeout.
+    struct elTimer shrink_timer; // Shrinks back a grown read buffer.
+    struct outQueue outq;    // Data waiting to be written to the socket.
+    struct clientWrite *write; // Write submitted to the kernel, or NULL.
+    int flags;               // CLIENT_* flags.
+    int codec;               // Codec compressing our binary frames, or 0.
+    struct tlsConn *tls;     // TLS session, while the library is needed
+                             // for one of the directions, or NULL.
+    struct client *close_next; // Next client in Chat->clients_to_close.
+    struct client *pending_write_next; // Next in clients_pending_write.
+    struct client *pending_input_prev; // Neighbours in
+    struct client *pending_input_next; // clients_pending_input.
+    int turn_left;            // Messages still allowed in this turn.
+    long long msg_tokens;     // Rate limiting buckets, in millionths of a
+    long long byte_tokens;    // message and of a byte, see
+    long long refill_time;    // refillClientTokens(). ustime() of the
+                              // last refill.
+    struct elTimer throttle_timer; // Ends the wait of a throttled client.
+    struct clientRoom *rooms; // Rooms joined by the client.
+    int numrooms;
+    int rooms_size;           // Allocated slots of 'rooms'.
+    struct room *room;        // Where the messages of the client go, the
+                              // room joined last, or NULL.
+    char readbuf[]; // Storage for read_cb while it has the initial size,
+                    // Chat->readbuf_inline bytes.
+};
+
+/* A write to a client in flight, with event loop backends doing the I/O
+ * for us (see elAsyncIO()). The kernel reads the messages straight from
+ * the output queue of the client, so they are only released when the
+ * write completes, even if the client is freed before. */
+struct clientWrite {
+    struct elWrite req;
+    struct client *c;       // The client, or NULL if it was freed. Then...
+    struct outQueue orphan; // ...its output queue and its socket are
+    int fd;                 // released here at completion.
+    size_t len;             // Bytes submitted.
+    struct iovec iov[CLIENT_WRITE_IOV];
+};
+
+/* States of the clients in the memory metrics, see sampleClientMemory().
+ * A client is in the first state of the list that applies to it. */
+#define CLIENT_STATE_PAUSED 0  /* Not read, see CLIENT_NO_READS. */
+#define CLIENT_STATE_WRITING 1 /* With output queued. */
+#define CLIENT_STATE_READING 2 /* With a partial message buffered. */
+#define CLIENT_STATE_IDLE 3    /* None of the above. */
+#define CLIENT_STATES 4
+
+const char *ClientStateNames[CLIENT_STATES] = {
+    "paused", "writing", "reading", "idle"
+};
+
+/* Memory used by the clients of a worker in a given state. */
+struct clientStateStats {
+    long long clients;
+    long long bytes;    // Client objects, read buffers, nicks and rooms.
+                        // Queued messages are shared and are not counted
+                        // here, see outqStats.queued.
+};
+
+/* Counters of a worker. Only the worker updates them (see stats.h), so
+ * the metrics can be rendered at any time, from any thread, without
+ * locks. */
+struct workerStats {
+    unsigned long long connections;     // Clients accepted.
+    unsigned long long disconnections;  // Clients freed.
+    unsigned long long accepts;         // accept(2) calls...
+    unsigned long long accept_eagain;   // ...that found no connection.
+    unsigned long long reads;           // Reads from the client sockets.
+    unsigned long long bytes_in;        // Bytes read from the clients.
+    unsigned long long msgs_in;         // Chat messages received.
+    unsigned long long commands;        // Commands received.
+    unsigned long long msgs_out;        // Messages queued to clients...
+    unsigned long long zmsgs_out;       // ...of which compressed.
+    unsigned long long drops;           // Messages not queued, because
+                                        // the recipient was closing.
+    unsigned long long hard_limit_kills; // Clients disconnected at the
+                                         // output hard limit.
+    unsigned long long input_deferred;  // Turns ended with complete
+                                        // messages left unprocessed...
+    unsigned long long throttled;       // ...and ended by a rate limit.
+    unsigned long long forwarded;       // Messages sent to other workers.
+    unsigned long long inbox;           // Messages got from other workers.
+    unsigned long long tls_handshakes;  // TLS handshakes completed...
+    unsigned long long tls_kernel_send; // ...with the output encrypted by
+                                        // the kernel.
+    unsigned long long tls_failures;    // TLS handshakes failed.
+    unsigned long long peer_msgs_out;   // Messages sent to other nodes.
+    unsigned long long peer_msgs_in;    // Messages got from other nodes.
+    long long peer_links;               // Links to other nodes ready.
+    struct outqStats peer_out;          // Writes to the peer links.
+    struct outqStats out;               // Writes to the client sockets.
+    struct histogram fanout_latency;    // Microseconds from reading a
+                                        // message to queuing it to every
+                                        // local recipient.
+    struct histogram forward_latency;   // The same, for the recipients
+                                        // served by the other workers.
+    struct clientStateStats states[CLIENT_STATES]; // Sampled every
+                                        // MEMORY_SAMPLE_MS.
+    long long slab_bytes;               // Allocated by the pools of the
+    long long slab_used_bytes;          // worker, and used by objects.
 };
 
-/* This global structure encapsulates the global state of the chat. */
+/* This structure encapsulates the state of a worker. Every worker runs
+ * its own event loop in its own thread, and serves its own clients: no
+ * lock is needed to access any of this. With a single worker (the
+ * default) the main thread is the only worker. */
 struct chatState {
+    int id;             // Worker number, 0 is the main thread.
+    pthread_t thread;   // Thread running the worker.
     int serversock;     // Listening server socket.
+    struct eventLoop *el; // Event loop multiplexing all our sockets.
     int numclients;     // Number of connected clients right now.
-    int maxclient;      // The greatest 'clients' slot populated.
-    struct client *clients[MAX_CLIENTS]; // Clients are set in the corresponding
-                                         // slot of their socket descriptor.
+    struct client **clients; // Connected clients, densely packed in the
+                             // first numclients slots, so that fan-out
+                             // only visits actual clients.
+    int clients_size;   // Allocated slots of 'clients'.
+    struct client **clients_by_fd; // Clients indexed by socket descriptor.
+    int clients_by_fd_size; // Allocated slots of 'clients_by_fd'.
+    struct client *clients_to_close; // Clients flagged CLIENT_CLOSE_ASAP.
+    struct client *clients_pending_write; // Output to flush before sleeping.
+    struct client *clients_pending_input; // Clients waiting for their turn
+    struct client *clients_pending_input_tail; // to process their input.
+    long long input_budget; // Messages still processed in this iteration.
+    struct slabPool client_pool; // Where clients (and their initial read
+                                 // buffer) are allocated from.
+    struct slabPool write_pool;  // Where clientWrite objects come from.
+    int readbuf_inline;          // Size of the read buffer included in every
+                                 // client object.
+    struct sharedMsg *welcome_msg; // Sent to every new client.
+    struct mpscQueue inbox; // Messages from other workers, to fan-out to
+                            // our clients.
+    int wakeup_fd[2];   // Written by other workers to wake us up when
+                        // there is something in the inbox. It is an
+                        // eventfd (both entries are the same fd) where
+                        // available, a pipe otherwise.
+    int wakeup_pending; // True if a wakeup is already on its way.
+    long long accept_tokens; // Token bucket limiting the accept rate, in
+                             // millionths of a connection.
+    long long accept_refill_time; // Last refill of the bucket (ustime).
+    int accept_paused;  // Listener unregistered until the bucket refills.
+    struct elTimer accept_timer; // Resumes accepts when paused.
+    struct elTimer memory_timer; // Samples the memory of the clients.
+    struct dict rooms;  // Rooms with members in this worker, by name.
+    long long read_time; // ustime() of the last read from a client.
+    int stopped;        // Hot restart in progress: no reads, no accepts.
+    char stats_pad1[STATS_CACHELINE]; // Keep the stats, read by other
+    struct workerStats stats;         // threads, away from the rest.
+    char stats_pad2[STATS_CACHELINE];
+};
+
+/* State of the worker running on this thread (initialized at startup). */
+__thread struct chatState *Chat;
+
+/* This global structure holds what is shared by all the workers. */
+struct chatServer {
+    int numworkers;
+    struct chatState **workers;
+    int shared_listener; // When SO_REUSEPORT is not available, the only
+                         // listening socket, shared by all workers.
+    unsigned long long next_client_id;
+    struct dict nicks;   // Nick -> client, of all the workers.
+    pthread_mutex_t nicks_lock; // Protects 'nicks'. While it is held the
+                                // clients in 'nicks' can't be freed.
+    struct dict history; // Room name -> roomHistory.
+    pthread_mutex_t history_lock; // Protects 'history' and the members
+                                  // count of the histories in it.
+    struct msgLog log;   // Where broadcast messages are persisted.
+    int handoff_fd;      // Hot restart in progress to this socket, or -1.
+    pthread_mutex_t handoff_lock; // Protects the fields below, that tell
+    pthread_cond_t handoff_cond;  // worker 0 when the other workers are
+    int handoff_stopped;          // stopped, and them when the hot
+    unsigned long long handoff_gen; // restart failed (see handOff()).
+    size_t malloc_allocated; // Sampled by mallocSamplerThread().
+    size_t malloc_free;
+    size_t malloc_mmap;
+} Server;
+
+/* Peer link states. */
+#define PEER_CONNECTING 0 /* Our connect(2) is in progress. */
+#define PEER_HANDSHAKE 1  /* Waiting for the HELLO of the other node. */
+#define PEER_READY 2      /* Exchanging subscriptions and messages. */
+
+/* A link to another node of the cluster. Like everything in the cluster
+ * it is only accessed by worker 0. */
+struct clusterPeer {
+    int fd;
+    int state;          // PEER_* state.
+    int outbound;       // True if we connected, false if the node did.
+    int closing;        // Freed at the end of the event loop iteration.
+    int pending_write;  // Output to flush before sleeping.
+    int codec;          // Codec compressing the messages, or 0.
+    uint64_t id;        // Id of the node, from its HELLO.
+    char addr[CLUSTER_ADDR_LEN]; // Where the node accepts peers, empty
+                                 // until known.
+    unsigned char *rbuf; // Input not processed yet...
+    size_t rlen, rsize;  // ...its length and allocated size.
+    struct outQueue outq; // Frames waiting to be written to the socket.
+    struct dict rooms;   // Rooms where the node has members.
+};
+
+/* A node we know the address of, and keep a link with. */
+struct clusterNode {
+    char addr[CLUSTER_ADDR_LEN];
+    uint64_t id;        // Id of the node, 0 until we talked to it.
+    int self;           // The address turned out to be our own.
+};
+
+/* The state of this node of the cluster. */
+struct clusterState {
+    uint64_t id;        // Random, told to the other nodes.
+    int listener;       // Socket accepting the other nodes.
+    struct clusterPeer **peers; // The links, in any state.
+    int numpeers;
+    int peers_size;     // Allocated slots of 'peers'.
+    struct clusterNode *nodes; // The nodes we know about.
+    int numnodes;
+    int nodes_size;     // Allocated slots of 'nodes'.
+    struct dict rooms;  // Rooms with members here, as told to the peers.
+    struct elTimer timer; // Reconnects the nodes without a link.
+} Cluster;
+
+/* Hot restart: the state of a client as the old process sends it. */
+struct handoffClient {
+    uint32_t worker;        // Worker serving it in the old process.
+    uint8_t binary;         // CLIENT_BINARY.
+    uint8_t discard_line;   // CLIENT_DISCARD_LINE.
+    uint8_t codec;
+    uint8_t numrooms;
+    uint64_t discard;
+};
+
+/* A message being built, see handoffAppend(). */
+struct handoffMsg {
+    size_t len;
+    char buf[1+HANDOFF_CHUNK];
+};
+
+/* What the new process got, until the workers exist to take it. */
+struct handoffRestore {
+    int fd;
+    char *state;        // struct handoffClient, nick and rooms.
+    size_t statelen;
+    char *input;
+    size_t inputlen;
+    char *output;
+    size_t outputlen;
+};
+
+/* What the new process took over from the old one. */
+struct handoffState {
+    int *listeners;     // Listening sockets.
+    int numlisteners;
+    struct handoffRestore *clients;
+    int numclients;
+    int clients_size;   // Allocated slots of 'clients'.
+} Handoff;
+
+/* A message relayed to another worker, so that it sends it to its own
+ * clients. A message without 'msg' tells worker 0 instead that 'room'
+ * got its first member, or lost the last one (see updateClusterRoom()). */
+struct workerMsg {
+    struct mpscNode node; // Must be the first member.
+    struct sharedMsg *msg;
+    long long read_time;  // When the message was read, see workerStats.
+    int target_fd;        // Only send it to this client, if not -1...
+    unsigned long long target_id; // ...and if it is still the same client.
+    char room[];          // Otherwise send it to the members of this
+                          // room.
+};
+
+/* Server configuration, set from the command line at startup. */
+struct chatConfig {
+    long long port;                 // TCP port to listen to.
+    long long outbuf_hard_limit;    // Disconnect a client when its pending
+                                    // output reaches this many bytes.
+    long long outbuf_soft_limit;    // Stop reading from a client when its
+                                    // pending output reaches this many bytes.
+    long long outbuf_low_watermark; // Resume reading when the pending output
+                                    // of a paused client drops to this.
+    long long defer_flush;          // If true, output is flushed once at the
+                                    // end of the event loop iteration.
+    long long readbuf_initial;      // Initial size of the read buffers.
+    long long max_line_length;      // Longest line accepted from a client.
+    long long readbuf_shrink_idle;  // Seconds without reads after which a
+                                    // grown read buffer shrinks back.
+    long long threads;              // Number of worker threads.
+    long long max_accepts_per_call; // Connections accepted per wakeup of
+                                    // the listening socket, at most.
+    long long max_accept_rate;      // Connections accepted per second by
+                                    // each worker, 0 for no limit.
+    long long history_size;         // Messages remembered for every room.
+    char *log_file;                 // Persist the messages here, if set.
+    long long log_segment_size;     // Size of the log segments.
+    long long log_sync_ms;          // Interval of the log group commits.
+    long long ping_interval;        // Seconds of silence after which a
+                                    // client gets a PING, 0 for never.
+    long long idle_timeout;         // Seconds of silence after which a
+                                    // client is disconnected, 0 for never.
+    long long metrics_port;         // Serve the metrics on this port, if
+                                    // not 0.
+    char *log_level;                // Least important records logged.
+    long long cluster_port;         // Accept the other nodes of the
+                                    // cluster on this port, if not 0.
+    char *cluster_peers;            // Comma separated host:port of nodes
+                                    // to link with.
+    char *cluster_allow;            // Comma separated numeric addresses
+                                    // allowed to link with us, or NULL.
+    long long compress_min_size;    // Shorter messages are never
+                                    // compressed.
+    char *tls_cert;                 // Clients connect with TLS, with this
+    char *tls_key;                  // certificate chain and key, if set.
+    char *handoff_socket;           // UNIX socket of the hot restarts.
+    long long client_msg_rate;      // Messages per second processed for
+                                    // each client, 0 for no limit.
+    long long client_byte_rate;     // Likewise, bytes per second.
+    long long client_quantum;       // Messages of a client processed in a
+                                    // row, before the next one's turn.
+    long long tick_budget;          // Messages processed per event loop
+                                    // iteration by each worker.
 };
 
-struct chatState *Chat; // Global chat state (initialized at startup).
+struct chatConfig Config = {
+    .port = SERVER_PORT,
+    .outbuf_hard_limit = 8*1024*1024,
+    .outbuf_soft_limit = 1024*1024,
+    .outbuf_low_watermark = 256*1024,
+    .defer_flush = 0,
+    .readbuf_initial = READBUF_INITIAL_SIZE,
+    .max_line_length = MAX_LINE_LENGTH,
+    .readbuf_shrink_idle = 2,
+    .threads = 1,
+    .max_accepts_per_call = MAX_ACCEPTS_PER_CALL,
+    .max_accept_rate = 0,
+    .history_size = 64,
+    .log_file = NULL,
+    .log_segment_size = 64*1024*1024,
+    .log_sync_ms = 1000,
+    .ping_interval = 0,
+    .idle_timeout = 0,
+    .metrics_port = 0,
+    .log_level = "verbose",
+    .cluster_port = 0,
+    .cluster_peers = NULL,
+    .cluster_allow = NULL,
+    .compress_min_size = 512,
+    .tls_cert = NULL,
+    .tls_key = NULL,
+    .handoff_socket = NULL,
+    .client_msg_rate = 0,
+    .client_byte_rate = 0,
+    .client_quantum = CLIENT_QUANTUM,
+    .tick_budget = TICK_BUDGET,
+};
+
+/* Command line options, numeric ones first. */
+struct chatOption {
+    const char *name;
+    long long *value;
+    long long min, max;
+    const char *help;
+} ChatOptions[] = {
+    {"--port", &Config.port, 1, 65535,
+     "TCP port to listen to"},
+    {"--outbuf-hard-limit", &Config.outbuf_hard_limit, 1, 1LL<<40,
+     "Pending output bytes after which a client is disconnected"},
+    {"--outbuf-soft-limit", &Config.outbuf_soft_limit, 1, 1LL<<40,
+     "Pending output bytes after which a client reads are paused"},
+    {"--outbuf-low-watermark", &Config.outbuf_low_watermark, 0, 1LL<<40,
+     "Pending output bytes under which a paused client is resumed"},
+    {"--defer-flush", &Config.defer_flush, 0, 1,
+     "Flush output once per event loop iteration (1) or right away (0)"},
+    {"--readbuf-initial", &Config.readbuf_initial, 1, 1<<20,
+     "Initial size of the client read buffers"},
+    {"--max-line-length", &Config.max_line_length, 1, 1<<26,
+     "Longest line accepted from a client, longer ones are rejected"},
+    {"--readbuf-shrink-idle", &Config.readbuf_shrink_idle, 1, 1<<20,
+     "Seconds without input after which read buffers shrink back"},
+    {"--threads", &Config.threads, 1, MAX_WORKERS,
+     "Worker threads, each with its own event loop and listening socket"},
+    {"--max-accepts-per-call", &Config.max_accepts_per_call, 1, 1<<20,
+     "Connections accepted at most every time the listener is ready"},
+    {"--max-accept-rate", &Config.max_accept_rate, 0, 1<<20,
+     "Connections accepted per second by each worker (0 = no limit)"},
+    {"--history-size", &Config.history_size, 0, 1<<16,
+     "Messages of every room kept for /history (0 = no history)"},
+    {"--log-segment-size", &Config.log_segment_size, 4096, 1LL<<40,
+     "Size of the message log segments"},
+    {"--log-sync-ms", &Config.log_sync_ms, 1, 60000,
+     "Milliseconds between the message log fsyncs"},
+    {"--ping-interval", &Config.ping_interval, 0, 1<<20,
+     "Seconds of client silence after which a PING is sent (0 = never)"},
+    {"--idle-timeout", &Config.idle_timeout, 0, 1<<20,
+     "Seconds of client silence after which it is disconnected (0 = never)"},
+    {"--metrics-port", &Config.metrics_port, 0, 65535,
+     "Port serving the metrics in the Prometheus format (0 = no port)"},
+    {"--cluster-port", &Config.cluster_port, 0, 65535,
+     "Port where the other nodes of a cluster connect (0 = no cluster)"},
+    {"--compress-min-size", &Config.compress_min_size, 0, 1LL<<40,
+     "Bytes of a message under which it is never compressed"},
+    {"--client-msg-rate", &Config.client_msg_rate, 0, 1<<20,
+     "Messages per second accepted from each client (0 = no limit)"},
+    {"--client-byte-rate", &Config.client_byte_rate, 0, 1LL<<30,
+     "Bytes per second accepted from each client (0 = no limit)"},
+    {"--client-quantum", &Config.client_quantum, 1, 1<<20,
+     "Messages of a client processed before the next client's turn"},
+    {"--tick-budget", &Config.tick_budget, 1, 1<<30,
+     "Messages processed per event loop iteration by each worker"},
+    {NULL, NULL, 0, 0, NULL}
+};
+
+struct chatStrOption {
+    const char *name;
+    char **value;
+    const char *help;
+} ChatStrOptions[] = {
+    {"--log-file", &Config.log_file,
+     "Append the messages to segments named after this path"},
+    {"--log-level", &Config.log_level,
+     "debug (echoes every message), verbose, notice or warning"},
+    {"--cluster-peers", &Config.cluster_peers,
+     "Comma separated host:port of cluster nodes to link with"},
+    {"--cluster-allow", &Config.cluster_allow,
+     "Comma separated IP addresses of the only nodes that may link with "
+     "us (without it, firewall the --cluster-port)"},
+    {"--tls-cert", &Config.tls_cert,
+     "PEM certificate chain: clients must then connect with TLS"},
+    {"--tls-key", &Config.tls_key,
+     "PEM private key of the --tls-cert certificate"},
+    {"--handoff-socket", &Config.handoff_socket,
+     "Take the clients over from the process listening at this UNIX "
+     "socket, if any, then listen there for the next one"},
+    {NULL, NULL, NULL}
+};
 
 /* ====================== Small chat core implementation ========================
  * Here the idea is very simple: we accept new connections, read what clients
@@ -79,282 +633,3795 @@ struct chatState *Chat; // Global chat state (initialized at startup).
  * simple chat system ever possible.
  * =========================================================================== */
 
-/* Create a new client bound to 'fd'. This is called when a new client
- * connects. As a side effect updates the global Chat state. */
-struct client *createClient(int fd) {
-    char nick[32]; // Used to create an initial nick for the user.
-    int nicklen = snprintf(nick, sizeof(nick), "user:%d", fd);
-    struct client *c = chatMalloc(sizeof(*c));
+void readFromClient(struct eventLoop *el, int fd, void *privdata, int mask);
+void recvFromClient(struct eventLoop *el, int fd, char *buf, int res,
+                    void *privdata);
+void acceptHandler(struct eventLoop *el, int fd, void *privdata, int mask);
+void acceptAsyncHandler(struct eventLoop *el, int fd, int res, void *privdata);
+void acceptTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata);
+void writeToClientHandler(struct eventLoop *el, int fd, void *privdata,
+                          int mask);
+void writeToClientDone(struct eventLoop *el, struct elWrite *w, ssize_t res,
+                       void *privdata);
+void tlsHandshakeHandler(struct eventLoop *el, int fd, void *privdata,
+                         int mask);
+void addClientPendingWrite(struct client *c);
+int watchListener(struct chatState *w);
+int joinRoom(struct client *c, const char *name);
+void partRoom(struct client *c, struct room *r);
+void clientTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata);
+void clientShrinkTimerProc(struct eventLoop *el, struct elTimer *t,
+                           void *privdata);
+void armClientTimer(struct client *c);
+int growClientReadBuffer(struct client *c, int size);
+void initCommandTable(void);
+void createMetricsListener(struct chatState *w);
+void notifyRoomChange(const char *name);
+void updateClusterRoom(const char *name);
+void clusterForward(const char *room, struct sharedMsg *m);
+void initCluster(struct chatState *w);
+void handleClusterPeers(void);
+void clientThrottleTimerProc(struct eventLoop *el, struct elTimer *t,
+                             void *privdata);
+void scheduleClientInput(struct client *c);
+void unlinkPendingInput(struct client *c);
+void handleClientsWithPendingInput(void);
+void memoryTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata);
+void startMallocSampler(void);
+void sanitizeFrameText(char *text, size_t len);
+int takeInputTokens(struct client *c, int len);
+int clientLineProc(void *privdata, int msglen);
+int clientFrameProc(void *privdata, int type, int hdrlen, size_t len);
+void takeOver(void);
+void restoreHandoffClients(void);
+void createHandoffListener(struct chatState *w);
+void handOff(void);
+void waitHandoff(void);
+
+/* Add the client to the clients tables. Both grow geometrically as
+ * needed: there is no limit to the number of clients other than the
+ * number of file descriptors the process can open. */
+void linkClient(struct client *c) {
+    if (c->fd >= Chat->clients_by_fd_size) {
+        int newsize = Chat->clients_by_fd_size*2;
+        if (newsize <= c->fd) newsize = c->fd+1;
+        Chat->clients_by_fd = chatRealloc(Chat->clients_by_fd,
+            sizeof(struct client*)*newsize);
+        memset(Chat->clients_by_fd+Chat->clients_by_fd_size, 0,
+            sizeof(struct client*)*(newsize-Chat->clients_by_fd_size));
+        Chat->clients_by_fd_size = newsize;
+    }
+    assert(Chat->clients_by_fd[c->fd] == NULL); // This should be available.
+    Chat->clients_by_fd[c->fd] = c;
+
+    if (Chat->numclients == Chat->clients_size) {
+        Chat->clients_size *= 2;
+        Chat->clients = chatRealloc(Chat->clients,
+            sizeof(struct client*)*Chat->clients_size);
+    }
+    c->index = Chat->numclients;
+    Chat->clients[Chat->numclients++] = c;
+}
+
+/* Remove the client from the clients tables, in constant time: the last
+ * client of the dense array takes its slot. */
+void unlinkClient(struct client *c) {
+    struct client *last = Chat->clients[--Chat->numclients];
+
+    Chat->clients[c->index] = last;
+    last->index = c->index;
+    Chat->clients_by_fd[c->fd] = NULL;
+}
+
+/* Take a reference to the history of room 'name' for a new member,
+ * creating it if needed. */
+struct roomHistory *retainRoomHistory(const char *name) {
+    pthread_mutex_lock(&Server.history_lock);
+    struct roomHistory *h = dict_find(&Server.history, name);
+    int created = h == NULL;
+    if (created) {
+        h = chatMalloc(sizeof(*h));
+        msgring_init(&h->ring, Config.history_size);
+        pthread_mutex_init(&h->lock, NULL);
+        h->members = 0;
+        dict_add(&Server.history, name, h);
+    }
+    h->members++;
+    pthread_mutex_unlock(&Server.history_lock);
+    if (created) notifyRoomChange(name);
+    return h;
+}
+
+/* Drop the reference of a member that left room 'name'. The history is
+ * destroyed with the last member. */
+void releaseRoomHistory(const char *name, struct roomHistory *h) {
+    pthread_mutex_lock(&Server.history_lock);
+    int destroyed = --h->members == 0;
+    if (destroyed) {
+        dict_delete(&Server.history, name);
+        msgring_free(&h->ring);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+    }
+    pthread_mutex_unlock(&Server.history_lock);
+    if (destroyed) notifyRoomChange(name);
+}
+
+/* Remember the message 'm' sent to room 'r'. The room has members here,
+ * so its history can't be destroyed meanwhile. */
+void addRoomHistory(struct room *r, struct sharedMsg *m) {
+    if (Config.history_size == 0) return;
+    pthread_mutex_lock(&r->history->lock);
+    msgring_push(&r->history->ring, m);
+    pthread_mutex_unlock(&r->history->lock);
+}
+
+/* Return the room of this worker called 'name', or NULL. */
+struct room *lookupRoom(const char *name) {
+    return dict_find(&Chat->rooms, name);
+}
 
-    socketSetNonBlockNoDelay(fd); // Pretend this will not fail.
+/* Return the position of room 'r' in c->rooms, or -1 if the client is
+ * not a member. Clients are in a few rooms at most: a scan is fine. */
+int clientRoomSlot(struct client *c, struct room *r) {
+    for (int j = 0; j < c->numrooms; j++)
+        if (c->rooms[j].room == r) return j;
+    return -1;
+}
+
+/* Subscribe the client to the room 'name', creating it if needed, and
+ * make it the room where the client messages go. Returns 0 if the client
+ * is already in too many rooms, otherwise 1. */
+int joinRoom(struct client *c, const char *name) {
+    struct room *r = lookupRoom(name);
+
+    if (r && clientRoomSlot(c, r) != -1) {
+        c->room = r;
+        return 1;
+    }
+    if (c->numrooms == MAX_ROOMS_PER_CLIENT) return 0;
+
+    if (r == NULL) {
+        r = chatMalloc(sizeof(*r));
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->members = NULL;
+        r->nummembers = r->members_size = 0;
+        dict_add(&Chat->rooms, r->name, r);
+    }
+
+    if (r->nummembers == r->members_size) {
+        r->members_size = r->members_size ? r->members_size*2 : 4;
+        r->members = chatRealloc(r->members,
+            sizeof(struct roomMember)*r->members_size);
+    }
+    if (c->numrooms == c->rooms_size) {
+        c->rooms_size = c->rooms_size ? c->rooms_size*2 : 2;
+        c->rooms = chatRealloc(c->rooms,
+            sizeof(struct clientRoom)*c->rooms_size);
+    }
+    r->members[r->nummembers].c = c;
+    r->members[r->nummembers].slot = c->numrooms;
+    c->rooms[c->numrooms].room = r;
+    c->rooms[c->numrooms].index = r->nummembers;
+    r->nummembers++;
+    c->numrooms++;
+    c->room = r;
+    r->history = retainRoomHistory(r->name);
+    return 1;
+}
+
+/* Unsubscribe the client from room 'r', that must be one of its rooms.
+ * Both arrays are kept dense in constant time, moving their last entry
+ * into the hole. Rooms are destroyed when the last member leaves. */
+void partRoom(struct client *c, struct room *r) {
+    int slot = clientRoomSlot(c, r);
+    int index = c->rooms[slot].index;
+
+    struct roomMember last = r->members[--r->nummembers];
+    r->members[index] = last;
+    last.c->rooms[last.slot].index = index;
+
+    if (slot != --c->numrooms) {
+        struct clientRoom moved = c->rooms[c->numrooms];
+        c->rooms[slot] = moved;
+        moved.room->members[moved.index].slot = slot;
+    }
+
+    if (c->room == r)
+        c->room = c->numrooms ? c->rooms[c->numrooms-1].room : NULL;
+    releaseRoomHistory(r->name, r->history);
+
+    if (r->nummembers == 0) {
+        dict_delete(&Chat->rooms, r->name);
+        free(r->members);
+        free(r);
+    }
+}
+
+/* Return the client using the socket 'fd', or NULL. */
+struct client *lookupClientByFd(int fd) {
+    if (fd < 0 || fd >= Chat->clients_by_fd_size) return NULL;
+    return Chat->clients_by_fd[fd];
+}
+
+/* Start (or resume) reading from the client. With backends doing the
+ * I/O for us the data is received on our behalf and handed to
+ * recvFromClient(), otherwise readFromClient() reads it when the socket
+ * is readable. So it is for the TLS clients not decrypted by the kernel:
+ * the TLS library does the reads. */
+int watchClientReads(struct client *c) {
+    if (Chat->stopped) return EL_OK; /* See quiesceWorker(). */
+    if (elAsyncIO() && !(c->flags & CLIENT_TLS_READ))
+        return elAsyncRecv(Chat->el, c->fd, recvFromClient, c);
+    return elCreateFileEvent(Chat->el, c->fd, EL_READABLE, readFromClient, c);
+}
+
+/* Stop reading from the client, see watchClientReads(). */
+void unwatchClientReads(struct client *c) {
+    if (elAsyncIO() && !(c->flags & CLIENT_TLS_READ))
+        elAsyncStop(Chat->el, c->fd);
+    else
+        elDeleteFileEvent(Chat->el, c->fd, EL_READABLE);
+}
+
+/* Stop reading from the client for the reason 'flag', one of
+ * CLIENT_NO_READS. */
+void pauseClientReads(struct client *c, int flag) {
+    if (!(c->flags & CLIENT_NO_READS)) unwatchClientReads(c);
+    c->flags |= flag;
+}
+
+/* The reason 'flag' to pause the reads is gone: resume them, unless
+ * there are others. */
+int resumeClientReads(struct client *c, int flag) {
+    c->flags &= ~flag;
+    if (c->flags & CLIENT_NO_READS) return EL_OK;
+    return watchClientReads(c);
+}
+
+/* Create a new client bound to 'fd'. This is called when a new client
+ * connects. As a side effect updates the global Chat state. With 'tls'
+ * the client starts with the TLS handshake: the client takes the session
+ * over, and frees it on error. */
+struct client *createClient(int fd, struct tlsConn *tls) {
+    struct client *c = slabAlloc(&Chat->client_pool);
 
     c->fd = fd;
-    c->nick = chatMalloc(nicklen+1);
-    memcpy(c->nick,nick,nicklen);
+    c->tls = tls;
+    c->flags = tls ? CLIENT_TLS_HANDSHAKE|CLIENT_TLS_READ|CLIENT_TLS_WRITE : 0;
+    if (watchClientReads(c) == EL_ERR) {
+        log_write(LL_WARNING, "Registering client socket: %s",
+                  strerror(errno));
+        if (tls) tlsFree(tls);
+        close(fd);
+        slabFree(&Chat->client_pool, c);
+        return NULL;
+    }
+
+    c->id = __atomic_add_fetch(&Server.next_client_id, 1, __ATOMIC_RELAXED);
+    c->worker = Chat;
+    c->nick = c->nickbuf;
+    snprintf(c->nickbuf, sizeof(c->nickbuf), DEFAULT_NICK_PREFIX "%d", fd);
 
-    /* Allocate circular buffer. */
-    c->read_cb = circbuf_alloc(READBUF_SIZE);
-    assert(c->read_cb != NULL);
-    
-    assert(Chat->clients[c->fd] == NULL); // This should be available.
-    Chat->clients[c->fd] = c;
+    /* Descriptors are unique across the workers, and the prefix can't
+     * be used with /nick: the default nick is always available. */
+    pthread_mutex_lock(&Server.nicks_lock);
+    dict_add(&Server.nicks, c->nick, c);
+    pthread_mutex_unlock(&Server.nicks_lock);
+    c->scanned = 0;
+    c->discard = 0;
+    c->last_read_time = mstime();
+    c->last_ping_time = 0;
+    elTimerInit(&c->timer, clientTimerProc, c);
+    elTimerInit(&c->shrink_timer, clientShrinkTimerProc, c);
+    elTimerInit(&c->throttle_timer, clientThrottleTimerProc, c);
+    c->msg_tokens = Config.client_msg_rate*1000000;
+    c->byte_tokens = Config.client_byte_rate*1000000;
+    c->refill_time = ustime();
+    c->turn_left = 0;
+    outq_init(&c->outq, &Chat->stats.out);
+    c->write = NULL;
+    c->codec = 0;
+    c->close_next = NULL;
+    c->pending_write_next = NULL;
+    c->rooms = NULL;
+    c->numrooms = c->rooms_size = 0;
+    c->room = NULL;
 
-    /* We need to update the max client set if needed. */
-    if (c->fd > Chat->maxclient) Chat->maxclient = c->fd;
-    
-    Chat->numclients++;
+    /* The circular buffer starts in the storage embedded in the client:
+     * connecting costs no allocation besides the pool slot. */
+    circbuf_init(&c->read_cb, c->readbuf, Chat->readbuf_inline);
 
+    linkClient(c);
+    joinRoom(c, DEFAULT_ROOM);
+    armClientTimer(c);
     return c;
 }
 
 /* Free a client, associated resources, and unbind it from the global
  * state in Chat. */
 void freeClient(struct client *c) {
-    free(c->nick);
-    close(c->fd);
-    circbuf_free(c->read_cb);
-    Chat->clients[c->fd] = NULL;
-    Chat->numclients--;
-    
-    if (Chat->maxclient == c->fd) {
-        /* Ooops, this was the max client set. Let's find what is
-         * the new highest slot used. */
-        int j;
-
-        for (j = Chat->maxclient-1; j >= 0; j--) {
-            if (Chat->clients[j] != NULL) {
-                Chat->maxclient = j;
+    pthread_mutex_lock(&Server.nicks_lock);
+    dict_delete(&Server.nicks, c->nick);
+    pthread_mutex_unlock(&Server.nicks_lock);
+    if (c->nick != c->nickbuf) free(c->nick);
+    while (c->numrooms) partRoom(c, c->rooms[c->numrooms-1].room);
+    free(c->rooms);
+    elDelTimer(Chat->el, &c->timer);
+    elDelTimer(Chat->el, &c->shrink_timer);
+    elDelTimer(Chat->el, &c->throttle_timer);
+    if (c->flags & CLIENT_INPUT_PENDING) unlinkPendingInput(c);
+    elDeleteFileEvent(Chat->el, c->fd, EL_READABLE|EL_WRITABLE);
+    elAsyncCancel(Chat->el, c->fd);
+    circbuf_deinit(&c->read_cb);
+    if (c->tls) tlsFree(c->tls);
+    if (c->write) {
+        /* The kernel may still be reading our messages, or not even know
+         * about the write yet: one that finds the descriptor closed, and
+         * maybe reused by another client, is no good. The write releases
+         * both when it completes. */
+        c->write->c = NULL;
+        c->write->orphan = c->outq;
+        c->write->fd = c->fd;
+        elAsyncCancelWrite(Chat->el, &c->write->req);
+    } else {
+        close(c->fd);
+        outq_free(&c->outq);
+    }
+    unlinkClient(c);
+    slabFree(&Chat->client_pool, c);
+    STAT_INC(Chat->stats.disconnections);
+}
+
+/* Set the client nickname. Short nicknames are stored inside the client
+ * itself. Nicks are unique in the whole server: returns 0 if 'nick' is
+ * used by another client. */
+int setClientNick(struct client *c, const char *nick) {
+    size_t len = strlen(nick);
+
+    pthread_mutex_lock(&Server.nicks_lock);
+    struct client *owner = dict_find(&Server.nicks, nick);
+    if (owner != NULL) {
+        pthread_mutex_unlock(&Server.nicks_lock);
+        return owner == c;
+    }
+    dict_delete(&Server.nicks, c->nick);
+    if (c->nick != c->nickbuf) free(c->nick);
+    c->nick = len < sizeof(c->nickbuf) ? c->nickbuf : chatMalloc(len+1);
+    memcpy(c->nick,nick,len+1);
+    dict_add(&Server.nicks, c->nick, c);
+    pthread_mutex_unlock(&Server.nicks_lock);
+    return 1;
+}
+
+/* Schedule the client to be freed at the end of the current event loop
+ * iteration. This is what we use from code paths that may still be
+ * referencing the client, like the fan-out loop or the parser. */
+void freeClientAsync(struct client *c) {
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+    c->flags |= CLIENT_CLOSE_ASAP;
+    c->close_next = Chat->clients_to_close;
+    Chat->clients_to_close = c;
+}
+
+/* Free all the clients flagged with CLIENT_CLOSE_ASAP. */
+void freeClientsInAsyncFreeQueue(void) {
+    while (Chat->clients_to_close) {
+        struct client *c = Chat->clients_to_close;
+        Chat->clients_to_close = c->close_next;
+        freeClient(c);
+    }
+}
+
+/* Apply the output watermarks: clients whose output reached the hard limit
+ * are disconnected, the ones over the soft limit are no longer read until
+ * their output drains to the low watermark. This way a slow reader can't
+ * make the server memory balloon, nor keep producing traffic it is not
+ * going to consume. */
+void checkClientOutputLimits(struct client *c) {
+    long long pending = outq_len(&c->outq);
+
+    if (pending >= Config.outbuf_hard_limit) {
+        log_write(LL_NOTICE, "Client fd=%d, nick=%s reached the output "
+                  "hard limit (%lld bytes): disconnecting",
+                  c->fd, c->nick, pending);
+        STAT_INC(Chat->stats.hard_limit_kills);
+        freeClientAsync(c);
+    } else if (!(c->flags & CLIENT_READ_PAUSED) &&
+               pending >= Config.outbuf_soft_limit)
+    {
+        pauseClientReads(c, CLIENT_READ_PAUSED);
+    } else if ((c->flags & CLIENT_READ_PAUSED) &&
+               pending <= Config.outbuf_low_watermark)
+    {
+        if (resumeClientReads(c, CLIENT_READ_PAUSED) == EL_ERR)
+            freeClientAsync(c);
+    }
+}
+
+/* Called after writing to the client. When some output is left, ask the
+ * event loop to tell us when the socket becomes writable again, otherwise
+ * stop listening for writable events. */
+void afterClientWrite(struct client *c) {
+    if (outq_len(&c->outq) == 0) {
+        elDeleteFileEvent(Chat->el, c->fd, EL_WRITABLE);
+    } else if (!(elGetFileEvents(Chat->el, c->fd) & EL_WRITABLE)) {
+        if (elCreateFileEvent(Chat->el, c->fd, EL_WRITABLE,
+                              writeToClientHandler, c) == EL_ERR)
+        {
+            freeClientAsync(c);
+            return;
+        }
+    }
+    checkClientOutputLimits(c);
+}
+
+/* Submit a write of the pending output of the client to the event loop
+ * backend, unless one is already in flight: when it completes, the next
+ * one is submitted. All the writes of an iteration reach the kernel
+ * together, with a single system call. */
+void submitClientWrite(struct client *c) {
+    if (c->write || outq_len(&c->outq) == 0) return;
+
+    struct clientWrite *cw = slabAlloc(&Chat->write_pool);
+    int iovcnt = outq_gather(&c->outq, cw->iov, CLIENT_WRITE_IOV, &cw->len);
+    cw->c = c;
+    elWriteInit(&cw->req, writeToClientDone, cw);
+    if (elAsyncWritev(Chat->el, &cw->req, c->fd, cw->iov, iovcnt) == EL_ERR) {
+        slabFree(&Chat->write_pool, cw);
+        freeClientAsync(c);
+        return;
+    }
+    c->write = cw;
+
+    /* The write itself tells us if the socket is full: there is no need
+     * to wait for it to be writable meanwhile. */
+    elDeleteFileEvent(Chat->el, c->fd, EL_WRITABLE);
+}
+
+/* Called when a write submitted by submitClientWrite() completes. */
+void writeToClientDone(struct eventLoop *el, struct elWrite *w, ssize_t res,
+                       void *privdata)
+{
+    (void)el; (void)w;
+    struct clientWrite *cw = privdata;
+    struct client *c = cw->c;
+
+    if (c == NULL) {
+        outq_free(&cw->orphan);
+        close(cw->fd);
+        slabFree(&Chat->write_pool, cw);
+        return;
+    }
+    c->write = NULL;
+    size_t len = cw->len;
+    slabFree(&Chat->write_pool, cw);
+
+    if (res == -EAGAIN || res == -EWOULDBLOCK) {
+        STAT_INC(Chat->stats.out.write_eagain);
+        res = 0;
+    } else if (res < 0) {
+        freeClientAsync(c);
+        return;
+    }
+    outq_advance(&c->outq, res);
+
+    /* The socket took it all: what was queued meanwhile goes with the
+     * writes of this iteration. Otherwise it is full, wait for it to be
+     * writable. */
+    if ((size_t)res == len && outq_len(&c->outq)) {
+        addClientPendingWrite(c);
+        checkClientOutputLimits(c);
+    } else {
+        afterClientWrite(c);
+    }
+}
+
+/* Like outq_write(), for the clients whose output is encrypted by the TLS
+ * library instead of the kernel. */
+ssize_t writeToTlsClient(struct client *c) {
+    struct iovec iov[CLIENT_WRITE_IOV];
+    ssize_t totwritten = 0;
+
+    while (outq_len(&c->outq)) {
+        size_t iovlen;
+        int iovcnt = outq_gather(&c->outq, iov, CLIENT_WRITE_IOV, &iovlen);
+
+        ssize_t nwritten = tlsWritev(c->tls, iov, iovcnt);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            STAT_INC(Chat->stats.out.writes);
+            if (errno == EAGAIN) {
+                STAT_INC(Chat->stats.out.write_eagain);
                 break;
             }
+            return -1;
         }
+        totwritten += nwritten;
+        outq_advance(&c->outq, nwritten);
+    }
+    return totwritten;
+}
+
+/* Write as much pending output as the socket accepts. */
+void writeToClient(struct client *c) {
+    if (c->flags & (CLIENT_CLOSE_ASAP|CLIENT_TLS_HANDSHAKE)) return;
 
-        if (j == -1) Chat->maxclient = -1; // We no longer have clients.
+    if (c->flags & CLIENT_TLS_WRITE) {
+        if (writeToTlsClient(c) == -1) {
+            freeClientAsync(c);
+            return;
+        }
+        afterClientWrite(c);
+        return;
+    }
+    if (elAsyncIO()) {
+        submitClientWrite(c);
+        return;
     }
+    if (outq_write(&c->outq, c->fd) == -1) {
+        freeClientAsync(c);
+        return;
+    }
+    afterClientWrite(c);
+}
 
-    free(c);
+/* Called by the event loop when the client socket can accept more data. */
+void writeToClientHandler(struct eventLoop *el, int fd, void *privdata,
+                          int mask)
+{
+    (void)el; (void)fd; (void)mask;
+    writeToClient(privdata);
 }
 
-/* Allocate and init the global stuff. */
-void initChat(void) {
-    Chat = chatMalloc(sizeof(*Chat));
-    memset(Chat,0,sizeof(*Chat));
+/* Make progress with the TLS handshake of the client. Once it is done the
+ * directions the kernel took over are handled like for a plaintext
+ * client: in particular, with the output encrypted by the kernel the
+ * shared messages are written to the socket as they are, by the same
+ * writev(2) (or io_uring) path. */
+void continueTlsHandshake(struct client *c) {
+    int res = tlsHandshake(c->tls);
 
-    /* No clients at startup, of course. */
-    Chat->maxclient = -1;
-    Chat->numclients = 0;
+    if (res == TLS_ERR) {
+        log_write(LL_VERBOSE, "TLS handshake failed with client fd=%d",
+                  c->fd);
+        STAT_INC(Chat->stats.tls_failures);
+        freeClientAsync(c);
+        return;
+    }
+    if (res == TLS_WANT_WRITE) {
+        if (!(elGetFileEvents(Chat->el, c->fd) & EL_WRITABLE) &&
+            elCreateFileEvent(Chat->el, c->fd, EL_WRITABLE,
+                              tlsHandshakeHandler, c) == EL_ERR)
+        {
+            freeClientAsync(c);
+        }
+        return;
+    }
+    elDeleteFileEvent(Chat->el, c->fd, EL_WRITABLE);
+    if (res == TLS_WANT_READ) return;
 
-    /* Create our listening socket, bound to the given port. This
-     * is where our clients will connect. */
-    Chat->serversock = createTCPServer(SERVER_PORT);
-    if (Chat->serversock == -1) {
-        perror("Creating listening socket");
-        exit(1);
+    c->flags &= ~CLIENT_TLS_HANDSHAKE;
+    STAT_INC(Chat->stats.tls_handshakes);
+    if (tlsKernelSend(c->tls)) {
+        c->flags &= ~CLIENT_TLS_WRITE;
+        STAT_INC(Chat->stats.tls_kernel_send);
+    }
+    if (tlsKernelRecv(c->tls)) {
+        c->flags &= ~CLIENT_TLS_READ;
+        /* Switch to the reads done by the backend, if any. */
+        if (elAsyncIO() && !(c->flags & CLIENT_NO_READS)) {
+            elDeleteFileEvent(Chat->el, c->fd, EL_READABLE);
+            if (watchClientReads(c) == EL_ERR) {
+                freeClientAsync(c);
+                return;
+            }
+        }
+    }
+    log_write(LL_VERBOSE, "TLS client fd=%d: %s, kernel send %s, recv %s",
+              c->fd, tlsDescription(c->tls),
+              c->flags & CLIENT_TLS_WRITE ? "no" : "yes",
+              c->flags & CLIENT_TLS_READ ? "no" : "yes");
+    if (!(c->flags & (CLIENT_TLS_READ|CLIENT_TLS_WRITE))) {
+        tlsFree(c->tls);
+        c->tls = NULL;
+    }
+
+    /* Flush the welcome message, and whatever was queued meanwhile. */
+    writeToClient(c);
+}
+
+/* Called by the event loop when the socket of a client in the middle of
+ * the TLS handshake becomes writable. */
+void tlsHandshakeHandler(struct eventLoop *el, int fd, void *privdata,
+                         int mask)
+{
+    (void)el; (void)fd; (void)mask;
+    struct client *c = privdata;
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+    continueTlsHandshake(c);
+}
+
+/* Put the client in the list of clients to flush at the end of the event
+ * loop iteration, if not already there. */
+void addClientPendingWrite(struct client *c) {
+    if (c->flags & CLIENT_PENDING_WRITE) return;
+    c->flags |= CLIENT_PENDING_WRITE;
+    c->pending_write_next = Chat->clients_pending_write;
+    Chat->clients_pending_write = c;
+}
+
+/* Return the message 'm' as the binary client 'c' gets it: a frame,
+ * compressed if the client agreed to it and the message is worth it. */
+struct sharedMsg *encodeReplyMsg(struct client *c, struct sharedMsg *m) {
+    if (c->codec == 0) return smsg_framed(m);
+
+    struct sharedMsg *z = smsg_compressed(m, c->codec,
+                                          Config.compress_min_size);
+    if (z != m->framed) STAT_INC(Chat->stats.zmsgs_out);
+    return z;
+}
+
+/* Queue the shared message 'm' to be sent to the client. The queue takes
+ * its own reference.
+ *
+ * If nothing else was pending we try to write it right away, so in the
+ * common case no writable event is ever needed. With --defer-flush the
+ * client is instead put in the list of clients to flush at the end of the
+ * event loop iteration: bursts of messages from many senders then reach
+ * each recipient with a single writev(2). */
+void addReplyMsg(struct client *c, struct sharedMsg *m) {
+    if (c->flags & CLIENT_CLOSE_ASAP) {
+        STAT_INC(Chat->stats.drops);
+        return;
+    }
+    if (c->flags & CLIENT_BINARY) m = encodeReplyMsg(c, m);
+    STAT_INC(Chat->stats.msgs_out);
+
+    if (!Config.defer_flush && outq_len(&c->outq) == 0 &&
+        !(c->flags & (CLIENT_TLS_HANDSHAKE|CLIENT_TLS_WRITE)))
+    {
+        /* Fast path: only what the socket does not accept is queued. */
+        if (outq_send(&c->outq, c->fd, m) == -1) {
+            freeClientAsync(c);
+            return;
+        }
+        afterClientWrite(c);
+        return;
+    }
+
+    int flush = !Config.defer_flush && outq_len(&c->outq) == 0;
+    outq_push(&c->outq, m);
+    if (flush) {
+        writeToClient(c);
+        return;
     }
+    if (Config.defer_flush) addClientPendingWrite(c);
+    checkClientOutputLimits(c);
 }
 
-/* Send the specified string to all connected clients but the one
- * having as socket descriptor 'excluded'. If you want to send something
- * to every client just set excluded to an impossible socket: -1. */
-void sendMsgToAllClientsBut(int excluded, char *s, size_t len) {
-    for (int j = 0; j <= Chat->maxclient; j++) {
-        if (Chat->clients[j] == NULL ||
-            Chat->clients[j]->fd == excluded) continue;
+/* Queue 'n' messages to be sent to the client at once. They are flushed
+ * together, gathered by a single writev(2), instead of costing a write(2)
+ * each like calling addReplyMsg() 'n' times would. */
+void addReplyMsgs(struct client *c, struct sharedMsg **msgs, int n) {
+    if (c->flags & CLIENT_CLOSE_ASAP) {
+        STAT_ADD(Chat->stats.drops, n);
+        return;
+    }
+    STAT_ADD(Chat->stats.msgs_out, n);
+
+    int flush = !Config.defer_flush && outq_len(&c->outq) == 0;
+    for (int j = 0; j < n; j++) {
+        struct sharedMsg *m = msgs[j];
+        if (c->flags & CLIENT_BINARY) m = encodeReplyMsg(c, m);
+        outq_push(&c->outq, m);
+    }
 
-        /* Important: we don't do ANY BUFFERING. We just use the kernel
-         * socket buffers. If the content does not fit, we don't care.
-         * This is needed in order to keep this program simple. */
-        write(Chat->clients[j]->fd,s,len);
+    if (flush) {
+        writeToClient(c);
+        return;
     }
+    if (Config.defer_flush) addClientPendingWrite(c);
+    checkClientOutputLimits(c);
 }
 
-/* The main() function implements the main chat logic:
- * 1. Accept new clients connections if any.
- * 2. Check if any client sent us some new message.
- * 3. Send the message to all the other clients. */
-int main(void) {
-    char tmpbuf[READBUF_SIZE];
-    char readbuf[READBUF_SIZE];
-    int readbuf_idx;
+/* Flush the clients that received output during this event loop
+ * iteration, when --defer-flush is enabled. */
+void handleClientsWithPendingWrites(void) {
+    while (Chat->clients_pending_write) {
+        struct client *c = Chat->clients_pending_write;
+        Chat->clients_pending_write = c->pending_write_next;
+        c->flags &= ~CLIENT_PENDING_WRITE;
 
-    /* Initialize the global Chat state. */
-    initChat();
+        /* If a writable handler is installed the socket buffer was full
+         * last time we tried: wait for the event loop to tell us. */
+        if (elGetFileEvents(Chat->el, c->fd) & EL_WRITABLE) continue;
+        writeToClient(c);
+    }
+}
 
-    while(1) {
-        fd_set readfds;
-        struct timeval tv;
-        int retval;
+/* Queue a copy of 's' to be sent to the client. */
+void addReply(struct client *c, const char *s, size_t len) {
+    struct sharedMsg *m = smsg_create(s, len);
+    addReplyMsg(c, m);
+    smsg_release(m);
+}
 
-        FD_ZERO(&readfds);
+/* Like addReply() for a null terminated string. */
+void addReplyString(struct client *c, const char *s) {
+    addReply(c, s, strlen(s));
+}
 
-        /* When we want to be notified by select() that there is
-         * activity? If the listening socket has pending clients to accept
-         * or if any other client wrote anything. */
-        FD_SET(Chat->serversock, &readfds);
-        for (int j = 0; j <= Chat->maxclient; j++) {
-            if (Chat->clients[j]) FD_SET(j, &readfds);
-        }
+/* Wake up worker 'w', unless a wakeup is already pending: a burst of
+ * messages costs a single write(2). */
+void wakeWorker(struct chatState *w) {
+    if (__atomic_exchange_n(&w->wakeup_pending, 1, __ATOMIC_ACQ_REL)) return;
 
-        /* Set a timeout for select(), see later why this may be useful
-         * in the future (not now). */
-        tv.tv_sec = 1; // 1 sec timeout
-        tv.tv_usec = 0;
+    uint64_t one = 1;
+    if (write(w->wakeup_fd[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+        log_write(LL_WARNING, "Waking up worker: %s", strerror(errno));
+}
 
-        /* Select wants as first argument the maximum file descriptor
-         * in use plus one. It can be either one of our clients or the
-         * server socket itself. */
-        int maxfd = Chat->maxclient;
-        if (maxfd < Chat->serversock) maxfd = Chat->serversock;
+/* Relay the message to all the other workers: they will send it to the
+ * members of 'room' they serve. The message itself is shared, every
+ * worker just takes a reference to it. */
+void sendMsgToOtherWorkers(const char *room, struct sharedMsg *m) {
+    size_t roomlen = strlen(room);
 
-        retval = select(maxfd+1, &readfds, NULL, NULL, &tv);
+    for (int j = 0; j < Server.numworkers; j++) {
+        struct chatState *w = Server.workers[j];
+        if (w == Chat) continue;
 
-        if (retval == -1) {
-            perror("select() error");
-            exit(1);
-        } else if (retval) {
-            /* If the listening socket is "readable", it actually means
-             * there are new clients connections pending to accept. */
-            if (FD_ISSET(Chat->serversock, &readfds)) {
-                int fd = acceptClient(Chat->serversock);
-                struct client *c = createClient(fd);
-                
-                /* Send a welcome message. */
-                char *welcome_msg =
-                    "Welcome to Simple Chat! "
-                    "Use /nick <nick> to set your nick.\n";
-                write(c->fd,welcome_msg,strlen(welcome_msg));
-
-                printf("Connected client fd=%d\n", fd);
-            }
+        struct workerMsg *wm = chatMalloc(sizeof(*wm)+roomlen+1);
+        wm->msg = smsg_retain(m);
+        wm->read_time = Chat->read_time;
+        wm->target_fd = -1;
+        memcpy(wm->room, room, roomlen+1);
+        mpsc_push(&w->inbox, &wm->node);
+        wakeWorker(w);
+        STAT_INC(Chat->stats.forwarded);
+    }
+}
 
-            /* Here for each connected client, check if there are pending
-             * data the client sent us. */
-            for (int j = 0; j <= Chat->maxclient; j++) {
-                /* Check if client actually exists. */
-                if (Chat->clients[j] == NULL) continue;
-
-                if (FD_ISSET(j, &readfds)) {
-                    /* Here we just hope that there is a well formed
-                     * message waiting for us. But it is entirely possible
-                     * that we read just half a message. In a normal program
-                     * that is not designed to be that simple, we should try
-                     * to buffer reads until the end-of-the-line (or another
-                     * message separator) is reached. */
-
-                    /* Remaining space in circular buffer, also taking into account 
-                     * the space for the final null char. */
-                    int count = circbuf_space_left(Chat->clients[j]->read_cb) - 1;
-
-                    /* Read data in a temp buffer and then push it in 
-                     * client circular buffer.*/
-                    int nread = read(j, tmpbuf, count);
-                    circbuf_push_from_linear(Chat->clients[j]->read_cb, tmpbuf, nread);
-                    tmpbuf[nread] = '\0';
-
-                    /* printf("Client fd=%d\n", j); */
-                    /* circbuf_print_data(Chat->clients[j]->read_cb); */
-
-                    if (nread <= 0) {
-                        /* Error or short read means that the socket
-                         * was closed. */
-                        printf("Disconnected client fd=%d, nick=%s\n",
-                            j, Chat->clients[j]->nick);
-                        freeClient(Chat->clients[j]);
-                    } else {
-                        /* Count the number of MSG_SEP occurrencies in tmpbuf */
-                        int sep_occur = 0;
-                        for (int i = 0; i < nread; i++) {
-                            if (tmpbuf[i] == MSG_SEP) sep_occur++;
-                        };
-
-                        /* Buffering reads until MSG_SEP is received or read_cb is 
-                         * full (taking into account the null-char space). */
-                        if (sep_occur > 0 || circbuf_space_left(Chat->clients[j]->read_cb) <= 1) {
-
-                            /* The client sent us a message. We need to
-                            * relay this message to all the other clients
-                            * in the chat. */
-                            struct client *c = Chat->clients[j];
-
-                            /* Process messages. 
-                             * Example (suppose 'A' is the separator):
-                             * "niceAtoAmeetAyou"
-                             * 
-                             * 'A' occurs 3 times, so we send 3 messages
-                             * niceA, toA, meetA
-                             * "you" is kept in circular buffer and is not sent.
-                             * 
-                             */
-
-                            /* If sep_occur is 0 and we are here, it means cb is full. 
-                             * So, set sep_occur to 1 to send the whole buffer once. */
-                            if (sep_occur == 0) sep_occur = 1;
-
-                            for (; sep_occur > 0; sep_occur--) {
-                                readbuf_idx = 0;
-                                do {
-                                    circbuf_pop(c->read_cb, &readbuf[readbuf_idx]);
-                                } while (readbuf[readbuf_idx++] != MSG_SEP);
-                                readbuf[readbuf_idx] = '\0';
-                                // printf("readbuf: %s\n", readbuf);
-
-                                /* If the user message starts with "/", we
-                                * process it as a client command. So far
-                                * only the /nick <newnick> command is implemented. */
-                                if (readbuf[0] == '/') {
-                                    /* Remove any trailing newline. */
-                                    char *p;
-                                    p = strchr(readbuf,'\r'); if (p) *p = 0;
-                                    p = strchr(readbuf,'\n'); if (p) *p = 0;
-                                    /* Check for an argument of the command, after
-                                    * the space. */
-                                    char *arg = strchr(readbuf,' ');
-                                    if (arg) {
-                                        *arg = 0; /* Terminate command name. */
-                                        arg++; /* Argument is 1 byte after the space. */
-                                    }
-
-                                    if (!strcmp(readbuf,"/nick") && arg) {
-                                        free(c->nick);
-                                        int nicklen = strlen(arg);
-                                        c->nick = chatMalloc(nicklen+1);
-                                        memcpy(c->nick,arg,nicklen+1);
-                                    } else {
-                                        /* Unsupported command. Send an error. */
-                                        char *errmsg = "Unsupported command\n";
-                                        write(c->fd,errmsg,strlen(errmsg));
-                                    }
-                                } else {
-                                    /* Create a message to send everybody (and show
-                                    * on the server console) in the form:
-                                    *   nick> some message. */
-                                    char msg[256];
-                                    int msglen = snprintf(msg, sizeof(msg),
-                                        "%s> %s", c->nick, readbuf);
-
-                                    /* snprintf() return value may be larger than
-                                    * sizeof(msg) in case there is no room for the
-                                    * whole output. */
-                                    if (msglen >= (int)sizeof(msg))
-                                        msglen = sizeof(msg)-1;
-                                    
-                                    printf("%s", msg);
-
-                                    /* Send it to all the other clients. */
-                                    sendMsgToAllClientsBut(j, msg, msglen);
-                                }
-                            }
-                        } else {
-                            /* Do nothing, keep buffering with the next read. */
-                        }
-                    }
-                }
-            }
+/* Persist the message, if --log-file is set. This only copies it into
+ * the log mapping: the disk is flushed by the log thread. */
+void logMsg(struct sharedMsg *m) {
+    if (Config.log_file == NULL) return;
+    if (msglog_append(&Server.log, m->buf, m->len) == -1)
+        log_write(LL_WARNING, "Appending to the message log: %s",
+                  strerror(errno));
+}
+
+/* Send the specified message to the members of room 'r' served by this
+ * worker, but the one having as socket descriptor 'excluded'. */
+void sendMsgToLocalRoomBut(struct room *r, int excluded,
+                           struct sharedMsg *m)
+{
+    for (int j = 0; j < r->nummembers; j++) {
+        if (r->members[j].c->fd == excluded) continue;
+        addReplyMsg(r->members[j].c,m);
+    }
+}
+
+/* Send the specified message to all the members of room 'r' but the one
+ * having as socket descriptor 'excluded'. The cost is proportional to
+ * the size of the room, not to the number of connected clients. Worker 0
+ * also forwards it to the other nodes of the cluster, for the messages
+ * of the other workers too, as they come through its inbox. */
+void sendMsgToRoomBut(struct room *r, int excluded, struct sharedMsg *m) {
+    logMsg(m);
+    sendMsgToLocalRoomBut(r, excluded, m);
+    if (Server.numworkers > 1) sendMsgToOtherWorkers(r->name, m);
+    if (Config.cluster_port && Chat->id == 0) clusterForward(r->name, m);
+}
+
+/* Send the specified message to the client called 'nick', that may be
+ * served by any worker. Returns 0 if there is no such client. */
+int sendMsgToNick(const char *nick, struct sharedMsg *m) {
+    pthread_mutex_lock(&Server.nicks_lock);
+    struct client *c = dict_find(&Server.nicks, nick);
+    struct chatState *w = c ? c->worker : NULL;
+    int fd = c ? c->fd : -1;
+    unsigned long long id = c ? c->id : 0;
+    pthread_mutex_unlock(&Server.nicks_lock);
+
+    if (c == NULL) return 0;
+    if (w == Chat) {
+        /* Our own client: it can't go away while we use it. */
+        addReplyMsg(c, m);
+        return 1;
+    }
+
+    /* The client may disconnect before the worker serving it gets the
+     * message: the id tells if the descriptor still belongs to it. */
+    struct workerMsg *wm = chatMalloc(sizeof(*wm)+1);
+    wm->msg = smsg_retain(m);
+    wm->read_time = Chat->read_time;
+    wm->target_fd = fd;
+    wm->target_id = id;
+    wm->room[0] = '\0';
+    mpsc_push(&w->inbox, &wm->node);
+    wakeWorker(w);
+    STAT_INC(Chat->stats.forwarded);
+    return 1;
+}
+
+/* Called by the event loop when another worker woke us up: fan-out the
+ * messages in our inbox. */
+void workerWakeupHandler(struct eventLoop *el, int fd, void *privdata,
+                         int mask)
+{
+    (void)el; (void)privdata; (void)mask;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    /* Clear the flag before draining the inbox: a message pushed after
+     * the last pop we do will trigger a new wakeup. */
+    __atomic_store_n(&Chat->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+
+    struct mpscNode *n;
+    while ((n = mpsc_pop(&Chat->inbox)) != NULL) {
+        struct workerMsg *wm = (struct workerMsg *)n;
+        if (wm->msg == NULL) {
+            updateClusterRoom(wm->room);
+            free(wm);
+            continue;
+        }
+        if (wm->target_fd != -1) {
+            struct client *c = lookupClientByFd(wm->target_fd);
+            if (c && c->id == wm->target_id) addReplyMsg(c, wm->msg);
         } else {
-            /* Timeout occurred. We don't do anything right now, but in
-             * general this section can be used to wakeup periodically
-             * even if there is no clients activity. */
+            struct room *r = lookupRoom(wm->room);
+            if (r) sendMsgToLocalRoomBut(r, -1, wm->msg);
+            if (Config.cluster_port && Chat->id == 0)
+                clusterForward(wm->room, wm->msg);
         }
+        STAT_INC(Chat->stats.inbox);
+        hist_add(&Chat->stats.forward_latency, ustime() - wm->read_time);
+        smsg_release(wm->msg);
+        free(wm);
     }
+}
 
-    return 0;
-}
\ No newline at end of file
+/* The only limit to the number of clients is the number of descriptors
+ * we can open: raise the soft limit as much as the hard limit allows. */
+void adjustOpenFilesLimit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return;
+    if (limit.rlim_cur == limit.rlim_max) return;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        perror("Raising the open files limit"); // Not fatal.
+}
+
+/* Create the wakeup channel of the worker. */
+void createWakeupChannel(struct chatState *w) {
+#ifdef __linux__
+    w->wakeup_fd[0] = w->wakeup_fd[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (w->wakeup_fd[0] != -1) return;
+#endif
+    if (pipe(w->wakeup_fd) == -1) {
+        perror("Creating wakeup channel");
+        exit(1);
+    }
+    for (int j = 0; j < 2; j++) {
+        fcntl(w->wakeup_fd[j], F_SETFL, O_NONBLOCK);
+        fcntl(w->wakeup_fd[j], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/* Create the listening socket of the worker 'id'. With multiple workers
+ * every one has its own socket, created with SO_REUSEPORT, so that the
+ * kernel balances the connections among them. Where this is not
+ * supported all the workers share the same socket. */
+int createWorkerListener(int id) {
+    int s;
+
+    if (Handoff.numlisteners)
+        return Handoff.listeners[id % Handoff.numlisteners];
+    if (Server.numworkers == 1)
+        return createTCPServer(Config.port, 0);
+    if (Server.shared_listener != -1)
+        return Server.shared_listener;
+
+    s = createTCPServer(Config.port, 1);
+    if (s == -1 && id == 0) {
+        perror("SO_REUSEPORT listener, workers will share one socket");
+        s = createTCPServer(Config.port, 0);
+        Server.shared_listener = s;
+    }
+    return s;
+}
+
+/* Allocate and init the state of the worker 'id'. */
+struct chatState *createWorker(int id) {
+    struct chatState *w = chatMalloc(sizeof(*w));
+    memset(w,0,sizeof(*w));
+    w->id = id;
+
+    /* No clients at startup, of course. */
+    w->numclients = 0;
+    w->clients_size = CLIENTS_TABLE_INITIAL;
+    w->clients = chatMalloc(sizeof(struct client*)*w->clients_size);
+    w->clients_by_fd_size = CLIENTS_TABLE_INITIAL;
+    w->clients_by_fd = chatMalloc(sizeof(struct client*)*
+                                  w->clients_by_fd_size);
+    memset(w->clients_by_fd, 0,
+           sizeof(struct client*)*w->clients_by_fd_size);
+    w->clients_to_close = NULL;
+
+    /* Clients come from a pool, every object including the storage of a
+     * read buffer of the initial size. */
+    w->readbuf_inline = 1;
+    while (w->readbuf_inline < Config.readbuf_initial)
+        w->readbuf_inline <<= 1;
+    slabInit(&w->client_pool,
+             sizeof(struct client)+w->readbuf_inline, CLIENTS_PER_SLAB);
+    slabInit(&w->write_pool, sizeof(struct clientWrite), WRITES_PER_SLAB);
+
+    /* The welcome message is the same for everybody: create it once. */
+    char *welcome_msg =
+        "Welcome to Simple Chat! "
+        "Use /nick <nick> to set your nick.\n";
+    w->welcome_msg = smsg_create(welcome_msg, strlen(welcome_msg));
+    dict_init(&w->rooms);
+
+    /* Create the event loop. It starts small and grows with the
+     * highest file descriptor registered. */
+    w->el = elCreateEventLoop(EL_DEFAULT_SETSIZE);
+    if (w->el == NULL) {
+        perror("Creating event loop");
+        exit(1);
+    }
+
+    /* Create our listening socket, bound to the given port. This
+     * is where our clients will connect. It is non blocking: with a
+     * shared socket another worker may accept the client first. */
+    w->serversock = createWorkerListener(id);
+    w->accept_tokens = Config.max_accept_rate*1000000;
+    w->accept_refill_time = ustime();
+    w->accept_paused = 0;
+    elTimerInit(&w->accept_timer, acceptTimerProc, NULL);
+    if (w->serversock == -1) {
+        perror("Creating listening socket");
+        exit(1);
+    }
+    socketSetNonBlockNoDelay(w->serversock);
+    if (watchListener(w) == EL_ERR) {
+        perror("Registering listening socket");
+        exit(1);
+    }
+
+    /* Other workers send us messages through the inbox. */
+    mpsc_init(&w->inbox);
+    createWakeupChannel(w);
+    if (elCreateFileEvent(w->el, w->wakeup_fd[0], EL_READABLE,
+                          workerWakeupHandler, NULL) == EL_ERR)
+    {
+        perror("Registering wakeup channel");
+        exit(1);
+    }
+
+    elTimerInit(&w->memory_timer, memoryTimerProc, NULL);
+    elAddTimer(w->el, &w->memory_timer, 0);
+    return w;
+}
+
+/* Allocate and init the global stuff. */
+void initServer(void) {
+    /* Writing to a socket closed by the peer must return an error we
+     * handle, not kill the server. */
+    signal(SIGPIPE, SIG_IGN);
+    adjustOpenFilesLimit();
+
+    /* When the event loop backend does the I/O for us, output is always
+     * flushed at the end of the iteration: the writes to all the clients
+     * are then submitted together. */
+    if (elAsyncIO()) Config.defer_flush = 1;
+
+    Server.numworkers = Config.threads;
+    Server.shared_listener = -1;
+    Server.next_client_id = 0;
+    dict_init(&Server.nicks);
+    pthread_mutex_init(&Server.nicks_lock, NULL);
+    dict_init(&Server.history);
+    pthread_mutex_init(&Server.history_lock, NULL);
+    Server.handoff_fd = -1;
+    pthread_mutex_init(&Server.handoff_lock, NULL);
+    pthread_cond_init(&Server.handoff_cond, NULL);
+    initCommandTable();
+    if (Config.tls_cert && tlsInit(Config.tls_cert, Config.tls_key) == -1)
+        exit(1);
+    if (Config.handoff_socket) takeOver();
+
+    if (Config.log_file &&
+        msglog_open(&Server.log, Config.log_file, Config.log_segment_size,
+                    Config.log_sync_ms) == -1)
+    {
+        perror("Opening the message log");
+        exit(1);
+    }
+    Server.workers = chatMalloc(sizeof(struct chatState*)*Server.numworkers);
+    for (int j = 0; j < Server.numworkers; j++)
+        Server.workers[j] = createWorker(j);
+    if (Config.metrics_port) {
+        createMetricsListener(Server.workers[0]);
+        startMallocSampler();
+    }
+    if (Config.cluster_port) initCluster(Server.workers[0]);
+
+    /* Listening sockets handed off and left over, if the old process had
+     * more workers. */
+    for (int j = Server.numworkers; j < Handoff.numlisteners; j++)
+        close(Handoff.listeners[j]);
+    restoreHandoffClients();
+    if (Config.handoff_socket) createHandoffListener(Server.workers[0]);
+}
+
+/* Refill the accept token bucket with the connections allowed by the
+ * time elapsed since the last refill. The bucket holds at most one
+ * second worth of connections, that is the largest burst we accept. */
+void refillAcceptTokens(void) {
+    long long now = ustime();
+    long long max = Config.max_accept_rate*1000000;
+
+    Chat->accept_tokens += (now-Chat->accept_refill_time)*
+                           Config.max_accept_rate;
+    if (Chat->accept_tokens > max) Chat->accept_tokens = max;
+    Chat->accept_refill_time = now;
+}
+
+/* Take a token from the bucket to accept a connection. Returns 0 if the
+ * accept rate limit was reached. */
+int takeAcceptToken(void) {
+    if (Config.max_accept_rate == 0) return 1;
+    if (Chat->accept_tokens < 1000000) refillAcceptTokens();
+    if (Chat->accept_tokens < 1000000) return 0;
+    Chat->accept_tokens -= 1000000;
+    return 1;
+}
+
+/* Milliseconds until the bucket has a token. */
+long long acceptTokenWait(void) {
+    long long missing = 1000000-Chat->accept_tokens;
+    if (missing <= 0) return 0;
+    long long us = (missing+Config.max_accept_rate-1)/Config.max_accept_rate;
+    return (us+999)/1000;
+}
+
+/* Start (or resume) accepting connections on the listening socket of the
+ * worker. With backends doing the I/O for us the connections are accepted
+ * on our behalf and handed to acceptAsyncHandler(), otherwise
+ * acceptHandler() accepts them when the socket is readable. */
+int watchListener(struct chatState *w) {
+    if (elAsyncIO())
+        return elAsyncAccept(w->el, w->serversock, acceptAsyncHandler, NULL);
+    return elCreateFileEvent(w->el, w->serversock, EL_READABLE,
+                             acceptHandler, NULL);
+}
+
+/* Stop polling the listening socket for 'ms' milliseconds: with
+ * connections still pending it would be reported ready at every iteration
+ * of the event loop. The backlog is left to the kernel until the bucket
+ * has a token again, or until a client closing frees a descriptor. */
+void pauseAccepts(long long ms) {
+    if (elAsyncIO())
+        elAsyncStop(Chat->el, Chat->serversock);
+    else
+        elDeleteFileEvent(Chat->el, Chat->serversock, EL_READABLE);
+    Chat->accept_paused = 1;
+    elAddTimer(Chat->el, &Chat->accept_timer, ms);
+}
+
+/* Register the listening socket again, once the bucket has tokens for
+ * at least one connection. */
+void acceptTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+
+    if (Config.max_accept_rate) {
+        refillAcceptTokens();
+        if (Chat->accept_tokens < 1000000) {
+            elAddTimer(el, t, acceptTokenWait());
+            return;
+        }
+    }
+    if (watchListener(Chat) == EL_ERR) {
+        perror("Registering listening socket");
+        exit(1);
+    }
+    Chat->accept_paused = 0;
+}
+
+/* Start serving the client just accepted on 'cfd'. */
+void serveNewClient(int cfd) {
+    struct tlsConn *tls = NULL;
+    if (Config.tls_cert && (tls = tlsAccept(cfd)) == NULL) {
+        log_write(LL_WARNING, "Creating the TLS session of fd=%d", cfd);
+        close(cfd);
+        return;
+    }
+
+    struct client *c = createClient(cfd, tls);
+    if (c == NULL) return;
+    STAT_INC(Chat->stats.connections);
+
+    /* Send a welcome message. */
+    addReplyMsg(c,Chat->welcome_msg);
+
+    log_write(LL_VERBOSE, "Connected client fd=%d", cfd);
+}
+
+/* Called by the event loop when the listening socket is "readable", that
+ * actually means there are new clients connections pending to accept.
+ * During a reconnection storm taking a single connection per iteration
+ * would overflow the backlog, so we drain it, up to a budget that
+ * leaves some time to the clients already connected. */
+void acceptHandler(struct eventLoop *el, int fd, void *privdata, int mask) {
+    (void)el; (void)privdata; (void)mask;
+
+    for (long long j = 0; j < Config.max_accepts_per_call; j++) {
+        if (!takeAcceptToken()) {
+            pauseAccepts(acceptTokenWait());
+            return;
+        }
+
+        int cfd = acceptClient(fd);
+        STAT_INC(Chat->stats.accepts);
+        if (cfd == -1) {
+            /* Give the token back, no connection was accepted. */
+            if (Config.max_accept_rate) Chat->accept_tokens += 1000000;
+            if (errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                STAT_INC(Chat->stats.accept_eagain);
+                return;
+            }
+            log_write(LL_WARNING, "Accepting client connection: %s",
+                      strerror(errno));
+            if (errno == EMFILE || errno == ENFILE)
+                pauseAccepts(ACCEPT_BACKOFF_MS);
+            return;
+        }
+        serveNewClient(cfd);
+    }
+}
+
+/* Called with every connection accepted on our behalf by the event loop
+ * backend, see watchListener(). The accept rate is limited like in
+ * acceptHandler(), but what the kernel already accepted is served. */
+void acceptAsyncHandler(struct eventLoop *el, int fd, int res, void *privdata)
+{
+    (void)el; (void)fd; (void)privdata;
+
+    STAT_INC(Chat->stats.accepts);
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EWOULDBLOCK)
+            STAT_INC(Chat->stats.accept_eagain);
+        else if (res != -ECONNABORTED)
+            log_write(LL_WARNING, "Accepting client connection: %s",
+                      strerror(-res));
+        if ((res == -EMFILE || res == -ENFILE) && !Chat->accept_paused)
+            pauseAccepts(ACCEPT_BACKOFF_MS);
+        return;
+    }
+    socketSetNoDelay(res);
+    if (!Chat->accept_paused && !takeAcceptToken())
+        pauseAccepts(acceptTokenWait());
+    serveNewClient(res);
+}
+
+/* Room names and nicks are short words of printable characters. */
+int validName(const char *name, size_t maxlen) {
+    size_t len = strlen(name);
+
+    if (len == 0 || len > maxlen) return 0;
+    for (size_t j = 0; j < len; j++)
+        if ((unsigned char)name[j] <= ' ' || name[j] == 127) return 0;
+    return 1;
+}
+
+/* ================================== Cluster ===================================
+ * Several servers can form a cluster, so that a room can have more users
+ * than a single process can serve. Every node keeps a link with every
+ * other node, and tells them the rooms it has members in: the messages
+ * of a room are only forwarded to the nodes having members there, and a
+ * node never forwards again what it got from another one.
+ *
+ * The links are served by worker 0, that gets the messages of the other
+ * workers through its inbox anyway, and carry binary frames (see
+ * frame.h). The frames queued during an event loop iteration are written
+ * at its end by a single writev(2) per link: a burst of messages costs
+ * one system call, and no message ever waits for a timer. The nodes also
+ * tell each other the addresses of the nodes they know, so a new node
+ * only needs the address of one of them to join the cluster.
+ *
+ * The links are not authenticated: whoever links with a node can send
+ * messages to all its users. Either --cluster-allow lists the addresses
+ * of the nodes, or the --cluster-port must be firewalled. What a peer
+ * sends is checked like what clients send anyway: the messages are no
+ * longer than a client could make them, and have no separators inside.
+ * =========================================================================== */
+
+void peerReadHandler(struct eventLoop *el, int fd, void *privdata, int mask);
+void peerWriteHandler(struct eventLoop *el, int fd, void *privdata,
+                      int mask);
+
+/* Split "host:port" (or "[host]:port" for IPv6). Returns 0 on success,
+ * -1 if the address is invalid. */
+int splitNodeAddr(const char *addr, char *host, size_t hostlen, int *port) {
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL || strlen(addr) >= CLUSTER_ADDR_LEN) return -1;
+
+    char *endptr;
+    long p = strtol(colon+1, &endptr, 10);
+    if (colon[1] == '\0' || *endptr != '\0' || p < 1 || p > 65535)
+        return -1;
+
+    size_t len = colon-addr;
+    if (len >= 2 && addr[0] == '[' && addr[len-1] == ']') {
+        addr++;
+        len -= 2;
+    }
+    if (len == 0 || len >= hostlen) return -1;
+    memcpy(host, addr, len);
+    host[len] = '\0';
+    *port = p;
+    return 0;
+}
+
+/* Return the node with address 'addr', or NULL. Clusters have a few
+ * nodes: a scan is fine. */
+struct clusterNode *lookupClusterNode(const char *addr) {
+    for (int j = 0; j < Cluster.numnodes; j++)
+        if (!strcmp(Cluster.nodes[j].addr, addr)) return &Cluster.nodes[j];
+    return NULL;
+}
+
+/* Return the node with address 'addr', adding it if it is new. */
+struct clusterNode *addClusterNode(const char *addr) {
+    struct clusterNode *n = lookupClusterNode(addr);
+    if (n) return n;
+
+    if (Cluster.numnodes == Cluster.nodes_size) {
+        Cluster.nodes_size = Cluster.nodes_size ? Cluster.nodes_size*2 : 4;
+        Cluster.nodes = chatRealloc(Cluster.nodes,
+            sizeof(struct clusterNode)*Cluster.nodes_size);
+    }
+    n = &Cluster.nodes[Cluster.numnodes++];
+    snprintf(n->addr, sizeof(n->addr), "%s", addr);
+    n->id = 0;
+    n->self = 0;
+    return n;
+}
+
+/* Return true if we have a link with the node, or are creating one. */
+int clusterNodeLinked(struct clusterNode *n) {
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *p = Cluster.peers[j];
+        if (p->closing) continue;
+        if (!strcmp(p->addr, n->addr)) return 1;
+
+        /* The same node may be known by more than one address. */
+        if (n->id && p->id == n->id && p->state == PEER_READY) return 1;
+    }
+    return 0;
+}
+
+/* Create a frame of type 'type', with the concatenation of the 'alen'
+ * bytes at 'a' and the 'blen' bytes at 'b' as payload. */
+struct sharedMsg *createPeerFrame(int type, const void *a, size_t alen,
+                                  const void *b, size_t blen)
+{
+    unsigned char hdr[FRAME_MAX_HEADER];
+    int hdrlen = frame_encode_header(hdr, alen+blen, type);
+    struct sharedMsg *f = smsg_alloc(hdrlen+alen+blen);
+
+    memcpy(f->buf, hdr, hdrlen);
+    memcpy(f->buf+hdrlen, a, alen);
+    if (blen) memcpy(f->buf+hdrlen+alen, b, blen);
+    return f;
+}
+
+/* Close the link at the end of the event loop iteration: until then the
+ * peer may still be referenced by the code that called us. */
+void closePeer(struct clusterPeer *p, const char *reason) {
+    if (p->closing) return;
+
+    log_write(p->state == PEER_READY ? LL_VERBOSE : LL_DEBUG,
+              "Link with node %s closed: %s",
+              p->addr[0] ? p->addr : "(unknown)", reason);
+    elDeleteFileEvent(Chat->el, p->fd, EL_READABLE|EL_WRITABLE);
+    if (p->state == PEER_READY) STAT_ADD(Chat->stats.peer_links, -1);
+    p->closing = 1;
+}
+
+/* Queue the frame 'f' to the peer. It is written at the end of the event
+ * loop iteration together with the other frames queued meanwhile. A node
+ * not keeping up with us is dropped at the output hard limit, like a
+ * client: it will link again, and tell us its rooms again. */
+void sendPeerFrame(struct clusterPeer *p, struct sharedMsg *f) {
+    if (p->closing) return;
+    outq_push(&p->outq, f);
+    p->pending_write = 1;
+    if (outq_len(&p->outq) >= (size_t)Config.outbuf_hard_limit)
+        closePeer(p, "output hard limit reached");
+}
+
+/* Create a frame and queue it to the peer. */
+void addPeerFrame(struct clusterPeer *p, int type, const void *a,
+                  size_t alen, const void *b, size_t blen)
+{
+    struct sharedMsg *f = createPeerFrame(type, a, alen, b, blen);
+    sendPeerFrame(p, f);
+    smsg_release(f);
+}
+
+/* Queue the frame to every peer ready but 'excluded'. */
+void broadcastPeerFrame(struct clusterPeer *excluded, struct sharedMsg *f) {
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *p = Cluster.peers[j];
+        if (p != excluded && p->state == PEER_READY) sendPeerFrame(p, f);
+    }
+}
+
+/* Write the pending frames of the peer. Whatever the socket does not
+ * accept now is written when it becomes writable. */
+void writeToPeer(struct clusterPeer *p) {
+    p->pending_write = 0;
+    if (p->state == PEER_CONNECTING) return; /* Flushed once connected. */
+
+    if (outq_write(&p->outq, p->fd) == -1) {
+        closePeer(p, strerror(errno));
+        return;
+    }
+    int writable = elGetFileEvents(Chat->el, p->fd) & EL_WRITABLE;
+    if (outq_len(&p->outq) && !writable) {
+        if (elCreateFileEvent(Chat->el, p->fd, EL_WRITABLE,
+                              peerWriteHandler, p) == EL_ERR)
+            closePeer(p, "can't watch the socket");
+    } else if (outq_len(&p->outq) == 0 && writable) {
+        elDeleteFileEvent(Chat->el, p->fd, EL_WRITABLE);
+    }
+}
+
+/* Create a link on the connected socket 'fd', and send our HELLO. */
+struct clusterPeer *createPeer(int fd, int outbound) {
+    struct clusterPeer *p = chatMalloc(sizeof(*p));
+    memset(p,0,sizeof(*p));
+    p->fd = fd;
+    p->outbound = outbound;
+    p->state = outbound ? PEER_CONNECTING : PEER_HANDSHAKE;
+    outq_init(&p->outq, &Chat->stats.peer_out);
+    dict_init(&p->rooms);
+
+    if (Cluster.numpeers == Cluster.peers_size) {
+        Cluster.peers_size = Cluster.peers_size ? Cluster.peers_size*2 : 4;
+        Cluster.peers = chatRealloc(Cluster.peers,
+            sizeof(struct clusterPeer*)*Cluster.peers_size);
+    }
+    Cluster.peers[Cluster.numpeers++] = p;
+
+    unsigned char hello[11];
+    for (int j = 0; j < 8; j++) hello[j] = Cluster.id >> (56-8*j);
+    hello[8] = Config.cluster_port >> 8;
+    hello[9] = Config.cluster_port & 0xff;
+    hello[10] = codec_available();
+    addPeerFrame(p, FRAME_PEER_HELLO, hello, sizeof(hello), NULL, 0);
+
+    int mask = outbound ? EL_WRITABLE : EL_READABLE;
+    elFileProc *proc = outbound ? peerWriteHandler : peerReadHandler;
+    if (elCreateFileEvent(Chat->el, fd, mask, proc, p) == EL_ERR)
+        closePeer(p, "can't watch the socket");
+    return p;
+}
+
+/* Release a link closed by closePeer(). */
+void freePeer(struct clusterPeer *p) {
+    close(p->fd);
+    free(p->rbuf);
+    outq_free(&p->outq);
+    dict_free(&p->rooms);
+    free(p);
+}
+
+/* Start linking with the node 'n'. The connection completes in the
+ * background. */
+void connectToNode(struct clusterNode *n) {
+    char host[CLUSTER_ADDR_LEN];
+    int port;
+
+    if (splitNodeAddr(n->addr, host, sizeof(host), &port) == -1) return;
+    int fd = TCPConnect(host, port, 1);
+    if (fd == -1) {
+        log_write(LL_DEBUG, "Connecting to node %s: %s", n->addr,
+                  strerror(errno));
+        return;
+    }
+    struct clusterPeer *p = createPeer(fd, 1);
+    snprintf(p->addr, sizeof(p->addr), "%s", n->addr);
+}
+
+/* Link with the nodes we know and have no link with, again and again. */
+void clusterTimerProc(struct eventLoop *el, struct elTimer *t,
+                      void *privdata)
+{
+    (void)privdata;
+    for (int j = 0; j < Cluster.numnodes; j++) {
+        struct clusterNode *n = &Cluster.nodes[j];
+        if (!n->self && !clusterNodeLinked(n)) connectToNode(n);
+    }
+    elAddTimer(el, t, CLUSTER_RECONNECT_MS);
+}
+
+/* Link with the nodes in the space separated list of addresses of a
+ * NODES frame, as far as we don't know them already. */
+void processPeerNodes(const unsigned char *buf, size_t len) {
+    size_t j = 0;
+
+    while (j < len) {
+        size_t start = j;
+        while (j < len && buf[j] != ' ') j++;
+
+        char addr[CLUSTER_ADDR_LEN], host[CLUSTER_ADDR_LEN];
+        int port;
+        if (j-start < sizeof(addr)) {
+            memcpy(addr, buf+start, j-start);
+            addr[j-start] = '\0';
+            if (splitNodeAddr(addr, host, sizeof(host), &port) == 0 &&
+                lookupClusterNode(addr) == NULL)
+            {
+                struct clusterNode *n = addClusterNode(addr);
+                if (!clusterNodeLinked(n)) connectToNode(n);
+            }
+        }
+        j++;
+    }
+}
+
+/* Set the address of a node that linked with us: the one we see it
+ * connecting from, with the port it told us. */
+void setPeerAddr(struct clusterPeer *p, int port) {
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    char host[CLUSTER_ADDR_LEN];
+
+    if (getpeername(p->fd, (struct sockaddr*)&sa, &salen) == -1 ||
+        getnameinfo((struct sockaddr*)&sa, salen, host, sizeof(host),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+        return;
+    snprintf(p->addr, sizeof(p->addr), strchr(host, ':') ? "[%s]:%d" :
+             "%s:%d", host, port);
+}
+
+/* The node told us its id, port and codecs: the link is ready, unless
+ * it duplicates another one. Then we tell it our rooms, and the nodes we
+ * know, while the other nodes learn about it. */
+void processPeerHello(struct clusterPeer *p, const unsigned char *buf,
+                      size_t len)
+{
+    uint64_t id = 0;
+    for (int j = 0; j < 8; j++) id = (id << 8) | buf[j];
+    int port = (buf[8] << 8) | buf[9];
+    int codecs = len > 10 ? buf[10] & codec_available() : 0;
+    p->codec = codecs & CODEC_DEFLATE;
+
+    if (id == Cluster.id) {
+        struct clusterNode *n = lookupClusterNode(p->addr);
+        if (n) n->self = 1;
+        closePeer(p, "it is this node");
+        return;
+    }
+    p->id = id;
+    if (!p->outbound && port) setPeerAddr(p, port);
+    if (p->addr[0]) addClusterNode(p->addr)->id = id;
+
+    /* Two nodes connecting to each other at the same time end up with
+     * two links: both keep the one created by the node with the lowest
+     * id, that they both know. */
+    uint64_t creator = p->outbound ? Cluster.id : id;
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *q = Cluster.peers[j];
+        if (q == p || q->closing || q->state != PEER_READY || q->id != id)
+            continue;
+        uint64_t q_creator = q->outbound ? Cluster.id : id;
+        if (creator > q_creator) {
+            closePeer(p, "duplicate link");
+            return;
+        }
+        closePeer(q, "duplicate link");
+    }
+
+    p->state = PEER_READY;
+    STAT_INC(Chat->stats.peer_links);
+    log_write(LL_VERBOSE, "Linked with node %s", p->addr);
+
+    struct dictIterator it;
+    struct dictEntry *de;
+    dict_iter_init(&it, &Cluster.rooms);
+    while ((de = dict_next(&it)) != NULL)
+        addPeerFrame(p, FRAME_PEER_SUB, de->key, strlen(de->key), NULL, 0);
+
+    char nodes[CLUSTER_ADDR_LEN*16];
+    size_t nodeslen = 0;
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *q = Cluster.peers[j];
+        if (q == p || q->state != PEER_READY || q->addr[0] == '\0')
+            continue;
+        size_t addrlen = strlen(q->addr);
+        if (nodeslen+addrlen+1 > sizeof(nodes)) {
+            addPeerFrame(p, FRAME_PEER_NODES, nodes, nodeslen-1, NULL, 0);
+            nodeslen = 0;
+        }
+        memcpy(nodes+nodeslen, q->addr, addrlen);
+        nodes[nodeslen+addrlen] = ' ';
+        nodeslen += addrlen+1;
+    }
+    if (nodeslen) addPeerFrame(p, FRAME_PEER_NODES, nodes, nodeslen-1, NULL, 0);
+
+    if (p->addr[0]) {
+        struct sharedMsg *f = createPeerFrame(FRAME_PEER_NODES, p->addr,
+                                              strlen(p->addr), NULL, 0);
+        broadcastPeerFrame(p, f);
+        smsg_release(f);
+    }
+}
+
+/* Longest message, separator excluded, a client of a node can send with
+ * our --max-line-length: the text, the nick and the room prefix. */
+size_t maxPeerMsgLength(void) {
+    return Config.max_line_length + MAX_NICK_LENGTH+2 + MAX_ROOM_NAME+3;
+}
+
+/* Create the message of a FRAME_PEER_MSG frame from the 'len' bytes of
+ * the message it carries, its trailing separator included. Returns NULL
+ * if the message is invalid. */
+struct sharedMsg *createPeerMsg(const unsigned char *buf, size_t len) {
+    if (len == 0 || buf[len-1] != MSG_SEP || len-1 > maxPeerMsgLength())
+        return NULL;
+
+    struct sharedMsg *m = smsg_create((const char *)buf, len);
+    sanitizeFrameText(m->buf, len-1);
+    return m;
+}
+
+/* Create the message of a FRAME_PEER_ZMSG frame from the 'len' bytes of
+ * the FRAME_ZMSG payload it carries. The compressed frame is kept with
+ * the message, ready for our binary clients: it is never compressed
+ * again, unless separators had to be replaced in the text. Returns NULL
+ * if the payload is invalid. */
+struct sharedMsg *inflatePeerMsg(struct clusterPeer *p,
+                                 const unsigned char *buf, size_t len)
+{
+    size_t textlen;
+    int n = frame_decode_varint(buf,
+        len > FRAME_MAX_VARINT ? FRAME_MAX_VARINT : len, &textlen);
+    if (p->codec == 0 || n <= 0 || textlen > maxPeerMsgLength())
+        return NULL;
+
+    struct sharedMsg *m = smsg_alloc(textlen+1);
+    if (codec_decompress(p->codec, (const char *)buf+n, len-n, m->buf,
+                         textlen) == -1)
+    {
+        smsg_release(m);
+        return NULL;
+    }
+    m->buf[textlen] = MSG_SEP;
+    if (memchr(m->buf, MSG_SEP, textlen)) {
+        sanitizeFrameText(m->buf, textlen);
+        return m;
+    }
+
+    unsigned char hdr[FRAME_MAX_HEADER];
+    int hdrlen = frame_encode_header(hdr, len, FRAME_ZMSG);
+    m->compressed = smsg_alloc(hdrlen+len);
+    memcpy(m->compressed->buf, hdr, hdrlen);
+    memcpy(m->compressed->buf+hdrlen, buf, len);
+    return m;
+}
+
+/* Deliver a message another node got from its clients to the members of
+ * 'room' of every worker, releasing it. */
+void deliverPeerMsg(const char *room, struct sharedMsg *m) {
+    if (Config.history_size) {
+        /* The room may have no members here: the global lock keeps the
+         * history alive while we use it. */
+        pthread_mutex_lock(&Server.history_lock);
+        struct roomHistory *h = dict_find(&Server.history, room);
+        if (h) {
+            pthread_mutex_lock(&h->lock);
+            msgring_push(&h->ring, m);
+            pthread_mutex_unlock(&h->lock);
+        }
+        pthread_mutex_unlock(&Server.history_lock);
+    }
+    logMsg(m);
+    struct room *r = lookupRoom(room);
+    if (r) sendMsgToLocalRoomBut(r, -1, m);
+    if (Server.numworkers > 1) sendMsgToOtherWorkers(room, m);
+    smsg_release(m);
+    STAT_INC(Chat->stats.peer_msgs_in);
+}
+
+/* Copy a room name of 'len' bytes to 'name', that has room for
+ * MAX_ROOM_NAME+1. Returns 0 if it is not a valid room name. */
+int copyRoomName(char *name, const unsigned char *buf, size_t len) {
+    if (len > MAX_ROOM_NAME) return 0;
+    memcpy(name, buf, len);
+    name[len] = '\0';
+    return strlen(name) == len && validName(name, MAX_ROOM_NAME);
+}
+
+/* Process a frame of 'len' bytes of payload got from the peer. Frame
+ * types we don't know are skipped: they come from newer nodes. */
+void processPeerFrame(struct clusterPeer *p, int type,
+                      const unsigned char *buf, size_t len)
+{
+    char room[MAX_ROOM_NAME+1];
+    struct sharedMsg *m = NULL;
+
+    if ((p->state == PEER_READY) == (type == FRAME_PEER_HELLO)) {
+        closePeer(p, "protocol error");
+        return;
+    }
+    switch(type) {
+    case FRAME_PEER_HELLO:
+        if (len < 10) closePeer(p, "protocol error");
+        else processPeerHello(p, buf, len);
+        break;
+    case FRAME_PEER_SUB:
+    case FRAME_PEER_UNSUB:
+        if (!copyRoomName(room, buf, len)) {
+            closePeer(p, "invalid room name");
+        } else if (type == FRAME_PEER_SUB) {
+            dict_add(&p->rooms, room, p);
+        } else {
+            dict_delete(&p->rooms, room);
+        }
+        break;
+    case FRAME_PEER_MSG:
+    case FRAME_PEER_ZMSG:
+        if (len == 0 || buf[0] >= len || !copyRoomName(room, buf+1, buf[0])) {
+            closePeer(p, "invalid message");
+            break;
+        }
+        const unsigned char *msg = buf+1+buf[0];
+        size_t msglen = len-1-buf[0];
+        if (type == FRAME_PEER_MSG)
+            m = createPeerMsg(msg, msglen);
+        else
+            m = inflatePeerMsg(p, msg, msglen);
+        if (m == NULL) closePeer(p, "invalid message");
+        if (m) deliverPeerMsg(room, m);
+        break;
+    case FRAME_PEER_NODES:
+        processPeerNodes(buf, len);
+        break;
+    }
+}
+
+/* Called by the event loop when the link has data for us: read it, and
+ * process the complete frames. */
+void peerReadHandler(struct eventLoop *el, int fd, void *privdata, int mask)
+{
+    (void)el; (void)mask;
+    struct clusterPeer *p = privdata;
+
+    if (p->rsize-p->rlen < CLUSTER_READ_SIZE) {
+        p->rsize = p->rlen+CLUSTER_READ_SIZE;
+        p->rbuf = chatRealloc(p->rbuf, p->rsize);
+    }
+    ssize_t nread = read(fd, p->rbuf+p->rlen, p->rsize-p->rlen);
+    if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (nread <= 0) {
+        closePeer(p, nread == 0 ? "connection closed" : strerror(errno));
+        return;
+    }
+    p->rlen += nread;
+    Chat->read_time = ustime();
+
+    size_t pos = 0;
+    while (!p->closing) {
+        size_t len;
+        int type;
+        size_t avail = p->rlen-pos;
+        int hdrlen = frame_decode_header(p->rbuf+pos,
+            avail > FRAME_MAX_HEADER ? FRAME_MAX_HEADER : avail, &len, &type);
+        if (hdrlen == -1 || (hdrlen > 0 && len > CLUSTER_MAX_FRAME)) {
+            closePeer(p, "invalid frame");
+            break;
+        }
+        if (hdrlen == 0 || avail-hdrlen < len) {
+            /* Make room for the rest of the frame at once. */
+            if (hdrlen && pos+hdrlen+len > p->rsize) {
+                p->rsize = pos+hdrlen+len;
+                p->rbuf = chatRealloc(p->rbuf, p->rsize);
+            }
+            break;
+        }
+        processPeerFrame(p, type, p->rbuf+pos+hdrlen, len);
+        pos += hdrlen+len;
+    }
+    memmove(p->rbuf, p->rbuf+pos, p->rlen-pos);
+    p->rlen -= pos;
+}
+
+/* Called by the event loop when the link can take more output, or when
+ * our connection completed. */
+void peerWriteHandler(struct eventLoop *el, int fd, void *privdata,
+                      int mask)
+{
+    (void)mask;
+    struct clusterPeer *p = privdata;
+
+    if (p->state == PEER_CONNECTING) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+            err = errno;
+        if (err) {
+            closePeer(p, strerror(err));
+            return;
+        }
+        p->state = PEER_HANDSHAKE;
+        if (elCreateFileEvent(el, fd, EL_READABLE, peerReadHandler,
+                              p) == EL_ERR)
+        {
+            closePeer(p, "can't watch the socket");
+            return;
+        }
+    }
+    writeToPeer(p);
+}
+
+/* Return 1 if the other end of the link 'fd' is listed by
+ * --cluster-allow, or if there is no such list. */
+int peerAllowed(int fd) {
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    char host[CLUSTER_ADDR_LEN];
+
+    if (Config.cluster_allow == NULL) return 1;
+    if (getpeername(fd, (struct sockaddr*)&sa, &salen) == -1 ||
+        getnameinfo((struct sockaddr*)&sa, salen, host, sizeof(host),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+        return 0;
+
+    /* IPv4 peers of a dual stack socket. */
+    const char *addr = host;
+    if (!strncmp(addr, "::ffff:", 7) && strchr(addr, '.')) addr += 7;
+
+    size_t addrlen = strlen(addr);
+    const char *s = Config.cluster_allow;
+    while (*s) {
+        size_t len = strcspn(s, ",");
+        if (len == addrlen && !memcmp(s, addr, len)) return 1;
+        s += len;
+        if (*s) s++;
+    }
+    return 0;
+}
+
+/* Accept the links of the other nodes. */
+void peerAcceptHandler(struct eventLoop *el, int fd, void *privdata,
+                       int mask)
+{
+    (void)el; (void)privdata; (void)mask;
+    int cfd;
+
+    while ((cfd = acceptClient(fd)) != -1) {
+        if (!peerAllowed(cfd)) {
+            log_write(LL_VERBOSE, "Refused a link not in --cluster-allow");
+            close(cfd);
+            continue;
+        }
+        createPeer(cfd, 0);
+    }
+}
+
+/* Create the frame forwarding the message 'm' sent to 'room'. With a
+ * codec, the compressed frame of the message is used if it is worth it:
+ * the same one our binary clients get, so that the message is only
+ * compressed once, and the other node uses it for its clients too. */
+struct sharedMsg *createPeerMsgFrame(const char *room, struct sharedMsg *m,
+                                     int codec)
+{
+    unsigned char hdr[MAX_ROOM_NAME+1];
+    hdr[0] = strlen(room);
+    memcpy(hdr+1, room, hdr[0]);
+
+    if (codec) {
+        struct sharedMsg *z = smsg_compressed(m, codec,
+                                              Config.compress_min_size);
+        size_t len;
+        int type;
+        int zhdrlen = frame_decode_header((unsigned char *)z->buf,
+            z->len > FRAME_MAX_HEADER ? FRAME_MAX_HEADER : z->len,
+            &len, &type);
+        if (zhdrlen > 0 && type == FRAME_ZMSG)
+            return createPeerFrame(FRAME_PEER_ZMSG, hdr, hdr[0]+1,
+                                   z->buf+zhdrlen, len);
+    }
+    return createPeerFrame(FRAME_PEER_MSG, hdr, hdr[0]+1, m->buf, m->len);
+}
+
+/* Forward the message 'm', sent to 'room' by one of our clients, to the
+ * nodes having members there. The frame is created once (once per codec
+ * used), and shared by the output queues of all the links. */
+void clusterForward(const char *room, struct sharedMsg *m) {
+    struct sharedMsg *f = NULL, *zf = NULL;
+
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *p = Cluster.peers[j];
+        if (p->state != PEER_READY || p->closing ||
+            !dict_find(&p->rooms, room)) continue;
+        struct sharedMsg **frame = p->codec ? &zf : &f;
+        if (*frame == NULL) *frame = createPeerMsgFrame(room, m, p->codec);
+        sendPeerFrame(p, *frame);
+        STAT_INC(Chat->stats.peer_msgs_out);
+    }
+    if (f) smsg_release(f);
+    if (zf) smsg_release(zf);
+}
+
+/* Tell the other nodes if room 'name' got its first member, or lost the
+ * last one, in any worker. Rooms change in all the workers, but only
+ * worker 0 talks to the cluster: the others tell it through its inbox.
+ * Notifications may then arrive after the room changed again, that's why
+ * updateClusterRoom() compares the room as it is now with what the
+ * other nodes know. */
+void notifyRoomChange(const char *name) {
+    if (Config.cluster_port == 0) return;
+    if (Chat->id == 0) {
+        updateClusterRoom(name);
+        return;
+    }
+
+    struct chatState *w = Server.workers[0];
+    size_t namelen = strlen(name);
+    struct workerMsg *wm = chatMalloc(sizeof(*wm)+namelen+1);
+    wm->msg = NULL;
+    memcpy(wm->room, name, namelen+1);
+    mpsc_push(&w->inbox, &wm->node);
+    wakeWorker(w);
+}
+
+/* Send a SUB or UNSUB of room 'name' to the peers, if the room got its
+ * first member or lost the last one since they were last told. */
+void updateClusterRoom(const char *name) {
+    pthread_mutex_lock(&Server.history_lock);
+    int members = dict_find(&Server.history, name) != NULL;
+    pthread_mutex_unlock(&Server.history_lock);
+
+    int announced = dict_find(&Cluster.rooms, name) != NULL;
+    if (members == announced) return;
+    if (members) dict_add(&Cluster.rooms, name, &Cluster);
+    else dict_delete(&Cluster.rooms, name);
+
+    struct sharedMsg *f = createPeerFrame(
+        members ? FRAME_PEER_SUB : FRAME_PEER_UNSUB, name, strlen(name),
+        NULL, 0);
+    broadcastPeerFrame(NULL, f);
+    smsg_release(f);
+}
+
+/* Flush the frames queued to the links during this event loop iteration,
+ * and release the links closed meanwhile. Called by worker 0 at the end
+ * of every iteration. */
+void handleClusterPeers(void) {
+    for (int j = 0; j < Cluster.numpeers; j++) {
+        struct clusterPeer *p = Cluster.peers[j];
+        if (p->pending_write && !p->closing) writeToPeer(p);
+        if (p->closing) {
+            freePeer(p);
+            Cluster.peers[j--] = Cluster.peers[--Cluster.numpeers];
+        }
+    }
+}
+
+/* Return a random node id, never 0. */
+uint64_t randomNodeId(void) {
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd != -1) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+        close(fd);
+    }
+    if (id == 0) id = ((uint64_t)getpid() << 32) ^ ustime();
+    return id ? id : 1;
+}
+
+/* Join the cluster, from the event loop of 'w': accept the other nodes
+ * on --cluster-port, and link with the nodes of --cluster-peers. */
+void initCluster(struct chatState *w) {
+    Cluster.id = randomNodeId();
+    dict_init(&Cluster.rooms);
+
+    Cluster.listener = createTCPServer(Config.cluster_port, 0);
+    if (Cluster.listener == -1) {
+        perror("Creating the cluster listening socket");
+        exit(1);
+    }
+    socketSetNonBlockNoDelay(Cluster.listener);
+    if (elCreateFileEvent(w->el, Cluster.listener, EL_READABLE,
+                          peerAcceptHandler, NULL) == EL_ERR)
+    {
+        perror("Registering the cluster listening socket");
+        exit(1);
+    }
+
+    const char *s = Config.cluster_peers ? Config.cluster_peers : "";
+    while (*s) {
+        size_t len = strcspn(s, ",");
+        char addr[CLUSTER_ADDR_LEN], host[CLUSTER_ADDR_LEN];
+        int port;
+        if (len >= sizeof(addr)) len = sizeof(addr)-1;
+        memcpy(addr, s, len);
+        addr[len] = '\0';
+        if (splitNodeAddr(addr, host, sizeof(host), &port) == -1) {
+            fprintf(stderr, "Invalid cluster peer address: %s\n", addr);
+            exit(1);
+        }
+        addClusterNode(addr);
+        s += strcspn(s, ",");
+        if (*s) s++;
+    }
+
+    /* Connecting needs the worker running: the first attempt is made by
+     * the timer, as soon as the event loop starts. */
+    elTimerInit(&Cluster.timer, clusterTimerProc, NULL);
+    elAddTimer(w->el, &Cluster.timer, 0);
+}
+
+/* ================================ Hot restart =================================
+ * A new process started with the same --handoff-socket takes the place of
+ * the running one without dropping anybody: the old process stops its
+ * workers, then passes its listening sockets and the socket of every
+ * client (SCM_RIGHTS) over the UNIX socket, with the state of the clients
+ * that lives in user space: nick, rooms, the input not yet parsed, and
+ * the output not yet written. Then it exits, and the new process resumes
+ * the clients where the old one left them. Room histories and cluster
+ * links are not handed off: the links are established again by the new
+ * process, like after any restart of a node.
+ *
+ * The protocol is a sequence of SOCK_SEQPACKET messages, each starting
+ * with its HANDOFF_* type, and ends with HANDOFF_END. Both processes run
+ * on the same host, usually are the same binary, so the struct is sent
+ * as it is in memory.
+ * =========================================================================== */
+
+/* Send the message of type 'type' with 'len' bytes of payload, and 'fd'
+ * unless it is -1. Returns -1 on error. */
+int handoffSend(int s, int type, const void *payload, size_t len, int fd) {
+    char buf[1+HANDOFF_CHUNK];
+
+    buf[0] = type;
+    if (len) memcpy(buf+1, payload, len);
+    return sendWithFd(s, buf, 1+len, fd) == -1 ? -1 : 0;
+}
+
+/* Append 'len' bytes to the HANDOFF_INPUT or HANDOFF_OUTPUT messages
+ * built in 'm', sending them as they fill up. Returns -1 on error. */
+int handoffAppend(int s, struct handoffMsg *m, const char *p, size_t len) {
+    while (len) {
+        size_t n = HANDOFF_CHUNK - m->len;
+        if (n > len) n = len;
+        memcpy(m->buf+1+m->len, p, n);
+        m->len += n;
+        p += n;
+        len -= n;
+        if (m->len == HANDOFF_CHUNK) {
+            if (sendWithFd(s, m->buf, 1+m->len, -1) == -1) return -1;
+            m->len = 0;
+        }
+    }
+    return 0;
+}
+
+/* Send what is left in 'm', see handoffAppend(). */
+int handoffFlush(int s, struct handoffMsg *m) {
+    if (m->len && sendWithFd(s, m->buf, 1+m->len, -1) == -1) return -1;
+    m->len = 0;
+    return 0;
+}
+
+/* Send the client 'c' to the new process. */
+int handOffClient(int s, struct client *c, struct handoffMsg *m) {
+    struct handoffClient hc;
+    char state[sizeof(hc)+MAX_NICK_LENGTH+1+
+               MAX_ROOMS_PER_CLIENT*(MAX_ROOM_NAME+1)];
+    size_t len = sizeof(hc), nicklen = strlen(c->nick);
+
+    memset(&hc, 0, sizeof(hc));
+    hc.worker = Chat->id;
+    hc.binary = (c->flags & CLIENT_BINARY) != 0;
+    hc.discard_line = (c->flags & CLIENT_DISCARD_LINE) != 0;
+    hc.codec = c->codec;
+    hc.numrooms = c->numrooms;
+    hc.discard = c->discard;
+    memcpy(state, &hc, sizeof(hc));
+    if (nicklen > MAX_NICK_LENGTH) nicklen = 0; /* Can't happen. */
+    memcpy(state+len, c->nick, nicklen);
+    len += nicklen;
+    state[len++] = '\0';
+    for (int j = 0; j <= c->numrooms; j++) {
+        /* The current room goes last, so that it is the one the new
+         * process joins last. */
+        struct room *r;
+        if (j < c->numrooms) {
+            r = c->rooms[j].room;
+            if (r == c->room) continue;
+        } else {
+            if ((r = c->room) == NULL) break;
+        }
+        size_t namelen = strlen(r->name);
+        memcpy(state+len, r->name, namelen+1);
+        len += namelen+1;
+    }
+    if (handoffSend(s, HANDOFF_CLIENT, state, len, c->fd) == -1) return -1;
+
+    struct iovec iov[2];
+    int iovcnt = circbuf_read_iov(&c->read_cb, iov);
+    m->buf[0] = HANDOFF_INPUT;
+    for (int j = 0; j < iovcnt; j++) {
+        if (handoffAppend(s, m, iov[j].iov_base, iov[j].iov_len) == -1)
+            return -1;
+    }
+    if (handoffFlush(s, m) == -1) return -1;
+
+    size_t sentpos = c->outq.sentpos;
+    m->buf[0] = HANDOFF_OUTPUT;
+    for (struct outNode *n = c->outq.head; n; n = n->next) {
+        if (handoffAppend(s, m, n->msg->buf+sentpos,
+                          n->msg->len-sentpos) == -1) return -1;
+        sentpos = 0;
+    }
+    return handoffFlush(s, m);
+}
+
+/* Stop reading from the clients and accepting new ones (see
+ * watchClientReads()), then wait for the writes that are in flight with
+ * the backends doing the I/O for us: what the new process gets must be
+ * all there is. */
+void quiesceWorker(void) {
+    Chat->stopped = 1;
+    for (int j = 0; j < Chat->numclients; j++) {
+        struct client *c = Chat->clients[j];
+        if (!(c->flags & CLIENT_NO_READS)) unwatchClientReads(c);
+    }
+    if (elAsyncIO())
+        elAsyncStop(Chat->el, Chat->serversock);
+    else
+        elDeleteFileEvent(Chat->el, Chat->serversock, EL_READABLE);
+
+    /* What the backend already received is still delivered meanwhile. */
+    long long deadline = mstime()+HANDOFF_DRAIN_MS;
+    while (elAsyncIO()) {
+        struct timeval tv = {0, 10000};
+        elProcessEvents(Chat->el, &tv);
+        handleClientsWithPendingWrites();
+        freeClientsInAsyncFreeQueue();
+        if (Chat->write_pool.used == 0 || mstime() > deadline) break;
+    }
+    elDelTimer(Chat->el, &Chat->accept_timer);
+}
+
+/* Undo quiesceWorker(), when the hot restart failed. */
+void resumeWorker(void) {
+    Chat->stopped = 0;
+    for (int j = 0; j < Chat->numclients; j++) {
+        struct client *c = Chat->clients[j];
+        if (c->flags & (CLIENT_NO_READS|CLIENT_CLOSE_ASAP)) continue;
+        if (watchClientReads(c) == EL_ERR) freeClientAsync(c);
+    }
+    if (watchListener(Chat) == EL_ERR) {
+        perror("Registering listening socket");
+        exit(1);
+    }
+    Chat->accept_paused = 0;
+}
+
+/* Called by every worker but 0 when a hot restart starts: stop, and wait
+ * for worker 0 to hand everything off. If it fails, resume serving. */
+void waitHandoff(void) {
+    quiesceWorker();
+    pthread_mutex_lock(&Server.handoff_lock);
+    unsigned long long gen = Server.handoff_gen;
+    Server.handoff_stopped++;
+    pthread_cond_broadcast(&Server.handoff_cond);
+    while (Server.handoff_gen == gen)
+        pthread_cond_wait(&Server.handoff_cond, &Server.handoff_lock);
+    pthread_mutex_unlock(&Server.handoff_lock);
+    resumeWorker();
+}
+
+/* Called by worker 0 when a new process connected to the hot restart
+ * socket: once all the workers stopped, send it everything and exit. */
+void handOff(void) {
+    int s = Server.handoff_fd;
+    struct handoffMsg *m = chatMalloc(sizeof(*m));
+    m->len = 0;
+    int sent = 0, skipped = 0, err = 0;
+
+    log_write(LL_NOTICE, "Hot restart: handing off to the new process");
+    quiesceWorker();
+    pthread_mutex_lock(&Server.handoff_lock);
+    while (Server.handoff_stopped < Server.numworkers-1)
+        pthread_cond_wait(&Server.handoff_cond, &Server.handoff_lock);
+    pthread_mutex_unlock(&Server.handoff_lock);
+
+    /* We are alone now: deliver the messages the workers sent to each
+     * other meanwhile, they end up in the output queues. */
+    for (int j = 0; j < Server.numworkers; j++) {
+        Chat = Server.workers[j];
+        workerWakeupHandler(Chat->el, Chat->wakeup_fd[0], NULL, 0);
+    }
+
+    for (int j = 0; j < Server.numworkers && !err; j++) {
+        struct chatState *w = Server.workers[j];
+        if (j && w->serversock == Server.workers[0]->serversock) continue;
+        err = handoffSend(s, HANDOFF_LISTENER, NULL, 0, w->serversock);
+    }
+    for (int j = 0; j < Server.numworkers && !err; j++) {
+        Chat = Server.workers[j];
+        for (int k = 0; k < Chat->numclients && !err; k++) {
+            struct client *c = Chat->clients[k];
+            /* Sessions still needing the TLS library can't be moved, as
+             * writes that did not complete in time: those clients will
+             * connect again. */
+            if (c->tls || c->write || (c->flags & CLIENT_CLOSE_ASAP)) {
+                skipped++;
+                continue;
+            }
+            err = handOffClient(s, c, m);
+            sent++;
+        }
+    }
+    Chat = Server.workers[0];
+    if (!err) err = handoffSend(s, HANDOFF_END, NULL, 0, -1);
+    free(m);
+
+    if (!err) {
+        log_write(LL_NOTICE, "Hot restart: %d clients handed off, %d "
+                  "disconnected, exiting", sent, skipped);
+        if (Config.log_file) msglog_sync(&Server.log);
+        log_flush();
+        exit(0);
+    }
+
+    log_write(LL_WARNING, "Hot restart failed (%s): resuming",
+              strerror(errno));
+    close(s);
+    pthread_mutex_lock(&Server.handoff_lock);
+    Server.handoff_fd = -1;
+    Server.handoff_stopped = 0;
+    Server.handoff_gen++;
+    pthread_cond_broadcast(&Server.handoff_cond);
+    pthread_mutex_unlock(&Server.handoff_lock);
+    resumeWorker();
+}
+
+/* Called by the event loop of worker 0 when a new process connects to
+ * the hot restart socket. The work is done by handOff(), at the end of
+ * the event loop iteration, after waking up the other workers so that
+ * they all stop. */
+void handoffAcceptHandler(struct eventLoop *el, int fd, void *privdata,
+                          int mask)
+{
+    (void)el; (void)privdata; (void)mask;
+    int s = accept(fd, NULL, NULL);
+
+    if (s == -1) return;
+    if (Server.handoff_fd != -1) {
+        close(s);
+        return;
+    }
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    __atomic_store_n(&Server.handoff_fd, s, __ATOMIC_SEQ_CST);
+    for (int j = 1; j < Server.numworkers; j++)
+        wakeWorker(Server.workers[j]);
+}
+
+/* Append 'len' bytes at 'p' to the buffer '*buf' of '*buflen' bytes. */
+void handoffGrow(char **buf, size_t *buflen, const char *p, size_t len) {
+    *buf = chatRealloc(*buf, *buflen+len);
+    memcpy(*buf+*buflen, p, len);
+    *buflen += len;
+}
+
+/* Take over the sockets and the clients of the process listening at
+ * --handoff-socket, if any, and wait for it to exit. Called at startup,
+ * before binding anything. The clients are created later, by
+ * restoreHandoffClients(), when the workers exist. */
+void takeOver(void) {
+    int s = unixConnect(Config.handoff_socket);
+    if (s == -1) {
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            log_write(LL_WARNING, "Hot restart socket %s: %s",
+                      Config.handoff_socket, strerror(errno));
+        return;
+    }
+
+    char *buf = chatMalloc(1+HANDOFF_CHUNK);
+    struct handoffRestore *last = NULL;
+    int done = 0;
+    while (!done) {
+        int fd;
+        ssize_t len = recvWithFd(s, buf, 1+HANDOFF_CHUNK, &fd);
+        if (len <= 0) {
+            fprintf(stderr, "Hot restart: the old process went away\n");
+            exit(1);
+        }
+
+        switch(buf[0]) {
+        case HANDOFF_LISTENER:
+            if (fd == -1) break;
+            Handoff.listeners = chatRealloc(Handoff.listeners,
+                sizeof(int)*(Handoff.numlisteners+1));
+            Handoff.listeners[Handoff.numlisteners++] = fd;
+            fd = -1;
+            break;
+        case HANDOFF_CLIENT:
+            if (fd == -1 || (size_t)len < 1+sizeof(struct handoffClient)) {
+                last = NULL;
+                break;
+            }
+            if (Handoff.numclients == Handoff.clients_size) {
+                Handoff.clients_size = Handoff.clients_size ?
+                                       Handoff.clients_size*2 : 64;
+                Handoff.clients = chatRealloc(Handoff.clients,
+                    sizeof(*Handoff.clients)*Handoff.clients_size);
+            }
+            last = &Handoff.clients[Handoff.numclients++];
+            memset(last, 0, sizeof(*last));
+            last->fd = fd;
+            handoffGrow(&last->state, &last->statelen, buf+1, len-1);
+            fd = -1;
+            break;
+        case HANDOFF_INPUT:
+            if (last) handoffGrow(&last->input, &last->inputlen, buf+1, len-1);
+            break;
+        case HANDOFF_OUTPUT:
+            if (last)
+                handoffGrow(&last->output, &last->outputlen, buf+1, len-1);
+            break;
+        case HANDOFF_END:
+            done = 1;
+            break;
+        }
+        if (fd != -1) close(fd);
+    }
+    free(buf);
+
+    /* Ports and files are ours once the old process is gone. */
+    char c;
+    int fd;
+    while (recvWithFd(s, &c, 1, &fd) > 0) {
+        if (fd != -1) close(fd);
+    }
+    close(s);
+    log_write(LL_NOTICE, "Hot restart: took over %d listening sockets "
+              "and %d clients", Handoff.numlisteners, Handoff.numclients);
+}
+
+/* Create the client handed off in 'hr', in the current worker. The nick
+ * and the rooms must be null terminated within the state we got: a
+ * malformed state frees the client, that would be half restored. */
+void restoreHandoffClient(struct handoffRestore *hr) {
+    struct handoffClient hc;
+    memcpy(&hc, hr->state, sizeof(hc));
+
+    struct client *c = createClient(hr->fd, NULL);
+    if (c == NULL) return;
+    if (hc.binary) c->flags |= CLIENT_BINARY;
+    if (hc.discard_line) c->flags |= CLIENT_DISCARD_LINE;
+    c->codec = hc.codec & codec_available();
+    c->discard = hc.discard;
+
+    char *p = hr->state+sizeof(hc), *end = hr->state+hr->statelen;
+    char *nick = p;
+    p = memchr(p, '\0', end-p);
+    if (p == NULL) {
+        log_write(LL_WARNING, "Hot restart: malformed client state");
+        freeClientAsync(c);
+        return;
+    }
+    /* Default nicks follow the descriptor, that changed. */
+    if (nick[0] && strncmp(nick, DEFAULT_NICK_PREFIX,
+                           strlen(DEFAULT_NICK_PREFIX)))
+    {
+        setClientNick(c, nick);
+    }
+
+    /* createClient() joined the default room: leave it, so that the
+     * rooms handed off, the default one included if it is one of them,
+     * get all the MAX_ROOMS_PER_CLIENT slots, the current one last. */
+    partRoom(c, lookupRoom(DEFAULT_ROOM));
+    for (p++; p < end; p++) {
+        char *name = p;
+        if ((p = memchr(p, '\0', end-p)) == NULL) {
+            log_write(LL_WARNING, "Hot restart: malformed client state");
+            freeClientAsync(c);
+            return;
+        }
+        joinRoom(c, name);
+    }
+
+    if (hr->inputlen) {
+        if ((size_t)circbuf_space_left(&c->read_cb) < hr->inputlen &&
+            !growClientReadBuffer(c, hr->inputlen+1))
+        {
+            freeClientAsync(c);
+            return;
+        }
+        circbuf_push_from_linear(&c->read_cb, hr->input, hr->inputlen);
+        /* It may hold complete messages the old process had no time to
+         * process. */
+        scheduleClientInput(c);
+    }
+    if (hr->outputlen) {
+        struct sharedMsg *m = smsg_create(hr->output, hr->outputlen);
+        outq_push(&c->outq, m);
+        smsg_release(m);
+        writeToClient(c);
+    }
+}
+
+/* Create the clients got by takeOver(), in the worker of the same number
+ * they had, if any. */
+void restoreHandoffClients(void) {
+    for (int j = 0; j < Handoff.numclients; j++) {
+        struct handoffRestore *hr = &Handoff.clients[j];
+        struct handoffClient hc;
+
+        memcpy(&hc, hr->state, sizeof(hc));
+        Chat = Server.workers[hc.worker % Server.numworkers];
+        restoreHandoffClient(hr);
+        free(hr->state);
+        free(hr->input);
+        free(hr->output);
+    }
+    for (int j = 0; j < Server.numworkers; j++) {
+        Chat = Server.workers[j];
+        freeClientsInAsyncFreeQueue();
+    }
+    Chat = NULL;
+    free(Handoff.clients);
+    Handoff.clients = NULL;
+    Handoff.numclients = Handoff.clients_size = 0;
+}
+
+/* Listen at --handoff-socket for the next process. */
+void createHandoffListener(struct chatState *w) {
+    int s = createUnixServer(Config.handoff_socket);
+    if (s == -1 ||
+        elCreateFileEvent(w->el, s, EL_READABLE, handoffAcceptHandler,
+                          NULL) == EL_ERR)
+    {
+        perror("Creating the hot restart socket");
+        exit(1);
+    }
+}
+
+/* ================================== Metrics ===================================
+ * The counters of all the workers, rendered in the Prometheus text format
+ * for the --metrics-port listener. Rendering only reads the counters, so
+ * it never takes a lock or slows down the workers updating them.
+ * =========================================================================== */
+
+#define METRICS_LATENCY_BUCKETS 27 /* Powers of two, up to about a minute. */
+
+/* A growing text buffer. */
+struct metricsBuf {
+    char *buf;
+    size_t len, size;
+};
+
+void metricsAppend(struct metricsBuf *b, const char *fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->buf+b->len, b->size-b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < b->size-b->len) {
+            b->len += n;
+            return;
+        }
+        b->size = (b->size+n)*2;
+        b->buf = chatRealloc(b->buf, b->size);
+    }
+}
+
+/* The counters of struct workerStats, rendered for every worker. */
+struct workerMetric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+    int is_signed;
+} WorkerMetrics[] = {
+    {"smallchat_connections_total", "counter", "Clients accepted",
+     offsetof(struct workerStats, connections), 0},
+    {"smallchat_disconnections_total", "counter", "Clients disconnected",
+     offsetof(struct workerStats, disconnections), 0},
+    {"smallchat_accept_calls_total", "counter", "accept(2) calls",
+     offsetof(struct workerStats, accepts), 0},
+    {"smallchat_accept_eagain_total", "counter",
+     "accept(2) calls that found no pending connection",
+     offsetof(struct workerStats, accept_eagain), 0},
+    {"smallchat_read_calls_total", "counter", "Reads from client sockets",
+     offsetof(struct workerStats, reads), 0},
+    {"smallchat_read_bytes_total", "counter", "Bytes read from clients",
+     offsetof(struct workerStats, bytes_in), 0},
+    {"smallchat_messages_in_total", "counter", "Chat messages received",
+     offsetof(struct workerStats, msgs_in), 0},
+    {"smallchat_commands_total", "counter", "Commands received",
+     offsetof(struct workerStats, commands), 0},
+    {"smallchat_messages_out_total", "counter", "Messages queued to clients",
+     offsetof(struct workerStats, msgs_out), 0},
+    {"smallchat_compressed_messages_out_total", "counter",
+     "Messages queued to clients as compressed frames",
+     offsetof(struct workerStats, zmsgs_out), 0},
+    {"smallchat_messages_dropped_total", "counter",
+     "Messages not queued because the recipient was disconnecting",
+     offsetof(struct workerStats, drops), 0},
+    {"smallchat_hard_limit_disconnections_total", "counter",
+     "Clients disconnected for reaching the output hard limit",
+     offsetof(struct workerStats, hard_limit_kills), 0},
+    {"smallchat_input_deferred_total", "counter",
+     "Client turns ended by the fairness budgets with input left",
+     offsetof(struct workerStats, input_deferred), 0},
+    {"smallchat_throttled_total", "counter",
+     "Client turns ended by the per client rate limits",
+     offsetof(struct workerStats, throttled), 0},
+    {"smallchat_forwarded_total", "counter",
+     "Messages handed to other workers",
+     offsetof(struct workerStats, forwarded), 0},
+    {"smallchat_inbox_total", "counter", "Messages got from other workers",
+     offsetof(struct workerStats, inbox), 0},
+    {"smallchat_tls_handshakes_total", "counter",
+     "TLS handshakes completed",
+     offsetof(struct workerStats, tls_handshakes), 0},
+    {"smallchat_tls_kernel_send_total", "counter",
+     "TLS clients whose output is encrypted by the kernel (kTLS)",
+     offsetof(struct workerStats, tls_kernel_send), 0},
+    {"smallchat_tls_handshake_failures_total", "counter",
+     "TLS handshakes failed",
+     offsetof(struct workerStats, tls_failures), 0},
+    {"smallchat_cluster_messages_out_total", "counter",
+     "Messages forwarded to other nodes of the cluster",
+     offsetof(struct workerStats, peer_msgs_out), 0},
+    {"smallchat_cluster_messages_in_total", "counter",
+     "Messages got from other nodes of the cluster",
+     offsetof(struct workerStats, peer_msgs_in), 0},
+    {"smallchat_cluster_links", "gauge", "Links with other nodes ready",
+     offsetof(struct workerStats, peer_links), 1},
+    {"smallchat_cluster_write_bytes_total", "counter",
+     "Bytes written to the other nodes",
+     offsetof(struct workerStats, peer_out.bytes), 0},
+    {"smallchat_write_calls_total", "counter", "Writes to client sockets",
+     offsetof(struct workerStats, out.writes), 0},
+    {"smallchat_write_eagain_total", "counter",
+     "Writes that found the socket buffer full",
+     offsetof(struct workerStats, out.write_eagain), 0},
+    {"smallchat_write_bytes_total", "counter", "Bytes written to clients",
+     offsetof(struct workerStats, out.bytes), 0},
+    {"smallchat_output_queued_bytes", "gauge",
+     "Bytes waiting in the output queues",
+     offsetof(struct workerStats, out.queued), 1},
+    {NULL, NULL, NULL, 0, 0}
+};
+
+/* Heap memory owned by the client, besides its object in the pool. */
+size_t clientHeapMemory(struct client *c) {
+    size_t bytes = c->rooms_size*sizeof(struct clientRoom);
+
+    if (c->read_cb.buf != c->read_cb.storage)
+        bytes += circbuf_size(&c->read_cb);
+    if (c->nick != c->nickbuf) bytes += strlen(c->nick)+1;
+    if (c->write) bytes += sizeof(struct clientWrite);
+    return bytes;
+}
+
+/* Publish in the stats the memory used by the clients of this worker,
+ * by state. Walking the clients once a second costs little even with a
+ * lot of them, and it is much simpler than accounting every transition
+ * between states. */
+void sampleClientMemory(void) {
+    struct clientStateStats states[CLIENT_STATES];
+    size_t objsize = Chat->client_pool.objsize;
+
+    memset(states, 0, sizeof(states));
+    for (int j = 0; j < Chat->numclients; j++) {
+        struct client *c = Chat->clients[j];
+        int state;
+
+        if (c->flags & CLIENT_NO_READS)
+            state = CLIENT_STATE_PAUSED;
+        else if (outq_len(&c->outq))
+            state = CLIENT_STATE_WRITING;
+        else if (circbuf_len(&c->read_cb))
+            state = CLIENT_STATE_READING;
+        else
+            state = CLIENT_STATE_IDLE;
+        states[state].clients++;
+        states[state].bytes += objsize + clientHeapMemory(c);
+    }
+    for (int j = 0; j < CLIENT_STATES; j++) {
+        STAT_SET(Chat->stats.states[j].clients, states[j].clients);
+        STAT_SET(Chat->stats.states[j].bytes, states[j].bytes);
+    }
+
+    struct slabPool *pools[] = {&Chat->client_pool, &Chat->write_pool};
+    long long total = 0, used = 0;
+    for (int j = 0; j < 2; j++) {
+        total += pools[j]->capacity*pools[j]->objsize;
+        used += pools[j]->used*pools[j]->objsize;
+    }
+    STAT_SET(Chat->stats.slab_bytes, total);
+    STAT_SET(Chat->stats.slab_used_bytes, used);
+}
+
+void memoryTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)privdata;
+    sampleClientMemory();
+    elAddTimer(el, t, MEMORY_SAMPLE_MS);
+}
+
+/* Sample the allocator every MEMORY_SAMPLE_MS. mallinfo2() locks the
+ * malloc arenas, that the workers use all the time: it runs on its own
+ * thread, and the metrics only read what it found last. */
+void *mallocSamplerThread(void *arg) {
+    struct timespec ts;
+
+    (void)arg;
+    ts.tv_sec = MEMORY_SAMPLE_MS/1000;
+    ts.tv_nsec = (MEMORY_SAMPLE_MS%1000)*1000000;
+    while(1) {
+#ifdef HAVE_MALLINFO2
+        struct mallinfo2 mi = mallinfo2();
+        STAT_SET(Server.malloc_allocated, mi.uordblks + mi.hblkhd);
+        STAT_SET(Server.malloc_free, mi.fordblks);
+        STAT_SET(Server.malloc_mmap, mi.hblkhd);
+#endif
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+void startMallocSampler(void) {
+#ifdef HAVE_MALLINFO2
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, mallocSamplerThread,
+                                NULL)) != 0)
+    {
+        perror("Creating the malloc sampler thread");
+        exit(1);
+    }
+    pthread_detach(thread);
+#endif
+}
+
+/* Resident set size of the process in bytes, or -1 if unknown. */
+long long processResidentMemory(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    long long size, resident;
+
+    if (fp == NULL) return -1;
+    int n = fscanf(fp, "%lld %lld", &size, &resident);
+    fclose(fp);
+    if (n != 2) return -1;
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+/* Render the memory metrics: the process as a whole, the allocator, and
+ * the clients by state. */
+void renderMemoryMetrics(struct metricsBuf *b) {
+    long long rss = processResidentMemory();
+    if (rss != -1)
+        metricsAppend(b, "# HELP smallchat_resident_memory_bytes Resident "
+                      "set size of the process\n"
+                      "# TYPE smallchat_resident_memory_bytes gauge\n"
+                      "smallchat_resident_memory_bytes %lld\n", rss);
+
+#ifdef HAVE_MALLINFO2
+    metricsAppend(b, "# HELP smallchat_malloc_allocated_bytes Bytes in use "
+                  "according to malloc\n"
+                  "# TYPE smallchat_malloc_allocated_bytes gauge\n"
+                  "smallchat_malloc_allocated_bytes %zu\n"
+                  "# HELP smallchat_malloc_free_bytes Bytes free in the "
+                  "malloc arenas\n"
+                  "# TYPE smallchat_malloc_free_bytes gauge\n"
+                  "smallchat_malloc_free_bytes %zu\n"
+                  "# HELP smallchat_malloc_mmap_bytes Bytes of the "
+                  "allocations mapped on their own\n"
+                  "# TYPE smallchat_malloc_mmap_bytes gauge\n"
+                  "smallchat_malloc_mmap_bytes %zu\n",
+                  STAT_GET(Server.malloc_allocated),
+                  STAT_GET(Server.malloc_free), STAT_GET(Server.malloc_mmap));
+#endif
+
+    metricsAppend(b, "# HELP smallchat_slab_bytes Bytes allocated by the "
+                  "object pools\n# TYPE smallchat_slab_bytes gauge\n");
+    for (int j = 0; j < Server.numworkers; j++)
+        metricsAppend(b, "smallchat_slab_bytes{worker=\"%d\"} %lld\n", j,
+                      STAT_GET(Server.workers[j]->stats.slab_bytes));
+    metricsAppend(b, "# HELP smallchat_slab_used_bytes Bytes of the object "
+                  "pools in use\n# TYPE smallchat_slab_used_bytes gauge\n");
+    for (int j = 0; j < Server.numworkers; j++)
+        metricsAppend(b, "smallchat_slab_used_bytes{worker=\"%d\"} %lld\n",
+                      j, STAT_GET(Server.workers[j]->stats.slab_used_bytes));
+
+    metricsAppend(b, "# HELP smallchat_clients_by_state Clients by state, "
+                  "sampled every second\n"
+                  "# TYPE smallchat_clients_by_state gauge\n");
+    for (int j = 0; j < Server.numworkers; j++) {
+        struct workerStats *st = &Server.workers[j]->stats;
+        for (int k = 0; k < CLIENT_STATES; k++)
+            metricsAppend(b, "smallchat_clients_by_state{worker=\"%d\","
+                          "state=\"%s\"} %lld\n", j, ClientStateNames[k],
+                          STAT_GET(st->states[k].clients));
+    }
+    metricsAppend(b, "# HELP smallchat_client_memory_bytes Memory of the "
+                  "clients by state, queued messages excluded\n"
+                  "# TYPE smallchat_client_memory_bytes gauge\n");
+    for (int j = 0; j < Server.numworkers; j++) {
+        struct workerStats *st = &Server.workers[j]->stats;
+        for (int k = 0; k < CLIENT_STATES; k++)
+            metricsAppend(b, "smallchat_client_memory_bytes{worker=\"%d\","
+                          "state=\"%s\"} %lld\n", j, ClientStateNames[k],
+                          STAT_GET(st->states[k].bytes));
+    }
+}
+
+/* Render the latency histogram of all the workers found at 'offset' in
+ * struct workerStats, with the given metric name. */
+void renderLatencyMetric(struct metricsBuf *b, const char *name,
+                         const char *help, size_t offset)
+{
+    struct histogram h;
+    memset(&h, 0, sizeof(h));
+    for (int j = 0; j < Server.numworkers; j++)
+        hist_merge(&h, (struct histogram *)
+                       ((char *)&Server.workers[j]->stats + offset));
+
+    metricsAppend(b, "# HELP %s_seconds %s\n# TYPE %s_seconds histogram\n",
+                  name, help, name);
+    unsigned long long cumulative = 0;
+    int idx = 0;
+    for (int bits = 1; bits <= METRICS_LATENCY_BUCKETS; bits++) {
+        long long upto = (1LL << bits) - 1;
+        while (idx < HIST_BUCKETS && hist_bucket_max(idx) <= upto)
+            cumulative += h.buckets[idx++];
+        metricsAppend(b, "%s_seconds_bucket{le=\"%.6f\"} %llu\n",
+                      name, upto/1e6, cumulative);
+    }
+    metricsAppend(b, "%s_seconds_bucket{le=\"+Inf\"} %llu\n", name, h.count);
+    metricsAppend(b, "%s_seconds_sum %.6f\n", name, h.sum/1e6);
+    metricsAppend(b, "%s_seconds_count %llu\n", name, h.count);
+
+    /* Precomputed quantiles, handy for humans. */
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    metricsAppend(b, "# TYPE %s_quantile_seconds gauge\n", name);
+    for (int j = 0; j < 3; j++)
+        metricsAppend(b, "%s_quantile_seconds{quantile=\"%g\"} %.6f\n", name,
+                      quantiles[j], hist_percentile(&h, quantiles[j])/1e6);
+    metricsAppend(b, "%s_quantile_seconds{quantile=\"1\"} %.6f\n",
+                  name, h.max/1e6);
+}
+
+/* Render all the metrics. The caller owns the returned buffer. */
+char *renderMetrics(size_t *len) {
+    struct metricsBuf b = {NULL, 0, 0};
+
+    metricsAppend(&b, "# TYPE smallchat_workers gauge\nsmallchat_workers %d\n",
+                  Server.numworkers);
+    metricsAppend(&b, "# TYPE smallchat_clients gauge\n");
+    for (int j = 0; j < Server.numworkers; j++) {
+        struct workerStats *st = &Server.workers[j]->stats;
+        metricsAppend(&b, "smallchat_clients{worker=\"%d\"} %lld\n", j,
+                      (long long)(STAT_GET(st->connections) -
+                                  STAT_GET(st->disconnections)));
+    }
+    metricsAppend(&b, "# HELP smallchat_log_dropped_total Log records "
+                  "dropped because a log buffer was full\n"
+                  "# TYPE smallchat_log_dropped_total counter\n"
+                  "smallchat_log_dropped_total %llu\n", log_dropped());
+
+    for (struct workerMetric *m = WorkerMetrics; m->name; m++) {
+        metricsAppend(&b, "# HELP %s %s\n# TYPE %s %s\n",
+                      m->name, m->help, m->name, m->type);
+        for (int j = 0; j < Server.numworkers; j++) {
+            char *field = (char *)&Server.workers[j]->stats + m->offset;
+            if (m->is_signed)
+                metricsAppend(&b, "%s{worker=\"%d\"} %lld\n", m->name, j,
+                              STAT_GET(*(long long *)field));
+            else
+                metricsAppend(&b, "%s{worker=\"%d\"} %llu\n", m->name, j,
+                              STAT_GET(*(unsigned long long *)field));
+        }
+    }
+
+    renderMemoryMetrics(&b);
+    renderLatencyMetric(&b, "smallchat_fanout_latency",
+        "From reading a message to queuing it to the local recipients",
+        offsetof(struct workerStats, fanout_latency));
+    renderLatencyMetric(&b, "smallchat_forward_latency",
+        "From reading a message to queuing it in the other workers",
+        offsetof(struct workerStats, forward_latency));
+
+    *len = b.len;
+    return b.buf;
+}
+
+/* A connection to the metrics port. Whatever it sends is taken as a
+ * request for the metrics: they are sent back as an HTTP response, then
+ * we wait for the peer to close the connection. */
+struct metricsConn {
+    char *buf;      // The response, NULL until the request arrives.
+    size_t len, pos;
+};
+
+void freeMetricsConn(int fd, struct metricsConn *mc) {
+    elDeleteFileEvent(Chat->el, fd, EL_READABLE|EL_WRITABLE);
+    close(fd);
+    free(mc->buf);
+    free(mc);
+}
+
+void metricsWriteHandler(struct eventLoop *el, int fd, void *privdata,
+                         int mask)
+{
+    (void)mask;
+    struct metricsConn *mc = privdata;
+    ssize_t nwritten = write(fd, mc->buf+mc->pos, mc->len-mc->pos);
+
+    if (nwritten == -1) {
+        if (errno == EAGAIN) return;
+        freeMetricsConn(fd, mc);
+        return;
+    }
+    mc->pos += nwritten;
+    if (mc->pos < mc->len) {
+        if (!(elGetFileEvents(el, fd) & EL_WRITABLE) &&
+            elCreateFileEvent(el, fd, EL_WRITABLE, metricsWriteHandler,
+                              mc) == EL_ERR)
+        {
+            freeMetricsConn(fd, mc);
+        }
+        return;
+    }
+    elDeleteFileEvent(el, fd, EL_WRITABLE);
+    shutdown(fd, SHUT_WR);
+}
+
+void metricsReadHandler(struct eventLoop *el, int fd, void *privdata,
+                        int mask)
+{
+    (void)mask;
+    struct metricsConn *mc = privdata;
+    char buf[1024];
+    ssize_t nread = read(fd, buf, sizeof(buf));
+
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        freeMetricsConn(fd, mc);
+        return;
+    }
+    if (mc->buf) return; /* Already answered. */
+
+    size_t bodylen;
+    char *body = renderMetrics(&bodylen);
+    struct metricsBuf b = {NULL, 0, 0};
+    metricsAppend(&b, "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n\r\n%.*s", bodylen, (int)bodylen, body);
+    free(body);
+    mc->buf = b.buf;
+    mc->len = b.len;
+    metricsWriteHandler(el, fd, mc, EL_WRITABLE);
+}
+
+void metricsAcceptHandler(struct eventLoop *el, int fd, void *privdata,
+                          int mask)
+{
+    (void)privdata; (void)mask;
+    int cfd;
+
+    while ((cfd = acceptClient(fd)) != -1) {
+        struct metricsConn *mc = chatMalloc(sizeof(*mc));
+        mc->buf = NULL;
+        mc->len = mc->pos = 0;
+        if (elCreateFileEvent(el, cfd, EL_READABLE, metricsReadHandler,
+                              mc) == EL_ERR)
+        {
+            close(cfd);
+            free(mc);
+        }
+    }
+}
+
+/* Serve the metrics on --metrics-port from the event loop of 'w'. */
+void createMetricsListener(struct chatState *w) {
+    int fd = createTCPServer(Config.metrics_port, 0);
+    if (fd == -1) {
+        perror("Creating the metrics listening socket");
+        exit(1);
+    }
+    socketSetNonBlockNoDelay(fd);
+    if (elCreateFileEvent(w->el, fd, EL_READABLE, metricsAcceptHandler,
+                          NULL) == EL_ERR)
+    {
+        perror("Registering the metrics listening socket");
+        exit(1);
+    }
+}
+
+/* =============================== Client commands ==============================
+ * Every command is an entry of the commands table, with the number of
+ * arguments it takes and its handler. The last argument takes the rest of
+ * the line, spaces included. */
+
+#define COMMAND_MAX_ARGS 2
+#define COMMAND_TABLE_SIZE 64   /* Power of two, larger than the commands. */
+
+typedef void chatCommandProc(struct client *c, int argc, char **argv);
+
+struct chatCommand {
+    const char *name;   // Without the "/".
+    int minargs, maxargs;
+    chatCommandProc *proc;
+    const char *usage;  // Sent back when the arguments are wrong.
+};
+
+void nickCommand(struct client *c, int argc, char **argv) {
+    (void)argc;
+    if (!validName(argv[0],MAX_NICK_LENGTH) ||
+        !strncmp(argv[0],DEFAULT_NICK_PREFIX,strlen(DEFAULT_NICK_PREFIX)))
+    {
+        addReplyString(c,"Invalid nick\n");
+    } else if (!setClientNick(c,argv[0])) {
+        addReplyString(c,"Nick already in use\n");
+    }
+}
+
+void msgCommand(struct client *c, int argc, char **argv) {
+    (void)argc;
+    const char *text = argv[1];
+
+    /* (private) nick> text */
+    size_t nicklen = strlen(c->nick), textlen = strlen(text);
+    struct sharedMsg *m = smsg_alloc(10+nicklen+2+textlen+1);
+    char *p = m->buf;
+    memcpy(p, "(private) ", 10); p += 10;
+    memcpy(p, c->nick, nicklen); p += nicklen;
+    memcpy(p, "> ", 2); p += 2;
+    memcpy(p, text, textlen); p += textlen;
+    *p = '\n';
+    if (!sendMsgToNick(argv[0], m)) addReplyString(c,"No such nick\n");
+    smsg_release(m);
+}
+
+void joinCommand(struct client *c, int argc, char **argv) {
+    (void)argc;
+    if (!validName(argv[0],MAX_ROOM_NAME)) {
+        addReplyString(c,"Invalid room name\n");
+    } else if (!joinRoom(c,argv[0])) {
+        addReplyString(c,"Too many rooms joined\n");
+    }
+}
+
+void partCommand(struct client *c, int argc, char **argv) {
+    struct room *r = argc ? lookupRoom(argv[0]) : c->room;
+    if (r == NULL || clientRoomSlot(c,r) == -1) {
+        addReplyString(c,"Not in that room\n");
+    } else {
+        partRoom(c,r);
+    }
+}
+
+/* Replay the last messages of the current room, all of them or the last
+ * 'count' ones, with a single write. */
+void historyCommand(struct client *c, int argc, char **argv) {
+    long long count = Config.history_size;
+
+    if (argc) {
+        char *end;
+        count = strtoll(argv[0],&end,10);
+        if (*end != '\0' || count <= 0) {
+            addReplyString(c,"Invalid message count\n");
+            return;
+        }
+        if (count > Config.history_size) count = Config.history_size;
+    }
+    if (c->room == NULL) {
+        addReplyString(c,"Not in a room\n");
+        return;
+    }
+    if (count == 0) return;
+
+    struct sharedMsg **msgs = chatMalloc(sizeof(*msgs)*count);
+    struct roomHistory *h = c->room->history;
+    pthread_mutex_lock(&h->lock);
+    int n = msgring_last(&h->ring, count, msgs);
+    pthread_mutex_unlock(&h->lock);
+
+    addReplyMsgs(c,msgs,n);
+    for (int j = 0; j < n; j++) smsg_release(msgs[j]);
+    free(msgs);
+}
+
+/* Switch the client to binary framing. The reply is the last line the
+ * client receives: whatever follows it is a frame, and so must be
+ * whatever the client sends after the command.
+ *
+ * The optional argument is the comma separated list of the codecs the
+ * client can decompress, by preference. The first one we have too is
+ * used from now on for the messages worth compressing, and named in the
+ * reply. */
+void binaryCommand(struct client *c, int argc, char **argv) {
+    if (c->flags & CLIENT_BINARY) return;
+
+    const char *codecs = argc ? argv[0] : "";
+    while (*codecs && c->codec == 0) {
+        char name[32];
+        size_t len = strcspn(codecs, ",");
+        if (len < sizeof(name)) {
+            memcpy(name, codecs, len);
+            name[len] = '\0';
+            c->codec = codec_from_name(name);
+        }
+        codecs += len;
+        if (*codecs) codecs++;
+    }
+
+    char reply[64];
+    snprintf(reply, sizeof(reply), c->codec ? "BINARY %s\n" : "BINARY\n",
+             codec_name(c->codec));
+    addReplyString(c,reply);
+    c->flags |= CLIENT_BINARY;
+}
+
+/* Reply to our PING. Reading it was enough to reset the idle time. */
+void pongCommand(struct client *c, int argc, char **argv) {
+    (void)c; (void)argc; (void)argv;
+}
+
+struct chatCommand ChatCommands[] = {
+    {"nick", 1, 1, nickCommand, "Usage: /nick <nick>\n"},
+    {"msg", 2, 2, msgCommand, "Usage: /msg <nick> <text>\n"},
+    {"join", 1, 1, joinCommand, "Usage: /join <room>\n"},
+    {"part", 0, 1, partCommand, "Usage: /part [room]\n"},
+    {"history", 0, 1, historyCommand, "Usage: /history [count]\n"},
+    {"pong", 0, 0, pongCommand, "Usage: /pong\n"},
+    {"binary", 0, 1, binaryCommand, "Usage: /binary [codec,...]\n"},
+    {NULL, 0, 0, NULL, NULL}
+};
+
+/* Commands by hash. The hash only looks at the length and at the first
+ * and last byte of the name: initCommandTable() checks that it is
+ * perfect for the commands we have, so a lookup costs a single compare
+ * however many commands there are. */
+struct chatCommand *CommandTable[COMMAND_TABLE_SIZE];
+
+static unsigned int commandHash(const char *name, size_t len) {
+    return (len*31 + (unsigned char)name[0]*13 +
+            (unsigned char)name[len-1]) & (COMMAND_TABLE_SIZE-1);
+}
+
+void initCommandTable(void) {
+    for (struct chatCommand *cmd = ChatCommands; cmd->name; cmd++) {
+        unsigned int h = commandHash(cmd->name, strlen(cmd->name));
+        if (CommandTable[h]) {
+            fprintf(stderr, "Commands /%s and /%s collide: "
+                    "change commandHash()\n", cmd->name, CommandTable[h]->name);
+            exit(1);
+        }
+        CommandTable[h] = cmd;
+    }
+}
+
+struct chatCommand *lookupCommand(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0) return NULL;
+
+    struct chatCommand *cmd = CommandTable[commandHash(name, len)];
+    return (cmd && !strcmp(cmd->name, name)) ? cmd : NULL;
+}
+
+/* Process a command line sent by the client, without the "/" of line
+ * mode, already copied out of the read buffer as a null terminated
+ * string. */
+void processCommand(struct client *c, char *line) {
+    /* Remove any trailing newline. */
+    char *p;
+    p = strchr(line,'\r'); if (p) *p = 0;
+    p = strchr(line,'\n'); if (p) *p = 0;
+
+    /* Split the command name and the arguments, separated by a space. */
+    char *argv[COMMAND_MAX_ARGS];
+    int argc = 0;
+    char *arg = strchr(line,' ');
+    if (arg) *arg++ = 0; /* Terminate command name. */
+
+    struct chatCommand *cmd = lookupCommand(line);
+    if (cmd == NULL) {
+        /* Unsupported command. Send an error. */
+        char *errmsg = "Unsupported command\n";
+        addReply(c,errmsg,strlen(errmsg));
+        return;
+    }
+
+    while (arg && argc < cmd->maxargs) {
+        argv[argc++] = arg;
+        if (argc == cmd->maxargs) {
+            arg = NULL; /* The last argument takes the rest. */
+            break;
+        }
+        arg = strchr(arg,' ');
+        if (arg) *arg++ = 0;
+    }
+    if (argc < cmd->minargs || arg != NULL) {
+        addReplyString(c,cmd->usage);
+        return;
+    }
+    cmd->proc(c,argc,argv);
+}
+
+/* Create the message of the client to its current room, in the form:
+ *   nick> some message.
+ * or, outside the default room:
+ *   [room] nick> some message.
+ * with room for 'len' bytes of text, followed by MSG_SEP if 'addsep' is
+ * true. '*text' is set to where the caller has to copy the text. */
+struct sharedMsg *createChatMessage(struct client *c, size_t len,
+                                    int addsep, char **text)
+{
+    /* Room prefix, empty in the default room. */
+    char prefix[MAX_ROOM_NAME+4];
+    size_t prefixlen = 0;
+    if (strcmp(c->room->name, DEFAULT_ROOM))
+        prefixlen = snprintf(prefix, sizeof(prefix), "[%s] ", c->room->name);
+
+    size_t nicklen = strlen(c->nick);
+    struct sharedMsg *m = smsg_alloc(prefixlen+nicklen+2+len+(addsep != 0));
+    char *p = m->buf;
+    memcpy(p, prefix, prefixlen); p += prefixlen;
+    memcpy(p, c->nick, nicklen); p += nicklen;
+    memcpy(p, "> ", 2); p += 2;
+    *text = p;
+    if (addsep) p[len] = MSG_SEP;
+    return m;
+}
+
+/* Send the message created by createChatMessage() to the room of the
+ * client, releasing it. */
+void sendChatMessage(struct client *c, struct sharedMsg *m) {
+    log_write(LL_DEBUG, "%.*s", (int)m->len-1, m->buf);
+
+    /* Send it to the other members of the room. */
+    addRoomHistory(c->room, m);
+    sendMsgToRoomBut(c->room, c->fd, m);
+    smsg_release(m);
+    STAT_INC(Chat->stats.msgs_in);
+    hist_add(&Chat->stats.fanout_latency, ustime() - Chat->read_time);
+}
+
+/* Replace with spaces the separators in the 'len' bytes of text of a
+ * message that came in a frame: otherwise line mode clients would take
+ * what follows a separator as a new line, that could be made to look
+ * like a message of another user. The history and the message log, that
+ * store one message per line, would be confused as well. */
+void sanitizeFrameText(char *text, size_t len) {
+    char *p = text, *end = text+len;
+    while ((p = memchr(p, MSG_SEP, end-p)) != NULL) *p++ = ' ';
+}
+
+/* Send the next 'len' bytes of the client read buffer, consuming them, to
+ * the members of the current room of the client (and show them on the
+ * server console). If 'addsep' is true MSG_SEP is appended, since the
+ * bytes come from a frame: line mode clients in the room then see a line
+ * like any other, the separators in the frame being replaced by spaces.
+ * The message bytes are copied only once, straight from the read buffer
+ * into the shared message that every recipient will reference. */
+void processChatMessage(struct client *c, int len, int addsep) {
+    if (c->room == NULL) {
+        circbuf_consume(&c->read_cb, len);
+        addReplyString(c,"Join a room to send messages\n");
+        return;
+    }
+
+    char *text;
+    struct sharedMsg *m = createChatMessage(c, len, addsep, &text);
+    circbuf_pop_to_linear(text, &c->read_cb, len);
+    if (addsep) sanitizeFrameText(text, len);
+    sendChatMessage(c, m);
+}
+
+/* Copy the next 'len' bytes of the client read buffer, consuming them, as
+ * a null terminated command line, and process it. Commands are rare and
+ * short, so they are parsed from a copy. */
+void processCommandBytes(struct client *c, int len) {
+    STAT_INC(Chat->stats.commands);
+    char *line = chatMalloc(len+1);
+    int linelen = circbuf_pop_to_linear(line, &c->read_cb, len);
+    line[linelen] = '\0';
+    processCommand(c, line);
+    free(line);
+}
+
+/* Handle the first 'len' bytes of the client read buffer, that form a
+ * complete line (separator included), and consume them. If the line
+ * starts with "/", we process it as a client command, otherwise it is a
+ * message for the current room of the client. */
+void processMessage(struct client *c, int len) {
+    char *head;
+    circbuf_read_span(&c->read_cb, &head);
+
+    if (head[0] == '/') {
+        circbuf_consume(&c->read_cb, 1);
+        processCommandBytes(c, len-1);
+    } else {
+        processChatMessage(c, len, 0);
+    }
+}
+
+/* Reject a line longer than --max-line-length. 'len' bytes of it are
+ * buffered: they are consumed, and if the separator was not received yet
+ * the rest of the line is discarded as it arrives. */
+void rejectLongLine(struct client *c, int len, int complete) {
+    char *errmsg = "Line too long\n";
+
+    circbuf_consume(&c->read_cb, len);
+    if (!complete) c->flags |= CLIENT_DISCARD_LINE;
+    addReply(c,errmsg,strlen(errmsg));
+}
+
+/* Process a FRAME_ZMSG frame of 'len' bytes: the message is decompressed
+ * from a copy of the frame, straight into the shared message. Its length
+ * is checked against --max-line-length before allocating it, and its
+ * separators replaced like for FRAME_MSG. */
+void processCompressedMessage(struct client *c, int len) {
+    if (c->codec == 0 || c->room == NULL) {
+        circbuf_consume(&c->read_cb, len);
+        addReplyString(c, c->codec ? "Join a room to send messages\n" :
+                       "Use /binary <codec> to send compressed frames\n");
+        return;
+    }
+
+    unsigned char *buf = chatMalloc(len);
+    circbuf_pop_to_linear((char *)buf, &c->read_cb, len);
+
+    size_t textlen;
+    int n = frame_decode_varint(buf, len, &textlen);
+    if (n <= 0) {
+        addReplyString(c,"Invalid compressed frame\n");
+    } else if (textlen > (size_t)Config.max_line_length) {
+        addReplyString(c,"Frame too long\n");
+    } else {
+        char *text;
+        struct sharedMsg *m = createChatMessage(c, textlen, 1, &text);
+        if (codec_decompress(c->codec, (char *)buf+n, len-n, text,
+                             textlen) == -1)
+        {
+            smsg_release(m);
+            addReplyString(c,"Invalid compressed frame\n");
+        } else {
+            sanitizeFrameText(text, textlen);
+            sendChatMessage(c, m);
+        }
+    }
+    free(buf);
+}
+
+/* Handle a complete frame of type 'type', whose 'len' bytes of payload
+ * are at the head of the client read buffer, and consume it. */
+void processFrame(struct client *c, int type, int len) {
+    switch(type) {
+    case FRAME_MSG:
+        processChatMessage(c, len, 1);
+        break;
+    case FRAME_CMD:
+        processCommandBytes(c, len);
+        break;
+    case FRAME_ZMSG:
+        processCompressedMessage(c, len);
+        break;
+    default:
+        circbuf_consume(&c->read_cb, len);
+        addReplyString(c,"Unknown frame type\n");
+        break;
+    }
+}
+
+/* Process the complete frames in the client read buffer. Unlike lines,
+ * frames say how long they are upfront: nothing is scanned, and when a
+ * frame is incomplete the buffer is grown at once to fit all of it, so
+ * the next reads land right where the payload goes. Frames longer than
+ * --max-line-length are rejected, and their payload skipped as it
+ * arrives. The frames are split by frame_split(), calling
+ * clientFrameProc() for each of them. */
+void processFrames(struct client *c) {
+    struct Circbuf *cb = &c->read_cb;
+
+    while (!(c->flags & CLIENT_CLOSE_ASAP)) {
+        if (c->discard) {
+            int avail = circbuf_len(cb);
+            int skip = c->discard < (size_t)avail ? (int)c->discard : avail;
+            circbuf_consume(cb, skip);
+            c->discard -= skip;
+            if (c->discard) break;
+            continue;
+        }
+
+        size_t need;
+        int res = frame_split(cb, Config.max_line_length, &need,
+                              clientFrameProc, c);
+        if (res == FRAME_SPLIT_STOPPED) {
+            /* Go on if it was to skip a frame too long. */
+            if (c->discard) continue;
+            break;
+        }
+        if (res == FRAME_SPLIT_INVALID) {
+            /* There is no way to find where the next frame starts. Flush
+             * the error right away: with --defer-flush it would not be
+             * written, the client being closed. */
+            addReplyString(c,"Invalid frame\n");
+            writeToClient(c);
+            freeClientAsync(c);
+            break;
+        }
+        if ((size_t)circbuf_size(cb) < need && !growClientReadBuffer(c, need))
+            freeClientAsync(c);
+        break;
+    }
+}
+
+/* Called by frame_split() with the frame at the head of the client read
+ * buffer (see processFrames()). */
+int clientFrameProc(void *privdata, int type, int hdrlen, size_t len) {
+    struct client *c = privdata;
+
+    if (c->flags & CLIENT_CLOSE_ASAP) return 0;
+    if (len > (size_t)Config.max_line_length) {
+        /* Stop, for processFrames() to skip the payload. */
+        circbuf_consume(&c->read_cb, hdrlen);
+        c->discard = len;
+        addReplyString(c,"Frame too long\n");
+        return 0;
+    }
+    if (!takeInputTokens(c, hdrlen+len)) return 0;
+    circbuf_consume(&c->read_cb, hdrlen);
+    processFrame(c, type, len);
+    return 1;
+}
+
+/* Process the complete lines in the client read buffer.
+ *
+ * Example (suppose 'A' is the separator):
+ * "niceAtoAmeetAyou"
+ *
+ * 'A' occurs 3 times, so we send 3 messages
+ * niceA, toA, meetA
+ * "you" is kept in circular buffer and is not sent. When the buffer
+ * is full it grows, up to what is needed to hold the longest line
+ * accepted: lines longer than that are rejected.
+ *
+ * The separators are located by frame_split_lines() with a single scan
+ * of the bytes we did not scan yet, then every message is consumed in
+ * turn by clientLineProc(). Stop parsing
+ * if the client was scheduled for disconnection while we were
+ * processing its messages. If a line switched the client to binary mode,
+ * the rest of the buffer is made of frames. */
+void processLines(struct client *c) {
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+    if (frame_split_lines(&c->read_cb, &c->scanned, MSG_SEP,
+                          clientLineProc, c) ||
+        (c->flags & CLIENT_BINARY))
+    {
+        /* The rest waits for the next turn of the client, or is made of
+         * frames if the client switched to binary mode. */
+        if (c->flags & CLIENT_BINARY) processFrames(c);
+        return;
+    }
+
+    /* What is left has no separator, and was scanned already. */
+    int len = circbuf_len(&c->read_cb);
+    if (c->flags & CLIENT_DISCARD_LINE) {
+        circbuf_consume(&c->read_cb, len);
+        c->scanned = 0;
+    } else if (len > Config.max_line_length) {
+        rejectLongLine(c, len, 0);
+        c->scanned = 0;
+    } else if (circbuf_space_left(&c->read_cb) == 0 &&
+               !growClientReadBuffer(c,0))
+    {
+        /* Keep buffering with the next read, making room if needed. */
+        freeClientAsync(c);
+    }
+}
+
+/* Called by frame_split_lines() with the line at the head of the client
+ * read buffer (see processLines()). */
+int clientLineProc(void *privdata, int msglen) {
+    struct client *c = privdata;
+
+    if (c->flags & (CLIENT_CLOSE_ASAP|CLIENT_BINARY)) return 0;
+    if (c->flags & CLIENT_DISCARD_LINE) {
+        /* Tail of a line we already rejected. */
+        circbuf_consume(&c->read_cb, msglen);
+        c->flags &= ~CLIENT_DISCARD_LINE;
+        return 1;
+    }
+    if (!takeInputTokens(c, msglen)) return 0;
+    if (msglen-1 > Config.max_line_length)
+        rejectLongLine(c, msglen, 1);
+    else
+        processMessage(c, msglen);
+    return 1;
+}
+
+/* ============================ Input scheduling ===============================
+ * A client sending a flood of messages must not take the worker for
+ * itself: messages are processed in turns of --client-quantum at most,
+ * and each worker processes --tick-budget messages per event loop
+ * iteration at most. A client whose turn ends with complete messages
+ * still buffered stops being read, and queues in
+ * Chat->clients_pending_input: at the next iteration the clients there
+ * get their turn, round robin, before the event loop is polled again.
+ * On top of that every client has token buckets limiting its messages
+ * and bytes per second (--client-msg-rate, --client-byte-rate): a client
+ * over its rate is not read nor processed until it earned enough
+ * tokens.
+ * =========================================================================== */
+
+/* Append the client to Chat->clients_pending_input. */
+void linkPendingInput(struct client *c) {
+    c->pending_input_next = NULL;
+    c->pending_input_prev = Chat->clients_pending_input_tail;
+    if (Chat->clients_pending_input_tail)
+        Chat->clients_pending_input_tail->pending_input_next = c;
+    else
+        Chat->clients_pending_input = c;
+    Chat->clients_pending_input_tail = c;
+}
+
+/* Remove the client from Chat->clients_pending_input. */
+void unlinkPendingInput(struct client *c) {
+    if (c->pending_input_prev)
+        c->pending_input_prev->pending_input_next = c->pending_input_next;
+    else
+        Chat->clients_pending_input = c->pending_input_next;
+    if (c->pending_input_next)
+        c->pending_input_next->pending_input_prev = c->pending_input_prev;
+    else
+        Chat->clients_pending_input_tail = c->pending_input_prev;
+    c->flags &= ~CLIENT_INPUT_PENDING;
+}
+
+/* The buffered input of the client waits for its next turn. */
+void scheduleClientInput(struct client *c) {
+    if (c->flags & (CLIENT_INPUT_PENDING|CLIENT_THROTTLED)) return;
+    pauseClientReads(c, CLIENT_INPUT_PENDING);
+    linkPendingInput(c);
+}
+
+/* Add to the buckets of the client the tokens earned since the last
+ * refill. Like the accept bucket, they hold at most one second worth of
+ * traffic, that is the largest burst allowed. */
+void refillClientTokens(struct client *c, long long now) {
+    long long elapsed = now - c->refill_time;
+
+    if (elapsed > 1000000) elapsed = 1000000;
+    c->refill_time = now;
+    if (Config.client_msg_rate) {
+        long long max = Config.client_msg_rate*1000000;
+        c->msg_tokens += elapsed*Config.client_msg_rate;
+        if (c->msg_tokens > max) c->msg_tokens = max;
+    }
+    if (Config.client_byte_rate) {
+        long long max = Config.client_byte_rate*1000000;
+        c->byte_tokens += elapsed*Config.client_byte_rate;
+        if (c->byte_tokens > max) c->byte_tokens = max;
+    }
+}
+
+/* Stop the client until its buckets have tokens again. The bytes bucket
+ * may be in debt: a message longer than the rate passes when the bucket
+ * is not empty, and the client then waits more. */
+void throttleClient(struct client *c) {
+    long long wait = 0; /* Microseconds. */
+
+    if (Config.client_msg_rate && c->msg_tokens < 1000000)
+        wait = (1000000 - c->msg_tokens)/Config.client_msg_rate;
+    if (Config.client_byte_rate && c->byte_tokens <= 0) {
+        long long w = (1 - c->byte_tokens)/Config.client_byte_rate;
+        if (w > wait) wait = w;
+    }
+    pauseClientReads(c, CLIENT_THROTTLED);
+    elAddTimer(Chat->el, &c->throttle_timer, wait/1000+1);
+    STAT_INC(Chat->stats.throttled);
+}
+
+/* The throttled client earned its tokens: it gets a turn. */
+void clientThrottleTimerProc(struct eventLoop *el, struct elTimer *t,
+                             void *privdata)
+{
+    (void)el; (void)t;
+    struct client *c = privdata;
+
+    c->flags &= ~CLIENT_THROTTLED;
+    scheduleClientInput(c);
+}
+
+/* Called before processing a message of 'len' bytes of the client: take
+ * what it costs from the budgets. If one of them is exhausted, returns 0
+ * after arranging for the client to continue later. */
+int takeInputTokens(struct client *c, int len) {
+    if (c->turn_left == 0 || Chat->input_budget == 0) {
+        scheduleClientInput(c);
+        STAT_INC(Chat->stats.input_deferred);
+        return 0;
+    }
+    if ((Config.client_msg_rate && c->msg_tokens < 1000000) ||
+        (Config.client_byte_rate && c->byte_tokens <= 0))
+    {
+        throttleClient(c);
+        return 0;
+    }
+    c->turn_left--;
+    Chat->input_budget--;
+    if (Config.client_msg_rate) c->msg_tokens -= 1000000;
+    if (Config.client_byte_rate) c->byte_tokens -= (long long)len*1000000;
+    return 1;
+}
+
+/* Start a turn of the client, processing the complete messages in its
+ * read buffer. */
+void processBufferedInput(struct client *c, long long now) {
+    c->turn_left = Config.client_quantum;
+    if (Config.client_msg_rate || Config.client_byte_rate)
+        refillClientTokens(c, now);
+
+    if (c->flags & CLIENT_BINARY)
+        processFrames(c);
+    else
+        processLines(c);
+}
+
+/* Give a turn to the clients waiting in Chat->clients_pending_input, in
+ * order, while the budget of the iteration lasts. The clients that still
+ * have input left queue again at the tail, the others are read again. */
+void handleClientsWithPendingInput(void) {
+    if (Chat->clients_pending_input == NULL) return;
+
+    long long now = ustime();
+    struct client *last = Chat->clients_pending_input_tail;
+    while (Chat->clients_pending_input && Chat->input_budget) {
+        struct client *c = Chat->clients_pending_input;
+        unlinkPendingInput(c);
+        if (!(c->flags & CLIENT_CLOSE_ASAP)) {
+            Chat->read_time = now;
+            processBufferedInput(c, now);
+            if (!(c->flags & (CLIENT_NO_READS|CLIENT_CLOSE_ASAP)) &&
+                watchClientReads(c) == EL_ERR)
+            {
+                freeClientAsync(c);
+            }
+        }
+        /* Every client had a turn: the ones queued again wait for the
+         * next iteration. */
+        if (c == last) break;
+    }
+}
+
+/* Account for the 'nread' bytes just added to the read buffer of the
+ * client, and process the complete messages. */
+void processClientInput(struct client *c, int nread) {
+    Chat->read_time = ustime();
+    c->last_read_time = Chat->read_time/1000;
+    STAT_INC(Chat->stats.reads);
+    STAT_ADD(Chat->stats.bytes_in, nread);
+
+    processBufferedInput(c, Chat->read_time);
+}
+
+/* Called by the event loop when the client socket 'fd' has pending data
+ * the client sent us. */
+void readFromClient(struct eventLoop *el, int fd, void *privdata, int mask) {
+    (void)el; (void)mask;
+    struct client *c = privdata;
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+
+    if (c->flags & CLIENT_TLS_HANDSHAKE) {
+        continueTlsHandshake(c);
+        return;
+    }
+    if (c->flags & CLIENT_TLS_READ) {
+        /* A record at a time, see tlsRead(). */
+        char buf[TLS_MAX_RECORD];
+        ssize_t nread = tlsRead(c->tls, buf, sizeof(buf));
+        if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        recvFromClient(el, fd, buf, nread, c);
+        return;
+    }
+
+    /* It is entirely possible that we read just half a message, so reads
+     * are buffered in the client circular buffer until the message
+     * separator is reached. We read straight into the free space of the
+     * buffer, that may be split in two parts when it wraps around. */
+    if (circbuf_space_left(&c->read_cb) == 0 &&
+        !growClientReadBuffer(c,0))
+    {
+        freeClientAsync(c);
+        return;
+    }
+    struct iovec iov[2];
+    int iovcnt = circbuf_write_iov(&c->read_cb, iov);
+    int nread = iovcnt ? readv(fd, iov, iovcnt) : 0;
+
+    if (nread <= 0) {
+        /* Error or short read means that the socket
+         * was closed. The client may still be referenced by the list
+         * of pending writes, so it is freed at the end of the event loop
+         * iteration. */
+        log_write(LL_VERBOSE, "Disconnected client fd=%d, nick=%s",
+                  fd, c->nick);
+        freeClientAsync(c);
+        return;
+    }
+    circbuf_commit(&c->read_cb, nread);
+
+    /* printf("Client fd=%d\n", fd); */
+    /* circbuf_print_data(&c->read_cb); */
+
+    processClientInput(c, nread);
+}
+
+/* Called with the data received on our behalf by the event loop backend,
+ * see watchClientReads(). It is in a buffer of the backend, valid only
+ * during the call: copy it in the client buffer. */
+void recvFromClient(struct eventLoop *el, int fd, char *buf, int res,
+                    void *privdata)
+{
+    (void)el;
+    struct client *c = privdata;
+    if (c->flags & CLIENT_CLOSE_ASAP) return;
+
+    if (res <= 0) {
+        log_write(LL_VERBOSE, "Disconnected client fd=%d, nick=%s",
+                  fd, c->nick);
+        freeClientAsync(c);
+        return;
+    }
+    if (circbuf_space_left(&c->read_cb) < res &&
+        !growClientReadBuffer(c, circbuf_len(&c->read_cb)+res))
+    {
+        freeClientAsync(c);
+        return;
+    }
+    circbuf_push_from_linear(&c->read_cb, buf, res);
+    processClientInput(c, res);
+}
+
+/* Grow the read buffer of the client to hold at least 'size' bytes, and
+ * at least double it. A grown buffer is shrunk back after
+ * --readbuf-shrink-idle seconds without input, so that memory tracks the
+ * active traffic. Returns 0 on failure. */
+int growClientReadBuffer(struct client *c, int size) {
+    if (size < circbuf_size(&c->read_cb)*2) size = circbuf_size(&c->read_cb)*2;
+    if (!circbuf_resize(&c->read_cb, size)) return 0;
+    if (!elTimerPending(&c->shrink_timer))
+        elAddTimer(Chat->el, &c->shrink_timer,
+                   Config.readbuf_shrink_idle*1000);
+    return 1;
+}
+
+/* Shrink back the read buffer of the client, if it was idle long
+ * enough. Otherwise check again when it will be. */
+void clientShrinkTimerProc(struct eventLoop *el, struct elTimer *t,
+                           void *privdata)
+{
+    struct client *c = privdata;
+    struct Circbuf *cb = &c->read_cb;
+    long long idle = mstime() - c->last_read_time;
+    long long shrink_idle = Config.readbuf_shrink_idle*1000;
+
+    if (circbuf_size(cb) <= Config.readbuf_initial) return;
+    if (idle < shrink_idle) {
+        elAddTimer(el, t, shrink_idle-idle);
+        return;
+    }
+
+    /* Keep room for at least one more byte, a full buffer would not
+     * accept any read. */
+    int target = circbuf_len(cb)+1;
+    if (target < Config.readbuf_initial) target = Config.readbuf_initial;
+    circbuf_resize(cb, target);
+}
+
+/* Arm the keepalive timer of the client for the next PING to send or
+ * for its idle timeout, whatever comes first. The timer is not moved
+ * when the client sends something: when it expires we just check how
+ * long the client was silent, and arm it again. */
+void armClientTimer(struct client *c) {
+    long long next = -1;
+
+    if (Config.idle_timeout)
+        next = c->last_read_time + Config.idle_timeout*1000;
+    if (Config.ping_interval) {
+        long long last = c->last_read_time > c->last_ping_time ?
+                         c->last_read_time : c->last_ping_time;
+        long long ping = last + Config.ping_interval*1000;
+        if (next == -1 || ping < next) next = ping;
+    }
+    if (next == -1) return;
+
+    long long ms = next - mstime();
+    elAddTimer(Chat->el, &c->timer, ms > 0 ? ms : 0);
+}
+
+/* Keepalive of the client: disconnect it if it was silent for longer
+ * than --idle-timeout, or send it a PING after --ping-interval seconds of
+ * silence. Any input, like the /pong reply, counts as activity. Half
+ * open connections are detected either way: by the timeout, or by the
+ * write error of the PING. */
+void clientTimerProc(struct eventLoop *el, struct elTimer *t, void *privdata) {
+    (void)el; (void)t;
+    struct client *c = privdata;
+    long long now = mstime();
+    long long idle = now - c->last_read_time;
+
+    if (Config.idle_timeout && idle >= Config.idle_timeout*1000) {
+        log_write(LL_VERBOSE, "Idle timeout for client fd=%d, nick=%s",
+                  c->fd, c->nick);
+        freeClientAsync(c);
+        return;
+    }
+    if (Config.ping_interval && idle >= Config.ping_interval*1000 &&
+        now - c->last_ping_time >= Config.ping_interval*1000)
+    {
+        addReplyString(c,"PING\n");
+        c->last_ping_time = now;
+    }
+    armClientTimer(c);
+}
+
+/* Show the command line options and exit. */
+void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [options]\n", progname);
+    for (struct chatOption *o = ChatOptions; o->name; o++)
+        fprintf(stderr, "  %-26s %s (default %lld)\n",
+            o->name, o->help, *o->value);
+    for (struct chatStrOption *o = ChatStrOptions; o->name; o++)
+        fprintf(stderr, "  %-26s %s (default %s)\n",
+            o->name, o->help, *o->value ? *o->value : "none");
+    exit(1);
+}
+
+/* Parse the command line as a list of "--option value" pairs, storing
+ * the values in the global Config. */
+void parseOptions(int argc, char **argv) {
+    for (int j = 1; j < argc; j++) {
+        struct chatOption *o;
+
+        for (o = ChatOptions; o->name; o++)
+            if (!strcmp(argv[j], o->name)) break;
+        if (o->name == NULL) {
+            struct chatStrOption *so;
+            for (so = ChatStrOptions; so->name; so++)
+                if (!strcmp(argv[j], so->name)) break;
+            if (so->name == NULL || j+1 == argc) usage(argv[0]);
+            *so->value = argv[++j];
+            continue;
+        }
+        if (j+1 == argc) usage(argv[0]);
+
+        char *endptr;
+        long long val = strtoll(argv[++j], &endptr, 10);
+        if (*endptr != '\0' || val < o->min || val > o->max) {
+            fprintf(stderr, "Invalid value for %s: %s\n", o->name, argv[j]);
+            exit(1);
+        }
+        *o->value = val;
+    }
+
+    if (Config.outbuf_soft_limit > Config.outbuf_hard_limit ||
+        Config.outbuf_low_watermark > Config.outbuf_soft_limit)
+    {
+        fprintf(stderr, "Output limits must satisfy: "
+            "low watermark <= soft limit <= hard limit\n");
+        exit(1);
+    }
+    if (!Config.tls_cert != !Config.tls_key) {
+        fprintf(stderr, "--tls-cert and --tls-key go together\n");
+        exit(1);
+    }
+    if (Config.cluster_peers && Config.cluster_port == 0) {
+        fprintf(stderr, "--cluster-peers needs a --cluster-port\n");
+        exit(1);
+    }
+    if (Config.cluster_allow && Config.cluster_port == 0) {
+        fprintf(stderr, "--cluster-allow needs a --cluster-port\n");
+        exit(1);
+    }
+    if (log_level_from_name(Config.log_level) == -1) {
+        fprintf(stderr, "Unknown log level: %s\n", Config.log_level);
+        exit(1);
+    }
+}
+
+/* The loop of a worker:
+ * 1. Accept new clients connections if any.
+ * 2. Check if any client sent us some new message.
+ * 3. Send the message to all the other clients.
+ * The first two steps are handled by acceptHandler() and readFromClient(),
+ * called by the event loop only for the sockets that are actually ready.
+ * Clients with more messages than their turn allowed get another turn at
+ * the start of the next iteration, see handleClientsWithPendingInput(). */
+void *runWorker(void *arg) {
+    Chat = arg;
+
+    char name[16];
+    snprintf(name, sizeof(name), "W%d", Chat->id);
+    log_thread_init(name);
+
+    while(1) {
+        Chat->input_budget = Config.tick_budget;
+        handleClientsWithPendingInput();
+
+        /* No fixed timeout: the event loop wakes up for the next timer
+         * (keepalives, buffers shrinking, accept rate limit), if any.
+         * With input left to process it just polls. */
+        struct timeval poll = {0, 0};
+        if (elProcessEvents(Chat->el,
+                            Chat->clients_pending_input ? &poll : NULL) == -1)
+        {
+            perror("Event loop error");
+            exit(1);
+        }
+
+        /* Flush the output accumulated during this iteration, then
+         * release the clients that could not be freed while the event
+         * handlers were still using them. */
+        handleClientsWithPendingWrites();
+        if (Config.cluster_port && Chat->id == 0) handleClusterPeers();
+        freeClientsInAsyncFreeQueue();
+
+        if (__atomic_load_n(&Server.handoff_fd, __ATOMIC_SEQ_CST) != -1) {
+            if (Chat->id == 0)
+                handOff();
+            else
+                waitHandoff();
+        }
+    }
+
+    return NULL;
+}
+
+/* The main() function starts the workers: the main thread itself runs
+ * worker 0, every other one gets its own thread. */
+int main(int argc, char **argv) {
+    parseOptions(argc, argv);
+    if (log_init(STDOUT_FILENO, log_level_from_name(Config.log_level)) == -1) {
+        perror("Starting the logging thread");
+        exit(1);
+    }
+    log_thread_init("W0"); /* The main thread, that runs worker 0. */
+
+    /* Initialize the global state and the workers. */
+    initServer();
+    for (int j = 1; j < Server.numworkers; j++) {
+        struct chatState *w = Server.workers[j];
+        if (pthread_create(&w->thread, NULL, runWorker, w) != 0) {
+            perror("Creating worker thread");
+            exit(1);
+        }
+    }
+    Server.workers[0]->thread = pthread_self();
+    runWorker(Server.workers[0]);
+
+    return 0;
+}
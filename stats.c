@@ -0,0 +1,69 @@
+/*
+ * Statistics: counters and latency histograms.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#include "stats.h"
+
+/* Return the bucket counting the value 'v'. */
+int hist_index(long long v) {
+    if (v < 0) v = 0;
+    if (v < HIST_LINEAR) return v;
+
+    int bits = 63 - __builtin_clzll(v); /* bits > HIST_SUB_BITS */
+    if (bits >= HIST_MAX_BITS) return HIST_BUCKETS-1;
+    int sub = (v >> (bits-HIST_SUB_BITS)) & (HIST_SUB-1);
+    return HIST_LINEAR + (bits-HIST_SUB_BITS-1)*HIST_SUB + sub;
+}
+
+/* Return the highest value counted by the bucket 'idx'. */
+long long hist_bucket_max(int idx) {
+    if (idx < HIST_LINEAR) return idx;
+
+    int bits = (idx-HIST_LINEAR)/HIST_SUB + HIST_SUB_BITS+1;
+    int sub = (idx-HIST_LINEAR) % HIST_SUB;
+    long long base = (1LL << bits) | ((long long)sub << (bits-HIST_SUB_BITS));
+    return base + (1LL << (bits-HIST_SUB_BITS)) - 1;
+}
+
+/* Count the value 'v'. Only the thread owning the histogram can call
+ * this, see STAT_ADD(). */
+void hist_add(struct histogram *h, long long v) {
+    STAT_INC(h->buckets[hist_index(v)]);
+    STAT_INC(h->count);
+    STAT_ADD(h->sum, v);
+    if (v > h->max) STAT_SET(h->max, v);
+}
+
+/* Add the counts of 'src', that may be owned by another thread, to 'dst'.
+ * The count is recomputed from the buckets, so that it is consistent
+ * with them even if 'src' is being updated. */
+void hist_merge(struct histogram *dst, struct histogram *src) {
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+        unsigned long long n = STAT_GET(src->buckets[j]);
+        dst->buckets[j] += n;
+        dst->count += n;
+    }
+    dst->sum += STAT_GET(src->sum);
+    long long max = STAT_GET(src->max);
+    if (max > dst->max) dst->max = max;
+}
+
+/* Return the value under which the fraction 'p' of the values fall, 0
+ * if the histogram is empty. */
+long long hist_percentile(struct histogram *h, double p) {
+    if (h->count == 0) return 0;
+
+    unsigned long long rank = p * h->count, seen = 0;
+    if (rank >= h->count) rank = h->count-1;
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen > rank) {
+            long long v = hist_bucket_max(j);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,47 @@
+/*
+ * Statistics: counters and latency histograms.
+ *
+ * Copyright (c) 2025 vitoloper
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_CACHELINE 64
+
+/* Counters are written by a single thread, the one owning them, and read
+ * by any. Updates are a relaxed load and store, not an atomic increment:
+ * there is no other writer to race with, and on common CPUs this costs
+ * as much as a plain increment, without any locked instruction. Readers
+ * use relaxed loads, so values may be a few updates behind, but never
+ * torn. */
+#define STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STAT_SET(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#define STAT_ADD(var, n) STAT_SET(var, STAT_GET(var) + (n))
+#define STAT_INC(var) STAT_ADD(var, 1)
+
+/* Log-linear histogram, in the style of HdrHistogram: values under
+ * HIST_LINEAR have a bucket each, larger ones HIST_SUB buckets for every
+ * power of two, so a percentile is never off by more than 1/HIST_SUB
+ * (about 6%) whatever its magnitude. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_LINEAR (HIST_SUB*2)
+#define HIST_MAX_BITS 40    /* Larger values go in the last bucket. */
+#define HIST_BUCKETS (HIST_LINEAR + (HIST_MAX_BITS-HIST_SUB_BITS-1)*HIST_SUB)
+
+struct histogram {
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long count;
+    long long sum;  // Of all the values counted.
+    long long max;
+};
+
+int hist_index(long long v);
+long long hist_bucket_max(int idx);
+void hist_add(struct histogram *h, long long v);
+void hist_merge(struct histogram *dst, struct histogram *src);
+long long hist_percentile(struct histogram *h, double p);
+
+#endif // STATS_H